@@ -11,22 +11,75 @@
 #include "Logger.h"
 #include "DocSet.h"
 #include "DocPair.h"
+#include "KeyTableSegments.h"
+#include "KeyMapFile.h"
+#include "KeyMapRuns.h"
 #include "kgrams.h"
 #include "files.h"
+#include "pstats.h"
 #include <unistd.h> // for GNU getopt
+#include <sys/stat.h> // for mkdir()
+#include <errno.h>
 #include <fstream>
 #include <sstream>
 
 
 const string myname="docsim-analyze";
 
+
+// Scratch directory for the runs of a build with -a, created if need be
+//
+string runDirectory(string rangeId)
+{
+  string dir=prependPath(baseDir,"runs"+rangeId);
+  if (mkdir(dir.c_str(),0755)!=0 && errno!=EEXIST) {
+    cerr << myname << ": Error - can't create directory " << dir << " for runs" << endl;
+    exit(2);
+  }
+  return(dir);
+}
+
+
+// Drop table1 (keys appearing only once) from keytable then write the
+// shared keys (-w) and/or candidate overlapping documents (-c)
+//
+void writeSharedAndCandidates(KeyTable& keytable, string rangeId)
+{
+  keytable.dropTable1();
+  cout << myname << ": Dropped table1, KeyTable stats:" << endl;
+  keytable.writeStats(cout, VERY_VERBOSE, numThreads);
+
+  if (writeSharedKeys) {
+    // Write out the shared keys file which is just tables 2 and 3
+    string keytableBaseName2=prependPath(baseDir,"sharedkeys"+rangeId);
+    cout << myname << ": Writing KeyTable2 to " << keytableBaseName2 << endl;
+    int nf2=keytable.writeMultiFile(keytableBaseName2,false,MAX_FILE_SIZE,numThreads);
+    cout << myname << ": Finished writing KeyTable2 in " << nf2 << " files to files starting " << keytableBaseName2 << endl;
+  }
+    
+  if (compare) {
+    intv oids;
+    keytable.getOverlapIds(oids, 20, numThreads);
+    cout << myname << ": Got " << oids.size() << " document ids with overlap >=20" << endl;
+    DocPairVector dpv;
+    keytable.getOverlapDocs(dpv, oids, 20, numThreads);
+    string candidateFile=prependPath(baseDir,"candidate"+rangeId+".txt");
+    cout << myname << ": Writing overlapping (>=20 keys) docs to " << candidateFile << endl;
+    ofstream cdout;
+    cdout.open(candidateFile.c_str(),ios_base::out);
+    cdout << dpv;
+    cdout.close();
+  }
+}
+
+
 int main(int argc, char* argv[])
 {
   VERBOSE=0;
   VERY_VERBOSE=0;
   //
   // Read options using standard code for all of docsim programs
-  readOptions(argc, argv, "d:o:f:b:cr:ST:wx:X:", myname, "<filename1> is file containing a list of filenames of normalized txt files to read (relative to the data directory (-d)). Will write a KeyMap by default but a KeyTable if the -b option is specified to give the number of bits. If -T keyTableBase is given then this KeyTable will be read in before adding more documents. ");
+  readOptions(argc, argv, "a:d:e:o:f:g:b:cj:r:ST:u:wx:X:y:", myname, "<filename1> is file containing a list of filenames of normalized txt files to read (relative to the data directory (-d)). Will write a KeyMap by default (as both allkeys.txt and the binary allkeys.keymap) but a KeyTable if the -b option is specified to give the number of bits. If -T keyTableBase is given then this KeyTable will be read in before adding more documents, and any documents listed with -e deleted from it. With -y bits in KeyMap mode a first pass over the documents finds likely common kgrams so that they never enter the KeyMap. With -g segmentDir the documents are instead written as a new KeyTable segment in segmentDir, existing segments being merged meanwhile if there are enough of them. With -a MB the KeyMap or KeyTable is built in sorted runs of about that size which are written to the runs directory in baseDir and then merged, so memory use doesn't grow with the number of documents. ");
 
   // Read list of psv files to work with
   cout << myname << ": about to run " << myname << "...\n";
@@ -69,63 +122,143 @@ int main(int argc, char* argv[])
     diout.close();
   }
 
-  if (bitsInKeyTable>0) {
+  if (bitsInKeyTable>0 && segmentDir!="") {
+
+    // Add the documents as a new segment, the files of earlier segments
+    // are merged in the background while the new segment is built
+    cout << myname << ": Will add KeyTable segment using " << bitsInKeyTable << " bit keys in " << segmentDir << endl;
+    KeyTableSegments segs(bitsInKeyTable,segmentDir,numThreads,selectBits,selectMatch);
+    if ((U32)docs.size()>segs.deltaTable().MAX_DOCID) {
+      cerr << myname << ": Error - " << docs.size() << " documents won't fit in KeyTable with MAX_DOCID="
+           << segs.deltaTable().MAX_DOCID << ", rebuild with wider KEYTABLE_DOCID" << endl;
+      exit(2);
+    }
+    segs.setSaturateAbove(saturateAbove); // before the compaction thread starts
+    segs.readManifest();
+    segs.startCompaction();
+    docs.addToKeyTable(segs.deltaTable(), -1, cStart, cEnd);
+    string segment=segs.flushDelta();
+    segs.waitCompaction();
+    cout << myname << ": Added segment " << segment << ", now " << segs.segments.size() << " segments" << endl;
+
+  } else if (bitsInKeyTable>0 && memoryBudget>0) {
+
+    // Build KeyTable runs (segments in a scratch directory) of up to the
+    // memory budget and merge their files into the full set of KeyTable
+    // files. Only -w and -c need the whole KeyTable in memory, it is read
+    // back from the files for these.
+    if (keyTableBase!="" || deleteFile!="") {
+      cerr << myname << ": Error - can't start from a KeyTable (-T) or delete documents (-e) when building in runs (-a)" << endl;
+      exit(1);
+    }
+    cout << myname << ": Will create KeyTable using " << bitsInKeyTable << " bit keys in runs of up to " << memoryBudget << "MB" << endl;
+    KeyTableSegments runs(bitsInKeyTable, runDirectory(rangeId), numThreads, selectBits, selectMatch);
+    if ((U32)docs.size()>runs.deltaTable().MAX_DOCID) {
+      cerr << myname << ": Error - " << docs.size() << " documents won't fit in KeyTable with MAX_DOCID="
+           << runs.deltaTable().MAX_DOCID << ", rebuild with wider KEYTABLE_DOCID" << endl;
+      exit(2);
+    }
+    runs.setSaturateAbove(saturateAbove);
+    docs.addToKeyTableRuns(runs, (size_t)memoryBudget*1024*1024, (saturateAbove>0 ? saturateAbove : -1), cStart, cEnd);
+    string keytableBaseName=prependPath(baseDir,"allkeys"+rangeId);
+    cout << myname << ": Merging " << runs.segments.size() << " runs to KeyTable files starting " << keytableBaseName << endl;
+    int nf1=runs.writeMerged(keytableBaseName);
+    runs.removeAll();
+    cout << myname << ": Finished writing " << nf1 << " KeyTable to files starting " << keytableBaseName << endl;
+
+    if (writeSharedKeys || compare) {
+      KeyTable keytable(bitsInKeyTable);
+      keytable.readMultiFile(keytableBaseName);
+      writeSharedAndCandidates(keytable, rangeId);
+    }
+
+  } else if (bitsInKeyTable>0) {
 
     cout << myname << ": Will create KeyTable using " << bitsInKeyTable << " bit keys" << endl;
     KeyTable keytable(bitsInKeyTable,false,selectBits,selectMatch);
+    if ((U32)docs.size()>keytable.MAX_DOCID) {
+      cerr << myname << ": Error - " << docs.size() << " documents won't fit in KeyTable with MAX_DOCID="
+           << keytable.MAX_DOCID << ", rebuild with wider KEYTABLE_DOCID" << endl;
+      exit(2);
+    }
 
     // Was an existing keytable specified to start from?
     if (keyTableBase!="") {
       keytable.readMultiFile(keyTableBase);
     }
 
+    // Delete withdrawn or replaced documents (a replacement is added again
+    // as a new document with a new docid)
+    if (deleteFile!="") {
+      ifstream delin;
+      delin.open(deleteFile.c_str(),ios_base::in);
+      if (!delin.good()) {
+        cerr << myname << ": Error - can't read list of docids to delete from " << deleteFile << endl;
+        exit(2);
+      }
+      U32 did;
+      int numDeletes=0;
+      while (delin >> did) {
+        keytable.deleteDoc(did);
+        numDeletes++;
+      }
+      delin.close();
+      cout << myname << ": Deleting " << numDeletes << " documents listed in " << deleteFile << endl;
+      keytable.compact();
+    }
+
     // Add keys from the selected set of documents
-    docs.addToKeyTable(keytable, -1, cStart, cEnd);
+    docs.addToKeyTable(keytable, (saturateAbove>0 ? saturateAbove : -1), cStart, cEnd);
 
     // Write full set of KeyTable files
     ofstream ktout;
     string keytableBaseName=prependPath(baseDir,"allkeys"+rangeId);
     cout << myname << ": Writing KeyTable to files starting " << keytableBaseName << endl;
-    int nf1=keytable.writeMultiFile(keytableBaseName,true);
+    int nf1=keytable.writeMultiFile(keytableBaseName,true,MAX_FILE_SIZE,numThreads);
     cout << myname << ": Finished writing " << nf1 << " KeyTable to files starting " << keytableBaseName << endl;
 
-    if (writeSharedKeys || compare) {
-      // Drop table1 (keys appearing only once) and write again
-      keytable.dropTable1();
-      cout << myname << ": Dropped table1, KeyTable stats:" << endl;
-      keytable.writeStats(cout);
-    }
+    if (writeSharedKeys || compare) writeSharedAndCandidates(keytable, rangeId);
 
-    if (writeSharedKeys) {
-      // Write out the shared keys file which is just tables 2 and 3
-      string keytableBaseName2=prependPath(baseDir,"sharedkeys"+rangeId);
-      cout << myname << ": Writing KeyTable2 to " << keytableBaseName2 << endl;
-      int nf2=keytable.writeMultiFile(keytableBaseName2,false);
-      cout << myname << ": Finished writing KeyTable2 in " << nf2 << " files to files starting " << keytableBaseName2 << endl;
-    }
-    
-    if (compare) {
-      intv oids;
-      keytable.getOverlapIds(oids, 20);
-      cout << myname << ": Got " << oids.size() << " document ids with overlap >=20" << endl;
-      DocPairVector dpv;
-      keytable.getOverlapDocs(dpv, oids, 20);
-      string candidateFile=prependPath(baseDir,"candidate"+rangeId+".txt");
-      cout << myname << ": Writing overlapping (>=20 keys) docs to " << candidateFile << endl;
-      ofstream cdout;
-      cdout.open(candidateFile.c_str(),ios_base::out);
-      cdout << dpv;
-      cdout.close();
-    }
+  } else if (memoryBudget>0) {
+
+    // KeyMap built in sorted runs on disk which are then merged, allkeys
+    // comes out in key order
+    cout << myname << ": Will create KeyMap in runs of up to " << memoryBudget << "MB" << endl;
+    if (sketchBits>0) cout << myname << ": Not using sketch (-y) when building in runs" << endl;
+    KeyMapRuns runs(runDirectory(rangeId), (size_t)memoryBudget*1024*1024);
+    docs.getKeymapRuns(runs, (saturateAbove>0 ? saturateAbove : -1), true, cStart, cEnd, numThreads);
+    cout << myname << ": built runs, " << get_pstats_string() << endl;
+
+    string allkeysFile=prependPath(baseDir,"allkeys"+rangeId+".txt");
+    string allkeysBinFile=prependPath(baseDir,"allkeys"+rangeId+".keymap");
+    string commonkeysFile=prependPath(baseDir,"commonkeys"+rangeId+".txt");
+    ofstream akout;
+    akout.open(allkeysFile.c_str(),ios_base::out);
+    ofstream ckout;
+    ckout.open(commonkeysFile.c_str(),ios_base::out);
+    runs.merge(akout, allkeysBinFile, ckout, (saturateAbove>0 ? saturateAbove : -1), NUM_DUPES_TO_BE_COMMON);
+    akout.close();
+    ckout.close();
+    runs.removeAll();
+    cout << myname << ": merged runs, " << get_pstats_string() << endl;
+    cout << myname << ": written KeyMap to " << allkeysFile << " and " << allkeysBinFile << endl;
 
   } else { // use KeyMap
     KeyMap allkeys;
-    docs.getKeymap(allkeys, MAX_DUPES_TO_COUNT, true, cStart, cEnd);
-    cout << myname << ": built KeyMap, " << allkeys.size() << " keys\n";
-
     KeyMap commonkeys;
-    docs.stripCommon(allkeys, commonkeys, NUM_DUPES_TO_BE_COMMON);
-    cout << myname << ": stripped common, left " << allkeys.size() << " keys\n";
+    if (sketchBits>0) {
+      // Find likely common keys first and keep them out of allkeys
+      CountMinSketch sketch(sketchBits);
+      docs.sketchCommon(sketch, true, cStart, cEnd, numThreads);
+      docs.getKeymap(allkeys, (saturateAbove>0 ? saturateAbove : -1), true, cStart, cEnd, numThreads, &commonkeys, &sketch, NUM_DUPES_TO_BE_COMMON);
+      docs.restoreUncommon(commonkeys, allkeys, NUM_DUPES_TO_BE_COMMON);
+      cout << myname << ": built KeyMap without common, " << allkeys.size() << " keys\n";
+    } else {
+      docs.getKeymap(allkeys, (saturateAbove>0 ? saturateAbove : -1), true, cStart, cEnd, numThreads);
+      cout << myname << ": built KeyMap, " << allkeys.size() << " keys\n";
+      docs.stripCommon(allkeys, commonkeys, NUM_DUPES_TO_BE_COMMON);
+      cout << myname << ": stripped common, left " << allkeys.size() << " keys\n";
+    }
     cout << myname << ": got " << commonkeys.size() << " common keys\n";
 
     string allkeysFile=prependPath(baseDir,"allkeys"+rangeId+".txt");
@@ -133,6 +266,10 @@ int main(int argc, char* argv[])
     akout.open(allkeysFile.c_str(),ios_base::out);
     akout << allkeys;
     akout.close();
+    // and in binary for docsim-compare -m
+    string allkeysBinFile=prependPath(baseDir,"allkeys"+rangeId+".keymap");
+    KeyMapFile::write(allkeysBinFile,allkeys);
+    cout << myname << ": written KeyMap to " << allkeysFile << " and " << allkeysBinFile << endl;
 
     string commonkeysFile=prependPath(baseDir,"commonkeys"+rangeId+".txt");
     ofstream ckout;
@@ -10,6 +10,7 @@
 #include "Logger.h"
 #include "DocSet.h"
 #include "DocInfo.h"
+#include "KeyMapFile.h"
 #include "kgrams.h"
 #include "files.h"
 #include <fstream>
@@ -44,11 +45,30 @@ int main(int argc, char* argv[])
   // line options...
   //
   // At the end of this if block we will have shared keys between new doc and
-  // corpus in sharedkeys
+  // corpus in sharedkeys, or for a binary KeyMap the indexes of the shared
+  // keys in corpuskeys
   KeyMap sharedkeys;
+  KeyMapFile corpuskeys;
+  vector<U64> sharedIndexes;
+  bool useKeyMapFile=(keyMapFile!="" && KeyMapFile::isKeyMapFile(prependPath(baseDir,keyMapFile)));
   //
-  if (keyMapFile!="") {
-    // Load existsing KeyMap
+  if (useKeyMapFile) {
+    // Binary KeyMap, merge the sorted keys of the new doc with it in place
+    corpuskeys.open(prependPath(baseDir,keyMapFile));
+    cout << myname << ": mapped corpus KeyMap with " << (size_t)corpuskeys.numKeys << " keys." << endl;
+    if (corpuskeys.numKeys==0) {
+      cerr << myname << ": no keys in KeyMap, aborting" << endl;
+      exit(1);
+    }
+    kgramkeyv newsorted;
+    newsorted.reserve(newkeys.size());
+    for (KeyMap::iterator kit=newkeys.begin(); kit!=newkeys.end(); kit++) {
+      newsorted.push_back(kit->first);
+    }
+    sort(newsorted.begin(),newsorted.end());
+    corpuskeys.intersect(newsorted,sharedIndexes);
+  } else if (keyMapFile!="") {
+    // Load existsing ASCII KeyMap
     KeyMap allkeys;
     string fullKeyMapFile=prependPath(baseDir,keyMapFile);
     ifstream kin;
@@ -94,17 +114,25 @@ int main(int argc, char* argv[])
     exit(2);
   }
  
-  cout << myname << ": " << sharedkeys.size() << " keys from new doc appear in corpus\n";
+  cout << myname << ": " << (useKeyMapFile ? sharedIndexes.size() : sharedkeys.size()) << " keys from new doc appear in corpus\n";
 
   string sharedkeysFile=prependPath(baseDir,"sharedkeys.txt");
   ofstream sout;
   sout.open(sharedkeysFile.c_str(),ios_base::out);
-  sout << sharedkeys;
+  if (useKeyMapFile) {
+    corpuskeys.writeKeys(sout,sharedIndexes);
+  } else {
+    sout << sharedkeys;
+  }
   sout.close();
   cout << myname << ": written shared keys KeyMap to " << sharedkeysFile << endl;
 
   DocPairVector dpv;
-  sharedkeys.getCommonDocs(dpv, keysForMatch);
+  if (useKeyMapFile) {
+    corpuskeys.getCommonDocs(sharedIndexes, dpv, keysForMatch);
+  } else {
+    sharedkeys.getCommonDocs(dpv, keysForMatch);
+  }
   string candidateFile=prependPath(baseDir,"candidates.dpv");
   cout << myname << ": Writing " << dpv.size() << " overlapping (>=" << keysForMatch << " keys) docs to " << candidateFile << endl;
   ofstream cdout;
@@ -25,7 +25,7 @@ int main(int argc, char* argv[])
   VERY_VERBOSE=0;
   //
   // Read options using standard code for all of docsim programs
-  int next_arg=readOptions(argc, argv, "d:o:f:b:cr:T:x:X:", myname, "<filename1> is file containing a list of filenames of normalized txt files to read (relative to the data directory (-d)). The number of bits in the KeyTable must be specified with the -b option. If -T keyTableBase is given then this KeyTable will be read in before adding more documents. ");
+  int next_arg=readOptions(argc, argv, "d:o:f:b:cj:r:T:u:x:X:", myname, "<filename1> is file containing a list of filenames of normalized txt files to read (relative to the data directory (-d)). The number of bits in the KeyTable must be specified with the -b option. If -T keyTableBase is given then this KeyTable will be read in before adding more documents. ");
 
   // Read list of psv files to work with
   cout << myname << ": about to run " << myname << "...\n";
@@ -37,6 +37,7 @@ int main(int argc, char* argv[])
   KeyTable keytable(bitsInKeyTable);
 
   keytable.setPruneAbove(10);
+  keytable.setSaturateAbove(saturateAbove);
   for (;next_arg<argc; next_arg++) {
     string ktFile = prependPath(baseDir,argv[next_arg]);
     cout << "Reading KeyTable '" << ktFile << "'" << endl;
@@ -53,7 +54,7 @@ int main(int argc, char* argv[])
   ofstream ktout;
   string keytableBaseName=prependPath(baseDir,"allkeys_concat");
   cout << myname << ": Writing KeyTable to files starting " << keytableBaseName << endl;
-  int nf1=keytable.writeMultiFile(keytableBaseName,true);
+  int nf1=keytable.writeMultiFile(keytableBaseName,true,MAX_FILE_SIZE,numThreads);
   cout << myname << ": Finished writing " << nf1 << " KeyTable to files starting " << keytableBaseName << endl;
 
   // Drop table1 (keys appearing only once) and write again
@@ -63,7 +64,7 @@ int main(int argc, char* argv[])
   
   string keytableBaseName2=prependPath(baseDir,"sharedkeys_concat");
   cout << myname << ": Writing KeyTable2 to " << keytableBaseName2 << endl;
-  int nf2=keytable.writeMultiFile(keytableBaseName2,false);
+  int nf2=keytable.writeMultiFile(keytableBaseName2,false,MAX_FILE_SIZE,numThreads);
   cout << myname << ": Finished writing KeyTable2 in " << nf2 << " files to files starting " << keytableBaseName2 << endl;
 
   return 0;
@@ -0,0 +1,80 @@
+// Count-Min sketch of kgram counts, see CountMinSketch.h
+
+#include "CountMinSketch.h"
+#include <stdlib.h>  // for exit()
+
+
+CountMinSketch::CountMinSketch(int b)
+{
+  if (b<1 || b>32) {
+    cerr << "CountMinSketch::CountMinSketch: bad number of bits " << b << ", must be 1..32" << endl;
+    exit(1);
+  }
+  bits=b;
+  mask=((size_t)1<<bits)-1;
+  counts.assign(((size_t)CMS_DEPTH)<<bits,0);
+}
+
+
+// Index in counts of the cell for key in each row. Row hashes are
+// h1+i*h2 from two 64-bit mixes of the key (Kirsch-Mitzenmacher).
+//
+void CountMinSketch::cells(kgramkey key, size_t* c)
+{
+  U64 h=key;
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  h*=0xc4ceb9fe1a85ec53ULL;
+  h^=h>>33;
+  U64 h2=(h*0x9e3779b97f4a7c15ULL)|1;
+  for (int i=0; i<CMS_DEPTH; i++) {
+    c[i]=(((size_t)i)<<bits)+(size_t)((h+i*h2)&mask);
+  }
+}
+
+
+// Count one more occurrence of key. Conservative update: only the
+// smallest counters for key are incremented.
+//
+void CountMinSketch::add(kgramkey key)
+{
+  size_t c[CMS_DEPTH];
+  cells(key,c);
+  U8 min=CMS_MAX;
+  for (int i=0; i<CMS_DEPTH; i++) {
+    if (counts[c[i]]<min) min=counts[c[i]];
+  }
+  if (min==CMS_MAX) return;
+  for (int i=0; i<CMS_DEPTH; i++) {
+    if (counts[c[i]]==min) counts[c[i]]=min+1;
+  }
+}
+
+
+int CountMinSketch::estimate(kgramkey key)
+{
+  size_t c[CMS_DEPTH];
+  cells(key,c);
+  int min=CMS_MAX;
+  for (int i=0; i<CMS_DEPTH; i++) {
+    if (counts[c[i]]<min) min=counts[c[i]];
+  }
+  return(min);
+}
+
+
+// Add counts from other (same size) sketch, as for counting the union of
+// the data in both. Estimates stay no less than true counts.
+//
+void CountMinSketch::merge(CountMinSketch& other)
+{
+  if (other.bits!=bits) {
+    cerr << "CountMinSketch::merge: can't merge sketches of " << bits << " and " << other.bits << " bits" << endl;
+    exit(1);
+  }
+  for (size_t j=0; j<counts.size(); j++) {
+    int sum=counts[j]+other.counts[j];
+    counts[j]=(U8)(sum<CMS_MAX ? sum : CMS_MAX);
+  }
+}
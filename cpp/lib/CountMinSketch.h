@@ -0,0 +1,37 @@
+// Count-Min sketch with conservative update, used to find common kgrams
+// (those in many documents) in a pre-pass over a document set so that
+// they can be kept out of the main KeyMap, see DocSet::sketchCommon().
+//
+// There are CMS_DEPTH rows of 2^bits 8-bit counters that stop at CMS_MAX.
+// The estimate for a key is never less than its true count (or CMS_MAX),
+// so a key with an estimate below a threshold is certainly below it. Keys
+// at or above a threshold may be false positives and must be checked.
+
+#ifndef __INC_CountMinSketch
+#define __INC_CountMinSketch 1
+
+#include "definitions.h"
+
+#define CMS_DEPTH 4
+#define CMS_MAX 255
+
+class CountMinSketch
+{
+public:
+  // DATA
+  int bits;           // log2 of counters per row
+  vector<U8> counts;  // CMS_DEPTH rows of 2^bits counters
+
+  // METHODS
+  CountMinSketch(int bits);
+  void add(kgramkey key);
+  int estimate(kgramkey key);
+  void merge(CountMinSketch& other);
+  size_t sizeInBytes(void) { return(counts.size()); }
+
+private:
+  size_t mask;
+  void cells(kgramkey key, size_t* c);
+};
+
+#endif /* #ifndef __INC_CountMinSketch */
@@ -0,0 +1,83 @@
+// Sparse per-docid counts, see DocCounter.h
+
+#include "DocCounter.h"
+#include <pthread.h>
+
+
+DocCounter::DocCounter(void)
+{
+  generation=1;
+}
+
+
+// Forget all counts, O(1) except when the generation wraps
+//
+void DocCounter::clear(void)
+{
+  touched.clear();
+  generation++;
+  if (generation==0) {
+    for (size_t j=0; j<entries.size(); j++) entries[j].stamp=0;
+    generation=1;
+  }
+}
+
+
+// Make room for docid id, at least doubling so that growth is rare
+//
+void DocCounter::grow(docid id)
+{
+  size_t newSize=entries.size()*2;
+  if (newSize<(size_t)id+1) newSize=(size_t)id+1;
+  Entry e;
+  e.stamp=0;
+  e.count=0;
+  entries.resize(newSize,e);
+}
+
+
+// Add a DocPair (docid,id2,count) to dpv for each docid counted more
+// than n times, in decreasing order of count (then increasing docid)
+//
+void DocCounter::getCommonDocs(DocPairVector& dpv, int n, docid id2)
+{
+  size_t first=dpv.size();
+  for (size_t j=0; j<touched.size(); j++) {
+    if (entries[touched[j]].count>n) {
+      DocPair dp(touched[j],id2,entries[touched[j]].count);
+      dpv.push_back(dp);
+    }
+  }
+  sortBySharedKeys(dpv.begin()+first,dpv.end());
+}
+
+
+// Each thread's counter is also held under this key so that it is
+// deleted when the thread exits
+//
+static pthread_key_t counterKey;
+static pthread_once_t counterKeyOnce=PTHREAD_ONCE_INIT;
+
+static void deleteCounter(void* counter)
+{
+  delete (DocCounter*)counter;
+}
+
+static void makeCounterKey(void)
+{
+  pthread_key_create(&counterKey,deleteCounter);
+}
+
+
+// Counter for the calling thread, created on first use
+//
+DocCounter& DocCounter::forThread(void)
+{
+  static __thread DocCounter* counter=(DocCounter*)NULL;
+  if (counter==(DocCounter*)NULL) {
+    counter=new DocCounter();
+    pthread_once(&counterKeyOnce,makeCounterKey);
+    pthread_setspecific(counterKey,counter);
+  }
+  return(*counter);
+}
@@ -0,0 +1,55 @@
+// Sparse accumulator of per-docid counts, used by the getCommonDocs
+// methods to count how many query keys each document shares.
+//
+// Counts are kept in an array indexed by docid that is reused from one
+// query to the next. Each entry records the generation it was last set
+// in, so clear() just starts a new generation and old entries read as
+// zero. The docids counted in the current generation are listed so that
+// collecting results costs in proportion to the postings touched, not
+// to the size of the corpus.
+//
+// forThread() gives each thread its own counter to reuse, deleted when
+// the thread exits.
+
+#ifndef __INC_DocCounter
+#define __INC_DocCounter 1
+
+#include "definitions.h"
+#include "DocPair.h"
+
+class DocCounter
+{
+public:
+  // METHODS
+  DocCounter(void);
+  void clear(void);
+  int count(docid id) { return((id<entries.size() && entries[id].stamp==generation) ? entries[id].count : 0); }
+  size_t size(void) { return(touched.size()); }
+  void getCommonDocs(DocPairVector& dpv, int n, docid id2);
+  static DocCounter& forThread(void);
+
+  // Add count to the total for docid id
+  void add(docid id, int count=1)
+  {
+    if (id>=entries.size()) grow(id);
+    Entry& e=entries[id];
+    if (e.stamp!=generation) {
+      e.stamp=generation;
+      e.count=0;
+      touched.push_back(id);
+    }
+    e.count+=count;
+  }
+
+private:
+  struct Entry {
+    U32 stamp;  // generation in which count was set
+    int count;
+  };
+  vector<Entry> entries;   // indexed by docid
+  vector<docid> touched;   // docids counted in this generation
+  U32 generation;
+  void grow(docid id);
+};
+
+#endif /* #ifndef __INC_DocCounter */
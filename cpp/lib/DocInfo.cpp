@@ -26,10 +26,10 @@ DocInfo::~DocInfo(void)
 // Open file for this document and then call routine to read and
 // add keys to map
 //
-void DocInfo::addToKeymap(keymap& keys, int maxDupesToCount, bool winnow)
+void DocInfo::addToKeymap(keymap& keys, int maxDupesToCount, bool winnow, keymap* common, CountMinSketch* sketch, int numDupesToBeCommon)
 {
   istream* fin=open_plain_or_gz_file(filename);
-  addToKeymap(*fin,keys,maxDupesToCount,winnow);
+  addToKeymap(*fin,keys,maxDupesToCount,winnow,common,sketch,numDupesToBeCommon);
   delete(fin);
 }
 
@@ -37,9 +37,13 @@ void DocInfo::addToKeymap(keymap& keys, int maxDupesToCount, bool winnow)
 // Read doc from file and process each line adding all winnowed 
 // kgram keys to the keymap keys (with the docid) 
 //
+// If common and sketch are given then keys with a sketch estimate of at
+// least numDupesToBeCommon documents go into common instead of keys (see
+// DocSet::sketchCommon)
+//
 // Extra code inserted if DOCUMENT_STATS set
 //
-void DocInfo::addToKeymap(istream& in, keymap& keys, int maxDupesToCount, bool winnow)
+void DocInfo::addToKeymap(istream& in, keymap& allkeys, int maxDupesToCount, bool winnow, keymap* common, CountMinSketch* sketch, int numDupesToBeCommon)
 {
 #ifdef DOCUMENT_STATS
   int linesInDoc=0;
@@ -60,13 +64,14 @@ void DocInfo::addToKeymap(istream& in, keymap& keys, int maxDupesToCount, bool w
 #ifdef DOCUMENT_STATS
         kgramsInDoc++;
 #else
+        keymap& keys=((sketch!=(CountMinSketch*)NULL && sketch->estimate(*k)>=numDupesToBeCommon) ? *common : allkeys);
         keymap::iterator kit = keys.find(*k);
         if (kit==keys.end()) {
           // create new entry with just current docid
-          keys.insert(keymap::value_type(*k,new KgramInfo(id)));
+          keys.insert(keymap::value_type(*k,new(keys.arena) KgramInfo(id)));
         } else {
           // get pointer to docidhashset and add extra element if size()<maxDupesToCount
-          kit->second->addOccurrence(id,maxDupesToCount);
+          kit->second->addOccurrence(id,maxDupesToCount,&keys.arena);
         }
 #endif
       }
@@ -102,11 +107,37 @@ void DocInfo::addToKeymap(istream& in, keymap& keys, int maxDupesToCount, bool w
 
 
 
+// Read doc from file and count each distinct winnowed kgram key once
+// in sketch, so that the sketch estimates the number of documents each
+// key is in
+//
+void DocInfo::addToSketch(CountMinSketch& sketch, bool winnow)
+{
+  istream* fin=open_plain_or_gz_file(filename);
+  kgramkeyv keys;
+  char* buf;
+  kgramkey* kgrams;
+  while ((buf=readLine(*fin))!=(char*)NULL) {
+    kgrams = getKgrams(buf,winnow);
+    if (kgrams!=(kgramkey*)NULL) {
+      for (kgramkey* k=kgrams; *k!=0; k++) keys.push_back(*k);
+    }
+  }
+  delete(fin);
+  sort(keys.begin(),keys.end());
+  kgramkeyv::iterator end=unique(keys.begin(),keys.end());
+  for (kgramkeyv::iterator k=keys.begin(); k!=end; k++) sketch.add(*k);
+}
+
+
 // Read doc from file and process each line adding all winnowed 
 // kgram keys to the KeyTable (with the docid) 
 //
 // Extra code inserted if DOCUMENT_STATS set
 //
+// maxDupesToCount is applied by the KeyTable itself, see
+// DocSet::addToKeyTable()
+//
 void DocInfo::addToKeyTable(KeyTable& kt, int maxDupesToCount)
 {
   istream* fin=open_plain_or_gz_file(filename);
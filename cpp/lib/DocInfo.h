@@ -8,6 +8,7 @@
 #include "KgramInfo.h"
 #include "KeyTable.h"
 #include "MarkedDoc.h"
+#include "CountMinSketch.h"
 
 class DocInfo
 {
@@ -21,8 +22,9 @@ public:
   ~DocInfo(void);
 
   // building and using keymaps
-  void addToKeymap(keymap& keys, int maxDupesToCount=-1, bool winnow=true);
-  void addToKeymap(istream& in, keymap& keys, int maxDupesToCount=-1, bool winnow=true);
+  void addToKeymap(keymap& keys, int maxDupesToCount=-1, bool winnow=true, keymap* common=(keymap*)NULL, CountMinSketch* sketch=(CountMinSketch*)NULL, int numDupesToBeCommon=0);
+  void addToKeymap(istream& in, keymap& keys, int maxDupesToCount=-1, bool winnow=true, keymap* common=(keymap*)NULL, CountMinSketch* sketch=(CountMinSketch*)NULL, int numDupesToBeCommon=0);
+  void addToSketch(CountMinSketch& sketch, bool winnow=true);
   char* findKgramInDoc(kgramkey key, int bits=0);
   void markupDoc(ostream& out, keyhashset& keys);
   void markupCompleteDoc(MarkedDoc& mud, keyhashset& keys);
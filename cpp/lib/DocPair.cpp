@@ -6,6 +6,7 @@
 #include "definitions.h"
 #include "DocPair.h"
 #include <fstream>
+#include <algorithm>  // for sort()
 
 
 DocPair::DocPair(docid i1, docid i2, int sk)
@@ -27,6 +28,21 @@ ostream& operator<<(ostream& out, DocPair& dp)
 }
 
 
+// Order by decreasing sharedKeys, then increasing id1
+//
+static bool moreSharedKeys(const DocPair& a, const DocPair& b)
+{
+  if (a.sharedKeys!=b.sharedKeys) return(a.sharedKeys>b.sharedKeys);
+  return(a.id1<b.id1);
+}
+
+
+void sortBySharedKeys(DocPairVector::iterator first, DocPairVector::iterator last)
+{
+  sort(first,last,moreSharedKeys);
+}
+
+
 ostream& operator<<(ostream& out, DocPairVector& dpv)
 {
   for (DocPairVector::iterator it=dpv.begin(); it<dpv.end(); ++it) {
@@ -28,5 +28,6 @@ public:
 
 typedef vector<DocPair> DocPairVector;
 ostream& operator<<(ostream& out, DocPairVector& k);
+void sortBySharedKeys(DocPairVector::iterator first, DocPairVector::iterator last);
 
 #endif /* #ifndef __INC_DocPair  */
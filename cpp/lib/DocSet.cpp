@@ -7,6 +7,8 @@
 #include "options.h"
 #include "files.h"
 #include "DocSet.h"
+#include "kgrams.h"
+#include "parallel.h"
 #include <fstream>
 
 DocSet::DocSet(void)
@@ -87,27 +89,190 @@ docid DocSet::addFile(const string psvFile, const string dataDir)
 //-------------------------------------------------------------------------
 
 
-void DocSet::getKeymap(keymap& allkeys, int maxKeysToCount, bool winnow, int startFile, int endFile) {
-  int i=0;	//number of documents in list
-  int inc=0;	//number of documents included
-  for (DocInfoVector::iterator docit=docv.begin();docit!=docv.end();docit++) {
-    i++;
-    if (((startFile<0) || (i>=startFile)) && ((endFile<0) || (i<=endFile))) {
-      inc++;
-      docit->addToKeymap(allkeys, maxKeysToCount, winnow);
-      if (VERY_VERBOSE) cout << "DocSet::getKeymap[" << i << "]: " << docit->filename << " (vv)" <<endl;
-      if (i%100==0) cout << "DocSet::getKeymap[" << i << "]: " << docit->filename << endl;
+// Range [first,last) of docv for startFile and endFile as used
+// by getKeymap
+//
+static void fileRange(size_t n, int startFile, int endFile, size_t& first, size_t& last)
+{
+  first=(startFile>0 ? startFile-1 : 0);
+  last=((endFile>=0 && (size_t)endFile<n) ? endFile : n);
+  if (first>last) first=last;
+}
+
+
+// Merge keymap part, for documents after all of those in allkeys, into
+// allkeys. part is left empty.
+//
+static void mergeKeymap(keymap& allkeys, keymap& part, int maxKeysToCount)
+{
+  if (allkeys.empty()) {
+    allkeys.swap(part);
+    return;
+  }
+  allkeys.reserve(allkeys.size()+part.size());
+  for (keymap::iterator kit=part.begin(); kit!=part.end(); kit++) {
+    keymap::iterator ait=allkeys.find(kit->first);
+    if (ait==allkeys.end()) {
+      // KgramInfo moves to allkeys with part's arena below
+      allkeys.insert(*kit);
+    } else {
+      ait->second->merge(kit->second, maxKeysToCount, &allkeys.arena);
     }
-  }	
+  }
+  allkeys.arena.adopt(part.arena);
+  part.clear();
+}
+
+
+// Work for one thread of getKeymap or sketchCommon, documents [start,end)
+// of docv
+struct KeymapWork {
+  DocSet* docs;
+  size_t start;
+  size_t end;
+  int maxKeysToCount;
+  bool winnow;
+  keymap* keys;
+  keymap* common;          // if sketch, for likely common keys
+  CountMinSketch* sketch;
+  int numDupesToBeCommon;
+};
+
+static void* keymapThread(void* arg)
+{
+  KeymapWork* w=(KeymapWork*)arg;
+  for (size_t j=w->start; j<w->end; j++) {
+    w->docs->docv[j].addToKeymap(*w->keys, w->maxKeysToCount, w->winnow, w->common, w->sketch, w->numDupesToBeCommon);
+    if (VERY_VERBOSE) cout << "DocSet::getKeymap[" << (j+1) << "]: " << w->docs->docv[j].filename << " (vv)" <<endl;
+  }
+  freeLineBuffer();
+  freeKgramBuffers();
+  return(NULL);
+}
+
+static void* sketchThread(void* arg)
+{
+  KeymapWork* w=(KeymapWork*)arg;
+  for (size_t j=w->start; j<w->end; j++) {
+    w->docs->docv[j].addToSketch(*w->sketch, w->winnow);
+  }
+  freeLineBuffer();
+  freeKgramBuffers();
+  return(NULL);
+}
+
+
+// Add kgram keys from all documents, or only those between startFile
+// and endFile (if these params>=0, counted from 1), to allkeys.
+//
+// With threads>1 the documents are split into that many consecutive
+// ranges and each thread builds a keymap for its range. These are then
+// merged into allkeys in range order so that each docid list stays in
+// increasing order, as KgramInfo requires.
+//
+// If common and sketch are given then keys that sketch estimates to be in
+// at least numDupesToBeCommon documents are put in common instead, see
+// sketchCommon().
+//
+void DocSet::getKeymap(keymap& allkeys, int maxKeysToCount, bool winnow, int startFile, int endFile, int threads, keymap* common, CountMinSketch* sketch, int numDupesToBeCommon) {
+  size_t first,last;
+  fileRange(docv.size(),startFile,endFile,first,last);
+  size_t inc=last-first;	//number of documents included
+  if (threads>1 && inc<(size_t)threads*2) threads=1;
+  if (threads<=1) {
+    for (size_t j=first; j<last; j++) {
+      docv[j].addToKeymap(allkeys, maxKeysToCount, winnow, common, sketch, numDupesToBeCommon);
+      if (VERY_VERBOSE) cout << "DocSet::getKeymap[" << (j+1) << "]: " << docv[j].filename << " (vv)" <<endl;
+      if ((j+1)%100==0) cout << "DocSet::getKeymap[" << (j+1) << "]: " << docv[j].filename << endl;
+    }
+  } else {
+    vector<KeymapWork> work(threads);
+    for (int t=0; t<threads; t++) {
+      splitRange(inc,threads,t,work[t].start,work[t].end);
+      work[t].start+=first;
+      work[t].end+=first;
+      work[t].docs=this;
+      work[t].maxKeysToCount=maxKeysToCount;
+      work[t].winnow=winnow;
+      work[t].keys=new keymap();
+      work[t].common=(sketch!=(CountMinSketch*)NULL ? new keymap() : (keymap*)NULL);
+      work[t].sketch=sketch;
+      work[t].numDupesToBeCommon=numDupesToBeCommon;
+    }
+    runThreads(work,keymapThread);
+    cout << "DocSet::getKeymap: read " << inc << " files on " << threads << " threads, merging" << endl;
+    for (int t=0; t<threads; t++) {
+      mergeKeymap(allkeys,*work[t].keys,maxKeysToCount);
+      delete work[t].keys;
+      if (work[t].common!=(keymap*)NULL) {
+        mergeKeymap(*common,*work[t].common,maxKeysToCount);
+        delete work[t].common;
+      }
+      if (VERBOSE) cout << "DocSet::getKeymap: merged range " << t << ", " << allkeys.size() << " keys" << endl;
+    }
+  }
   if (VERBOSE) cout << "DocSet::getKeymap: read " << inc << " files, got " << allkeys.size() << " keys " << endl;
 }
 
 
+// As getKeymap but for a KeyMap that may not fit in memory: documents are
+// added in batches of KEYMAP_RUN_BATCH per thread and the keymap is written
+// out as a run whenever it reaches the size limit of runs. Merge the runs
+// with KeyMapRuns::merge().
+//
+void DocSet::getKeymapRuns(KeyMapRuns& runs, int maxKeysToCount, bool winnow, int startFile, int endFile, int threads) {
+  size_t first,last;
+  fileRange(docv.size(),startFile,endFile,first,last);
+  size_t batch=KEYMAP_RUN_BATCH*(threads>1 ? threads : 1);
+  keymap km;
+  for (size_t j=first; j<last; j+=batch) {
+    size_t end=(j+batch<last ? j+batch : last);
+    getKeymap(km, maxKeysToCount, winnow, (int)j+1, (int)end, threads);
+    if (runs.full(km)) runs.flush(km);
+  }
+  runs.flush(km);
+  cout << "DocSet::getKeymapRuns: read " << (last-first) << " files into " << runs.runs.size() << " runs" << endl;
+}
+
+
+// Pre-pass over the same documents as getKeymap that counts each
+// distinct key once per document in sketch. Keys with an estimate below
+// numDupesToBeCommon are certainly not common, so getKeymap with this
+// sketch keeps common keys out of allkeys as they are found rather than
+// stripCommon removing them after the whole KeyMap is built. Use
+// restoreUncommon after getKeymap to move back the false positives.
+//
+void DocSet::sketchCommon(CountMinSketch& sketch, bool winnow, int startFile, int endFile, int threads)
+{
+  size_t first,last;
+  fileRange(docv.size(),startFile,endFile,first,last);
+  size_t inc=last-first;
+  if (threads>1 && inc<(size_t)threads*2) threads=1;
+  vector<KeymapWork> work(threads);
+  vector<CountMinSketch*> sketches(threads);
+  for (int t=0; t<threads; t++) {
+    splitRange(inc,threads,t,work[t].start,work[t].end);
+    work[t].start+=first;
+    work[t].end+=first;
+    work[t].docs=this;
+    work[t].winnow=winnow;
+    sketches[t]=(t==0 ? &sketch : new CountMinSketch(sketch.bits));
+    work[t].sketch=sketches[t];
+  }
+  runThreads(work,sketchThread);
+  for (int t=1; t<threads; t++) {
+    sketch.merge(*sketches[t]);
+    delete sketches[t];
+  }
+  cout << "DocSet::sketchCommon: counted " << inc << " files in " << sketch.sizeInBytes() << " byte sketch" << endl;
+}
+
+
 void DocSet::stripCommon(keymap& allkeys, keymap& common, int numDupesToBeCommon)
 {
   //cout << "DocSet::stripCommon: staring work on " << allkeys.size() << " keys" << endl;
   for (keymap::iterator kit = allkeys.begin(); kit != allkeys.end(); kit++) {
-    if (kit->second->size() >= numDupesToBeCommon) {
+    if (kit->second->numDocs() >= numDupesToBeCommon) {
       common.insert(keymap::value_type(kit->first,kit->second));
     }
   } //for over keys
@@ -116,12 +281,31 @@ void DocSet::stripCommon(keymap& allkeys, keymap& common, int numDupesToBeCommon
   // (if we stupidly try to do this in the loop above it gets very messy!)
   //
   for (keymap::iterator kit = common.begin(); kit != common.end(); kit++) {
-    //FIXME - do we need to explicitily delete the KgramInfo? *(kit->second)~;
+    // KgramInfo stays in the allkeys arena so common must not outlive allkeys
     allkeys.erase(kit->first);
   }
 }
 
 
+// Move keys in common that are in fewer than numDupesToBeCommon documents
+// (sketch false positives) to keys
+//
+void DocSet::restoreUncommon(keymap& common, keymap& keys, int numDupesToBeCommon)
+{
+  kgramkeyv moved;
+  for (keymap::iterator kit = common.begin(); kit != common.end(); kit++) {
+    if (kit->second->numDocs() < numDupesToBeCommon) {
+      keys.insert(keymap::value_type(kit->first,new(keys.arena) KgramInfo(kit->second,&keys.arena)));
+      moved.push_back(kit->first);
+    }
+  }
+  for (kgramkeyv::iterator k=moved.begin(); k!=moved.end(); k++) {
+    common.erase(*k);
+  }
+  if (VERBOSE) cout << "DocSet::restoreUncommon: moved back " << moved.size() << " keys, " << common.size() << " common keys" << endl;
+}
+
+
 //-------------------------------------------------------------------------
 // KeyTable methods
 //-------------------------------------------------------------------------
@@ -130,10 +314,12 @@ void DocSet::stripCommon(keymap& allkeys, keymap& common, int numDupesToBeCommon
 // and endFile (if these params>=0), and add short kgram keys to the keytable
 // passed in.
 //
-// maxKeysToCount currently ignored [FIXME/Simeon/2005-08-03]
+// If maxKeysToCount>0 then the docid list for any short key found in more
+// than maxKeysToCount documents is saturated (see KeyTable::setSaturateAbove)
 // 
 void DocSet::addToKeyTable(KeyTable& kt, int maxKeysToCount, int startFile, int endFile) {
   int i=0;	//number of documents in list
+  if (maxKeysToCount>0) kt.setSaturateAbove(maxKeysToCount);
   for (DocInfoVector::iterator docit=docv.begin();docit!=docv.end();docit++) {
     i++;
     if (((startFile<0) || (i>=startFile)) && ((endFile<0) || (i<=endFile))) {
@@ -153,6 +339,40 @@ void DocSet::addToKeyTable(KeyTable& kt, int maxKeysToCount, int startFile, int
 }
 
 
+// As addToKeyTable but for a KeyTable that may not fit in memory: keys are
+// added to the delta KeyTable of runs, which is written out as a new
+// segment (a sorted run) whenever it uses maxBytes. Merge the runs with
+// KeyTableSegments::writeMerged().
+//
+void DocSet::addToKeyTableRuns(KeyTableSegments& runs, size_t maxBytes, int maxKeysToCount, int startFile, int endFile) {
+  size_t first,last;
+  fileRange(docv.size(),startFile,endFile,first,last);
+  size_t emptyBytes=runs.deltaTable().memoryBytes();
+  if (emptyBytes>=maxBytes) {
+    cerr << "DocSet::addToKeyTableRuns: Error - memory limit of " << maxBytes << " bytes is less than the "
+         << emptyBytes << " bytes of an empty KeyTable, aborting!" << endl;
+    exit(1);
+  }
+  for (size_t j=first; j<last; j++) {
+    if (runs.delta==(KeyTable*)NULL && maxKeysToCount>0) runs.deltaTable().setSaturateAbove(maxKeysToCount);
+    KeyTable& kt=runs.deltaTable();
+    docv[j].addToKeyTable(kt, maxKeysToCount);
+    if (VERY_VERBOSE) {
+      cout << "DocSet::addToKeyTableRuns[" << (j+1) << "]: " << docv[j].filename << " (vv)" <<endl;
+    } else if ((j+1)%10000==0) {
+      cout << "DocSet::addToKeyTableRuns[" << (j+1) << "]: " << docv[j].filename << endl;
+    }
+    if (kt.memoryBytes()>=maxBytes) {
+      kt.writeStats(cout);
+      runs.flushDelta();
+    }
+  }
+  if (runs.delta!=(KeyTable*)NULL) runs.delta->writeStats(cout);
+  runs.flushDelta();
+  cout << "DocSet::addToKeyTableRuns: read " << (last-first) << " files into " << runs.segments.size() << " runs" << endl;
+}
+
+
 //-------------------------------------------------------------------------
 // Utility methods
 //-------------------------------------------------------------------------
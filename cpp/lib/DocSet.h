@@ -7,6 +7,12 @@
 #include "definitions.h"
 #include "KeyTable.h"
 #include "DocInfo.h"
+#include "KeyTableSegments.h"
+#include "KeyMapRuns.h"
+
+// Documents added to a keymap between checks of its size in getKeymapRuns()
+// (for each thread)
+#define KEYMAP_RUN_BATCH 16
 
 typedef vector<DocInfo> DocInfoVector;
 
@@ -25,11 +31,15 @@ public:
   int size() { return (int)docv.size(); }
 
   // Methods for dealing with a keymap 
-  void getKeymap(keymap& allkeys, int maxKeysToCount, bool winnow=true, int startFile=-1, int endFile=-1);
+  void getKeymap(keymap& allkeys, int maxKeysToCount, bool winnow=true, int startFile=-1, int endFile=-1, int threads=1, keymap* common=(keymap*)NULL, CountMinSketch* sketch=(CountMinSketch*)NULL, int numDupesToBeCommon=0);
   void stripCommon(keymap& keys, keymap& common, int numDupesToBeCommon);
+  void sketchCommon(CountMinSketch& sketch, bool winnow=true, int startFile=-1, int endFile=-1, int threads=1);
+  void restoreUncommon(keymap& common, keymap& keys, int numDupesToBeCommon);
+  void getKeymapRuns(KeyMapRuns& runs, int maxKeysToCount, bool winnow=true, int startFile=-1, int endFile=-1, int threads=1);
 
   // Methods for dealing with a KeyTable
   void addToKeyTable(KeyTable& kt, int maxKeysToCount, int startFile=-1, int endFile=-1);  
+  void addToKeyTableRuns(KeyTableSegments& runs, size_t maxBytes, int maxKeysToCount, int startFile=-1, int endFile=-1);
 
   friend ostream& operator<<(ostream& out, DocSet& docv);
 
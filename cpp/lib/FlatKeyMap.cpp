@@ -0,0 +1,125 @@
+// Open-addressing kgramkey -> KgramInfo* map, see FlatKeyMap.h
+
+#include "FlatKeyMap.h"
+#include <algorithm>  // for swap()
+
+
+pair<FlatKeyMap::iterator,bool> FlatKeyMap::insert(const value_type& v)
+{
+  size_t p=findPos(v.first);
+  if (p<slots.size()) return(make_pair(iterator(this,p),false));
+  if ((num+1)*FLATKEYMAP_LOAD_DEN>slots.size()*FLATKEYMAP_LOAD_NUM) {
+    rehash(slots.size()<FLATKEYMAP_MIN_SIZE ? FLATKEYMAP_MIN_SIZE : slots.size()*2);
+  }
+  num++;
+  p=place(v);
+  if (p>=slots.size()) p=findPos(v.first);
+  return(make_pair(iterator(this,p),true));
+}
+
+
+KgramInfo*& FlatKeyMap::operator[](kgramkey key)
+{
+  size_t p=findPos(key);
+  if (p<slots.size()) return(slots[p].second);
+  return(insert(value_type(key,(KgramInfo*)NULL)).first->second);
+}
+
+
+// Remove key, shifting back following entries that are displaced from
+// their home slot. Returns number of entries removed (0 or 1).
+//
+size_t FlatKeyMap::erase(kgramkey key)
+{
+  size_t i=findPos(key);
+  if (i>=slots.size()) return(0);
+  size_t j=(i+1)&mask;
+  while (dist[j]>1) {
+    slots[i]=slots[j];
+    dist[i]=dist[j]-1;
+    i=j;
+    j=(j+1)&mask;
+  }
+  dist[i]=0;
+  num--;
+  return(1);
+}
+
+
+// Remove all entries and free the table
+//
+void FlatKeyMap::clear(void)
+{
+  vector<value_type>().swap(slots);
+  vector<U8>().swap(dist);
+  num=0;
+  mask=0;
+}
+
+
+// Size the table for n entries without growing
+//
+void FlatKeyMap::reserve(size_t n)
+{
+  size_t s=FLATKEYMAP_MIN_SIZE;
+  while (s*FLATKEYMAP_LOAD_NUM<n*FLATKEYMAP_LOAD_DEN) s*=2;
+  if (s>slots.size()) rehash(s);
+}
+
+
+void FlatKeyMap::swap(FlatKeyMap& other)
+{
+  slots.swap(other.slots);
+  dist.swap(other.dist);
+  std::swap(num,other.num);
+  std::swap(mask,other.mask);
+  arena.swap(other.arena);
+}
+
+
+// Robin Hood insertion of v which must not already be present, and num
+// must already count it. An entry further from its home slot than the
+// one found takes over the slot. Returns the slot where v was put, or
+// slots.size() if the table had to be grown when a probe distance
+// reached 255 (then v must be looked up).
+//
+size_t FlatKeyMap::place(value_type v)
+{
+  size_t i=hashKey(v.first)&mask;
+  unsigned int d=1;
+  size_t pos=slots.size();
+  while (true) {
+    if (dist[i]==0) {
+      slots[i]=v;
+      dist[i]=(U8)d;
+      return(pos<slots.size() ? pos : i);
+    }
+    if (dist[i]<d) {
+      std::swap(slots[i],v);
+      unsigned int t=dist[i];
+      dist[i]=(U8)d;
+      d=t;
+      if (pos==slots.size()) pos=i;
+    }
+    i=(i+1)&mask;
+    if (++d>255) {
+      // Very unlikely with a good hash, grow and put the displaced entry
+      rehash(slots.size()*2);
+      place(v);
+      return(slots.size());
+    }
+  }
+}
+
+
+void FlatKeyMap::rehash(size_t newSize)
+{
+  vector<value_type> oldSlots(newSize);
+  vector<U8> oldDist(newSize,0);
+  oldSlots.swap(slots);
+  oldDist.swap(dist);
+  mask=newSize-1;
+  for (size_t j=0; j<oldDist.size(); j++) {
+    if (oldDist[j]>0) place(oldSlots[j]);
+  }
+}
@@ -0,0 +1,132 @@
+// Open-addressing hash map from kgramkey to KgramInfo* used as the backing
+// store for keymap/KeyMap in place of unordered_map.
+//
+// Entries (key and KgramInfo* handle) are stored inline in one array with
+// linear probing and Robin Hood insertion, so there is no per-key node
+// allocation and a lookup usually touches one cache line. Deletion uses
+// backward shifting so no tombstones are needed. A parallel byte array
+// holds each entry's probe distance plus one (0 for an empty slot).
+//
+// Supports the subset of the unordered_map interface used in Docsim:
+// begin/end iteration over (first,second) pairs, find, count, insert,
+// operator[], erase, size, clear, reserve. As with unordered_map the
+// iteration order is unspecified, and insert or erase invalidates
+// iterators.
+//
+// The map also holds the KgramArena that KgramInfo values and their id
+// arrays are allocated from, freed in bulk when the map is destroyed.
+
+#ifndef __INC_FlatKeyMap
+#define __INC_FlatKeyMap 1
+
+#include "definitions.h"
+#include "KgramInfo.h"
+#include <utility>  // for pair
+
+// Grow when more than FLATKEYMAP_LOAD_NUM/FLATKEYMAP_LOAD_DEN full
+#define FLATKEYMAP_LOAD_NUM 4
+#define FLATKEYMAP_LOAD_DEN 5
+#define FLATKEYMAP_MIN_SIZE 16
+
+class FlatKeyMap
+{
+public:
+  typedef kgramkey key_type;
+  typedef KgramInfo* mapped_type;
+  typedef pair<kgramkey,KgramInfo*> value_type;
+
+  class iterator {
+  public:
+    iterator(void) : m(NULL), i(0) {}
+    iterator(FlatKeyMap* map, size_t pos) : m(map), i(pos) {}
+    value_type& operator*() { return(m->slots[i]); }
+    value_type* operator->() { return(&m->slots[i]); }
+    iterator& operator++() { i=m->nextUsed(i+1); return(*this); }
+    iterator operator++(int) { iterator t=*this; i=m->nextUsed(i+1); return(t); }
+    bool operator==(const iterator& o) const { return(i==o.i); }
+    bool operator!=(const iterator& o) const { return(i!=o.i); }
+    FlatKeyMap* m;
+    size_t i;
+  };
+
+  class const_iterator {
+  public:
+    const_iterator(void) : m(NULL), i(0) {}
+    const_iterator(const FlatKeyMap* map, size_t pos) : m(map), i(pos) {}
+    const_iterator(const iterator& it) : m(it.m), i(it.i) {}
+    const value_type& operator*() { return(m->slots[i]); }
+    const value_type* operator->() { return(&m->slots[i]); }
+    const_iterator& operator++() { i=m->nextUsed(i+1); return(*this); }
+    const_iterator operator++(int) { const_iterator t=*this; i=m->nextUsed(i+1); return(t); }
+    bool operator==(const const_iterator& o) const { return(i==o.i); }
+    bool operator!=(const const_iterator& o) const { return(i!=o.i); }
+    const FlatKeyMap* m;
+    size_t i;
+  };
+
+  KgramArena arena;  // storage for KgramInfo values, new(map.arena) KgramInfo(...)
+
+  FlatKeyMap(void) : num(0), mask(0) {}
+
+  size_t size(void) const { return(num); }
+  bool empty(void) const { return(num==0); }
+  size_t bucket_count(void) const { return(slots.size()); }
+  size_t sizeInBytes(void) const { return(slots.capacity()*sizeof(value_type)+dist.capacity()); }
+
+  iterator begin(void) { return(iterator(this,nextUsed(0))); }
+  iterator end(void) { return(iterator(this,slots.size())); }
+  const_iterator begin(void) const { return(const_iterator(this,nextUsed(0))); }
+  const_iterator end(void) const { return(const_iterator(this,slots.size())); }
+
+  iterator find(kgramkey key) { return(iterator(this,findPos(key))); }
+  const_iterator find(kgramkey key) const { return(const_iterator(this,findPos(key))); }
+  size_t count(kgramkey key) const { return(findPos(key)<slots.size() ? 1 : 0); }
+
+  pair<iterator,bool> insert(const value_type& v);
+  KgramInfo*& operator[](kgramkey key);
+  size_t erase(kgramkey key);
+  void erase(iterator it) { erase(it->first); }
+  void clear(void);
+  void reserve(size_t n);
+  void swap(FlatKeyMap& other);
+
+private:
+  vector<value_type> slots;
+  vector<U8> dist;   // probe distance+1, 0 for empty
+  size_t num;
+  size_t mask;       // slots.size()-1, size is a power of 2
+
+  // 64-bit finalizer from MurmurHash3 so that all key bits affect the slot
+  static size_t hashKey(kgramkey key)
+  {
+    key^=key>>33;
+    key*=0xff51afd7ed558ccdULL;
+    key^=key>>33;
+    key*=0xc4ceb9fe1a85ec53ULL;
+    key^=key>>33;
+    return((size_t)key);
+  }
+
+  size_t nextUsed(size_t i) const
+  {
+    while (i<dist.size() && dist[i]==0) i++;
+    return(i);
+  }
+
+  // Slot holding key, or slots.size() if not present
+  size_t findPos(kgramkey key) const
+  {
+    if (num==0) return(slots.size());
+    size_t i=hashKey(key)&mask;
+    for (unsigned int d=1; d<=dist[i]; d++) {
+      if (slots[i].first==key) return(i);
+      i=(i+1)&mask;
+    }
+    return(slots.size());
+  }
+
+  size_t place(value_type v);
+  void rehash(size_t newSize);
+};
+
+#endif /* #ifndef __INC_FlatKeyMap */
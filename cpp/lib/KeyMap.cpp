@@ -7,80 +7,46 @@
 #include "KgramInfo.h"
 #include "DocPair.h"
 #include "KeyMap.h"
+#include "DocCounter.h"
 #include <algorithm>
+#include <iomanip>         // for setw()
 
 KeyMap::KeyMap()
 {
 }
 
 
-// Clean up memory on destruct, each element in the keymap has
-// a KgramInfo object as the value. If code uses the keymap type
-// directly then an explcit 
+// The KgramInfo values are in the arena which is freed with the keymap,
+// no need to visit each one
 //
 KeyMap::~KeyMap(void)
 {
-  // cerr << "Called KeyMap destructor" << endl;
-  for (KeyMap::iterator kit=begin(); kit!=end(); kit++) { 
-    delete kit->second;
-  }
-  clear();
 }
 
 
 // Find all the documents in this KeyMap that occur more than n times. 
-// Add the results to the DocPairVector dpv.
+// Add the results to the DocPairVector dpv, most shared keys first.
 //
 // id2 is passed in simply to output a set of DocPair values for all the
 // documents found where id2 is the second id of the DocPair. This supports
 // use when comparing id2 against a set of documents and pulling out those
 // with overlap > n
+//
+// Counts with this thread's DocCounter so the cost depends only on the
+// number of docids in the map. Saturated keys have no docids to count.
 // 
 void KeyMap::getCommonDocs(DocPairVector& dpv, int n, docid id2)
 {
-  cout << "getCommonDocs: called on keymap with " << size() << " keys, threshold=" << n << endl;
-  // Find largest docid
-  docid maxDocid=0;
-  for (KeyMap::iterator kit=begin(); kit!=end(); kit++) {
-    // kit->second is KgramInfo object, has ids[0..idsSize]
-    KgramInfo* ki=kit->second;
-    for (int j=0; j<(ki->size()); j++) {
-      if (ki->ids[j]>maxDocid) maxDocid=ki->ids[j];
-    }
-  }
-  //cout << "getCommonDocs: maxDocid=" << maxDocid << endl;
-
-  int* overlap=new int[maxDocid+1];
-  if (overlap==(int*)NULL) {
-    cerr << "getCommonDocs: Error - failure to allocate overlap[" << (maxDocid+1) << "] \arrary" << endl;
-    exit(4);
-  }
-  
-  // zero array to start
-  for (docid j=1; j<=maxDocid; j++) {
-    overlap[j]=0;
-  }
-
-  // Now run through complete keymap and increment count for each time
-  // a docid appears
+  DocCounter& counter=DocCounter::forThread();
+  counter.clear();
   for (KeyMap::iterator kit=begin(); kit!=end(); kit++) {
-    // kit->second is KgramInfo object, has ids[0..idsSize]
     KgramInfo* ki=kit->second;
-    for (int j=0; j<(ki->idsSize); j++) {
-      overlap[ki->ids[j]]++;
+    docid* ids=ki->idArray();
+    for (int j=0; j<ki->size(); j++) {
+      counter.add(ids[j]);
     }
   }
-
-  // Got through an add docids for which did[docid]>n to docids
-  for (docid j=1; j<=maxDocid; j++) {
-    if (overlap[j]>n) {
-      DocPair dp(j,id2,overlap[j]);
-      dpv.push_back(dp);
-      //cerr << "getCommonDocs: Added " << dp << endl;
-    }
-  }
-
-  delete[] overlap;
+  counter.getCommonDocs(dpv,n,id2);
 }
 
 //===================================================================================
@@ -88,8 +54,7 @@ void KeyMap::getCommonDocs(DocPairVector& dpv, int n, docid id2)
 // Non-member utility functions to write and read 'keymap' objects which are
 // thus inherited by KeyMaps.
 //
-// (might want to have a binary format for these if they are to be used
-// with large objects)
+// (see KeyMapFile.h for a binary format that is better for large objects)
 //
 // ASCII format of lines
 //   kgramkey KgramInfo
@@ -113,13 +78,14 @@ ostream& operator<<(ostream& out, keymap& keys)
 istream& operator>>(istream& in, keymap& keys)
 {
   if (VERY_VERBOSE) cout << "keymap::operator>>: reading keymap with " << keys.size() << " entries beforehand" << endl;
-  char kstr[KGRAMKEYDIGITS];
+  char kstr[KGRAMKEYDIGITS+1];
   kgramkey key;
   while (in) {  
-    KgramInfo* ki=new KgramInfo();
-    in >> kstr >> *ki;
+    KgramInfo ki;
+    if (!(in >> setw(KGRAMKEYDIGITS+1) >> kstr)) break;
+    in >> ki;
     key=stringToKgramkey(kstr);
-    keys.insert(keymap::value_type(key,ki));
+    keys.insert(keymap::value_type(key,new(keys.arena) KgramInfo(&ki,&keys.arena)));
     //if (VERY_VERBOSE) cout << "keymap::operator>>: read: " << kgramkeyToString(key) << ki << endl;
   }
   if (VERY_VERBOSE) cout << "keymap::operator>>: read keymap, now has " << keys.size() << " entries" << endl;
@@ -142,7 +108,7 @@ void filterKeymap(keymap& ks, keymap& kf, keymap& kr)
     if (ksit!=ks.end()) {
       // This kgram is in both maps
       //cout << "ksit: " << *ksit->second << endl;
-      KgramInfo* kip=new KgramInfo(ksit->second);
+      KgramInfo* kip=new(kr.arena) KgramInfo(ksit->second,&kr.arena);
       //cout << kip  << endl;
       kr.insert(keymap::value_type(ksit->first,kip));
     }
@@ -1,7 +1,7 @@
-// Wrapper class inhertied from a keymap unordered_map to add some bookkeeping 
-// and to obscure some of the messy innards. In particular, use of KeyMap as 
-// opposed to keymap will handle memory cleanup automatically with object
-// destruction (use of keymap requires manual cleanup).
+// Wrapper class inhertied from a keymap (FlatKeyMap hash table) to add some bookkeeping 
+// and to obscure some of the messy innards. KgramInfo values are allocated
+// in the keymap's arena with new(km.arena) KgramInfo(...) and are freed in
+// bulk when the keymap or KeyMap is destroyed.
 //
 // Simeon Warner - 2005-08-24...
 // 2011-04 - Handle cleanup
@@ -13,12 +13,10 @@
 #include "kgrams.h"
 #include "KgramInfo.h"
 #include "DocPair.h"
+#include "FlatKeyMap.h"
 
-#ifdef __NO_TR1__
-  typedef hash_map<kgramkey,KgramInfo*> keymap;
-#else
-  typedef std::tr1::unordered_map<kgramkey,KgramInfo*> keymap;
-#endif
+// Flat open-addressing table, see FlatKeyMap.h
+typedef FlatKeyMap keymap;
 
 ostream& operator<<(ostream& out, keymap& keys);
 istream& operator>>(istream& in, keymap& keys);
@@ -0,0 +1,373 @@
+// Binary mmap-able KeyMap file, see KeyMapFile.h
+
+#include "KeyMapFile.h"
+#include "options.h"
+#include "DocCounter.h"
+#include <string.h>        // for memcpy(), memcmp()
+#include <algorithm>       // for sort(), lower_bound()
+#include <fstream>
+#include <stdio.h>         // for remove()
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+KeyMapFile::KeyMapFile(void)
+{
+  map=NULL;
+  mapSize=0;
+  numKeys=0;
+  numDocids=0;
+  keys=(kgramkey*)NULL;
+  offsets=(U64*)NULL;
+  numIds=(U32*)NULL;
+  occurrences=(int*)NULL;
+  docids=(docid*)NULL;
+}
+
+
+KeyMapFile::~KeyMapFile(void)
+{
+  close();
+}
+
+
+// Write keymap km to filename in binary form
+//
+void KeyMapFile::write(string filename, keymap& km)
+{
+  kgramkeyv sorted;
+  sorted.reserve(km.size());
+  for (keymap::iterator kit=km.begin(); kit!=km.end(); kit++) {
+    sorted.push_back(kit->first);
+  }
+  sort(sorted.begin(),sorted.end());
+  vector<KgramInfo*> kis(sorted.size());
+  KeyMapFileHeader h;
+  memcpy(h.magic,KEYMAPFILE_MAGIC,8);
+  h.version=KEYMAPFILE_VERSION;
+  h.docidSize=sizeof(docid);
+  h.numKeys=sorted.size();
+  h.numDocids=0;
+  for (size_t j=0; j<sorted.size(); j++) {
+    kis[j]=km.find(sorted[j])->second;
+    if (kis[j]!=(KgramInfo*)NULL) h.numDocids+=kis[j]->size();
+  }
+
+  ofstream out(filename.c_str(),ios_base::out|ios_base::binary);
+  if (!out.good()) {
+    cerr << "KeyMapFile::write: failed to open '" << filename << "' to write, aborting!" << endl;
+    exit(2);
+  }
+  out.write((char*)&h,sizeof(h));
+  if (!sorted.empty()) out.write((char*)&sorted[0],sorted.size()*sizeof(kgramkey));
+  U64 offset=0;
+  out.write((char*)&offset,sizeof(offset));
+  for (size_t j=0; j<kis.size(); j++) {
+    if (kis[j]!=(KgramInfo*)NULL) offset+=kis[j]->size();
+    out.write((char*)&offset,sizeof(offset));
+  }
+  for (size_t j=0; j<kis.size(); j++) {
+    U32 n=(kis[j]!=(KgramInfo*)NULL ? kis[j]->numIds : 0);
+    out.write((char*)&n,sizeof(n));
+  }
+  for (size_t j=0; j<kis.size(); j++) {
+    int occ=(kis[j]!=(KgramInfo*)NULL ? kis[j]->occurrences : -1);
+    out.write((char*)&occ,sizeof(occ));
+  }
+  for (size_t j=0; j<kis.size(); j++) {
+    if (kis[j]!=(KgramInfo*)NULL && kis[j]->size()>0) {
+      out.write((char*)kis[j]->idArray(),kis[j]->size()*sizeof(docid));
+    }
+  }
+  out.close();
+  if (!out.good()) {
+    cerr << "KeyMapFile::write: error writing '" << filename << "', aborting!" << endl;
+    exit(2);
+  }
+  if (VERBOSE) cout << "KeyMapFile::write: wrote " << (size_t)h.numKeys << " keys, " << (size_t)h.numDocids << " docids to " << filename << endl;
+}
+
+
+// Does filename start with the KeyMapFile magic string (else it is
+// presumably an ASCII KeyMap)
+//
+bool KeyMapFile::isKeyMapFile(string filename)
+{
+  char magic[8];
+  ifstream in(filename.c_str(),ios_base::in|ios_base::binary);
+  if (!in.read(magic,8)) return(false);
+  return(memcmp(magic,KEYMAPFILE_MAGIC,8)==0);
+}
+
+
+// Map filename read-only and set up the array pointers. Set sequential
+// if the file will be read in order (as by KeyMapRuns::merge()) rather
+// than for lookups.
+//
+void KeyMapFile::open(string filename, bool sequential)
+{
+  close();
+  int fd=::open(filename.c_str(),O_RDONLY);
+  if (fd<0) {
+    cerr << "KeyMapFile::open: failed to open '" << filename << "', aborting!" << endl;
+    exit(2);
+  }
+  struct stat st;
+  if (fstat(fd,&st)!=0 || (size_t)st.st_size<sizeof(KeyMapFileHeader)) {
+    cerr << "KeyMapFile::open: '" << filename << "' is too short for a KeyMapFile, aborting!" << endl;
+    exit(2);
+  }
+  mapSize=st.st_size;
+  map=mmap(NULL,mapSize,PROT_READ,MAP_SHARED,fd,0);
+  ::close(fd);
+  if (map==MAP_FAILED) {
+    cerr << "KeyMapFile::open: failed to mmap '" << filename << "', aborting!" << endl;
+    exit(2);
+  }
+  KeyMapFileHeader* h=(KeyMapFileHeader*)map;
+  if (memcmp(h->magic,KEYMAPFILE_MAGIC,8)!=0 || h->version!=KEYMAPFILE_VERSION || h->docidSize!=sizeof(docid)) {
+    cerr << "KeyMapFile::open: '" << filename << "' is not a version " << KEYMAPFILE_VERSION
+         << " KeyMapFile with " << sizeof(docid) << " byte docids, aborting!" << endl;
+    exit(2);
+  }
+  numKeys=h->numKeys;
+  numDocids=h->numDocids;
+  size_t expected=sizeof(KeyMapFileHeader)+numKeys*sizeof(kgramkey)+(numKeys+1)*sizeof(U64)
+                  +numKeys*(sizeof(U32)+sizeof(int))+numDocids*sizeof(docid);
+  if (mapSize!=expected) {
+    cerr << "KeyMapFile::open: '" << filename << "' has size " << mapSize << ", expected " << expected << ", aborting!" << endl;
+    exit(2);
+  }
+  char* p=(char*)map+sizeof(KeyMapFileHeader);
+  keys=(kgramkey*)p;
+  p+=numKeys*sizeof(kgramkey);
+  offsets=(U64*)p;
+  p+=(numKeys+1)*sizeof(U64);
+  numIds=(U32*)p;
+  p+=numKeys*sizeof(U32);
+  occurrences=(int*)p;
+  p+=numKeys*sizeof(int);
+  docids=(docid*)p;
+  // Lookups jump about so don't read ahead
+  madvise(map,mapSize,(sequential ? MADV_SEQUENTIAL : MADV_RANDOM));
+  if (VERBOSE) cout << "KeyMapFile::open: mapped " << filename << ", " << (size_t)numKeys << " keys, " << (size_t)numDocids << " docids" << endl;
+}
+
+
+// For a file read in key order, give back the mapped pages holding only
+// keys before index i and their docids, so that the memory used stays small
+// however large the file
+//
+void KeyMapFile::releaseBefore(U64 i)
+{
+  if (map==NULL || i==0) return;
+  if (i>numKeys) i=numKeys;
+  releasePages(keys,keys+i);
+  releasePages(offsets,offsets+i);
+  releasePages(numIds,numIds+i);
+  releasePages(occurrences,occurrences+i);
+  releasePages(docids,docids+offsets[i]);
+}
+
+
+// madvise(MADV_DONTNEED) the whole pages in [start,end)
+//
+void KeyMapFile::releasePages(void* start, void* end)
+{
+  size_t page=(size_t)sysconf(_SC_PAGESIZE);
+  size_t s=((size_t)start+page-1)/page*page;
+  size_t e=(size_t)end/page*page;
+  if (e>s) madvise((void*)s,e-s,MADV_DONTNEED);
+}
+
+
+void KeyMapFile::close(void)
+{
+  if (map!=NULL) munmap(map,mapSize);
+  map=NULL;
+  mapSize=0;
+  numKeys=0;
+  numDocids=0;
+}
+
+
+// Index of key in keys, or numKeys if not present
+//
+U64 KeyMapFile::find(kgramkey key)
+{
+  if (numKeys==0 || key<keys[0] || key>keys[numKeys-1]) return(numKeys);
+  U64 lo=0;
+  U64 hi=numKeys-1;
+  // Interpolate, keys[lo]<=key<=keys[hi] throughout
+  for (int step=0; step<KEYMAPFILE_INTERP_STEPS && hi-lo>16; step++) {
+    U64 pos=lo+(U64)((double)(key-keys[lo])/(double)(keys[hi]-keys[lo])*(double)(hi-lo));
+    if (pos>hi) pos=hi;
+    if (keys[pos]==key) return(pos);
+    if (keys[pos]<key) {
+      lo=pos+1;
+    } else {
+      hi=pos-1;
+    }
+    if (lo>hi || key<keys[lo] || key>keys[hi]) return(numKeys);
+  }
+  kgramkey* k=lower_bound(keys+lo,keys+hi+1,key);
+  return((k<=keys+hi && *k==key) ? (U64)(k-keys) : numKeys);
+}
+
+
+// Indexes of the keys of sortedKeys (increasing, no repeats) that are in
+// this file, added to found in the same order. Each search gallops
+// forward from the last position so a query of m keys costs about
+// m log(numKeys/m) comparisons.
+//
+void KeyMapFile::intersect(kgramkeyv& sortedKeys, vector<U64>& found)
+{
+  U64 lo=0;  // keys[0..lo-1] are all less than the next query key
+  for (size_t q=0; q<sortedKeys.size() && lo<numKeys; q++) {
+    kgramkey key=sortedKeys[q];
+    U64 hi=lo;
+    U64 step=1;
+    while (hi<numKeys && keys[hi]<key) {
+      lo=hi+1;
+      hi+=step;
+      step*=2;
+    }
+    if (hi>=numKeys) hi=numKeys-1;
+    lo=(U64)(lower_bound(keys+lo,keys+hi+1,key)-keys);
+    if (lo<numKeys && keys[lo]==key) {
+      found.push_back(lo);
+      lo++;
+    }
+  }
+}
+
+
+// As KeyMap::getCommonDocs() for the keys with indexes found
+//
+void KeyMapFile::getCommonDocs(vector<U64>& found, DocPairVector& dpv, int n, docid id2)
+{
+  DocCounter& counter=DocCounter::forThread();
+  counter.clear();
+  for (size_t j=0; j<found.size(); j++) {
+    docid* ids=docidsFor(found[j]);
+    size_t m=numDocidsFor(found[j]);
+    for (size_t k=0; k<m; k++) counter.add(ids[k]);
+  }
+  counter.getCommonDocs(dpv,n,id2);
+}
+
+
+// Write the keys with indexes found in the ASCII format of
+// operator<<(ostream&,keymap&)
+//
+void KeyMapFile::writeKeys(ostream& out, vector<U64>& found)
+{
+  for (size_t j=0; j<found.size(); j++) {
+    U64 i=found[j];
+    writeEntry(out,keys[i],occurrences[i],numIds[i],docidsFor(i),numDocidsFor(i));
+  }
+  out.flush();
+}
+
+
+// Write one key as a line of operator<<(ostream&,keymap&), occurrences<0
+// for a [null] KgramInfo and no ids with numIds>0 for a saturated one.
+// Doesn't flush, the caller flushes once after the last key.
+//
+void KeyMapFile::writeEntry(ostream& out, kgramkey key, int occurrences, U32 numIds, docid* ids, size_t n)
+{
+  out << kgramkeyToString(key) << ' ';
+  if (occurrences<0) {
+    out << "[null]\n";
+    return;
+  }
+  out << "[" << occurrences << "," << numIds << "]";
+  if (n==0 && numIds>0) {
+    out << " *";
+  } else {
+    for (size_t k=0; k<n; k++) out << " " << ids[k];
+  }
+  out << '\n';
+}
+
+
+//-------------------------------------------------------------------------
+// KeyMapFileWriter
+//-------------------------------------------------------------------------
+
+static const char* writerParts[KEYMAPFILEWRITER_PARTS]={"keys","offsets","numids","occurrences","docids"};
+
+KeyMapFileWriter::KeyMapFileWriter(string f) : filename(f), numKeys(0), numDocids(0)
+{
+  for (int p=0; p<KEYMAPFILEWRITER_PARTS; p++) {
+    parts[p]=new ofstream(partName(p).c_str(),ios_base::out|ios_base::binary);
+    if (!parts[p]->good()) {
+      cerr << "KeyMapFileWriter: failed to open '" << partName(p) << "' to write, aborting!" << endl;
+      exit(2);
+    }
+  }
+  U64 offset=0;
+  parts[1]->write((char*)&offset,sizeof(offset));
+}
+
+
+KeyMapFileWriter::~KeyMapFileWriter(void)
+{
+  for (int p=0; p<KEYMAPFILEWRITER_PARTS; p++) {
+    if (parts[p]!=(ofstream*)NULL) delete parts[p];
+  }
+}
+
+
+string KeyMapFileWriter::partName(int p)
+{
+  return(filename+"."+writerParts[p]+".tmp");
+}
+
+
+// Add key, which must be greater than the last key added. Arguments as for
+// KeyMapFile::writeEntry().
+//
+void KeyMapFileWriter::add(kgramkey key, int occurrences, U32 numIds, docid* ids, size_t n)
+{
+  numKeys++;
+  numDocids+=n;
+  U64 offset=numDocids;
+  parts[0]->write((char*)&key,sizeof(key));
+  parts[1]->write((char*)&offset,sizeof(offset));
+  parts[2]->write((char*)&numIds,sizeof(numIds));
+  parts[3]->write((char*)&occurrences,sizeof(occurrences));
+  if (n>0) parts[4]->write((char*)ids,n*sizeof(docid));
+}
+
+
+// Write the header and join the parts to make the file
+//
+void KeyMapFileWriter::close(void)
+{
+  KeyMapFileHeader h;
+  memcpy(h.magic,KEYMAPFILE_MAGIC,8);
+  h.version=KEYMAPFILE_VERSION;
+  h.docidSize=sizeof(docid);
+  h.numKeys=numKeys;
+  h.numDocids=numDocids;
+  ofstream out(filename.c_str(),ios_base::out|ios_base::binary);
+  out.write((char*)&h,sizeof(h));
+  for (int p=0; p<KEYMAPFILEWRITER_PARTS; p++) {
+    parts[p]->close();
+    delete parts[p];
+    parts[p]=(ofstream*)NULL;
+    ifstream in(partName(p).c_str(),ios_base::in|ios_base::binary);
+    if (in.peek()!=EOF) out << in.rdbuf();
+    in.close();
+    remove(partName(p).c_str());
+  }
+  out.close();
+  if (!out.good()) {
+    cerr << "KeyMapFileWriter::close: error writing '" << filename << "', aborting!" << endl;
+    exit(2);
+  }
+  if (VERBOSE) cout << "KeyMapFileWriter::close: wrote " << (size_t)numKeys << " keys, " << (size_t)numDocids << " docids to " << filename << endl;
+}
@@ -0,0 +1,100 @@
+// Binary KeyMap file that is used in place with mmap, so that a lookup
+// of a few keys against a large corpus KeyMap doesn't need the whole
+// ASCII allkeys.txt to be parsed into memory first.
+//
+// Layout (native byte order, all arrays in key order):
+//   header      - KEYMAPFILE_MAGIC, version, sizeof(docid), numKeys, numDocids
+//   keys        - numKeys sorted kgramkeys
+//   offsets     - numKeys+1 U64 offsets into docids, key i has docids
+//                 docids[offsets[i]..offsets[i+1]-1]
+//   numIds      - numKeys U32 number of documents for each key
+//   occurrences - numKeys int total occurrences, -1 for a [null] KgramInfo
+//   docids      - numDocids docids
+// A saturated kgram (see KgramInfo) has no docids but numIds>0.
+//
+// Keys are hashes and so close to uniformly distributed, find() uses
+// interpolation search to get near the key and then a binary search.
+// intersect() finds a sorted set of keys with a galloping merge, giving
+// key indexes whose postings are used in place (docidsFor(i)) rather
+// than copied into KgramInfo objects.
+
+#ifndef __INC_KeyMapFile
+#define __INC_KeyMapFile 1
+
+#include "definitions.h"
+#include "KeyMap.h"
+#include "DocPair.h"
+#include <fstream>
+
+#define KEYMAPFILE_MAGIC "DocsimKM"
+#define KEYMAPFILE_VERSION 1
+// Interpolation steps before falling back to binary search
+#define KEYMAPFILE_INTERP_STEPS 4
+
+struct KeyMapFileHeader {
+  char magic[8];
+  U32 version;
+  U32 docidSize;
+  U64 numKeys;
+  U64 numDocids;
+};
+
+class KeyMapFile
+{
+public:
+  // DATA, pointers into the mapped file
+  U64 numKeys;
+  U64 numDocids;
+  kgramkey* keys;
+  U64* offsets;
+  U32* numIds;
+  int* occurrences;
+  docid* docids;
+
+  // METHODS
+  KeyMapFile(void);
+  ~KeyMapFile(void);
+  static void write(string filename, keymap& km);
+  static bool isKeyMapFile(string filename);
+  void open(string filename, bool sequential=false);
+  void close(void);
+  void releaseBefore(U64 i);
+  U64 find(kgramkey key);
+  void intersect(kgramkeyv& sortedKeys, vector<U64>& found);
+  docid* docidsFor(U64 i) { return(docids+offsets[i]); }
+  size_t numDocidsFor(U64 i) { return((size_t)(offsets[i+1]-offsets[i])); }
+  void getCommonDocs(vector<U64>& found, DocPairVector& dpv, int n, docid id2=9999999);
+  void writeKeys(ostream& out, vector<U64>& found);
+  static void writeEntry(ostream& out, kgramkey key, int occurrences, U32 numIds, docid* ids, size_t n);
+
+private:
+  void* map;
+  size_t mapSize;
+  void releasePages(void* start, void* end);
+};
+
+
+// Writes a KeyMapFile one key at a time, in increasing key order, without
+// holding the KeyMap in memory. Each array goes to its own temporary file
+// (filename.keys.tmp etc.) and close() joins them after the header.
+//
+#define KEYMAPFILEWRITER_PARTS 5
+
+class KeyMapFileWriter
+{
+public:
+  string filename;
+  U64 numKeys;
+  U64 numDocids;
+
+  KeyMapFileWriter(string filename);
+  ~KeyMapFileWriter(void);
+  void add(kgramkey key, int occurrences, U32 numIds, docid* ids, size_t n);
+  void close(void);
+
+private:
+  ofstream* parts[KEYMAPFILEWRITER_PARTS]; // keys, offsets, numIds, occurrences, docids
+  string partName(int p);
+};
+
+#endif /* #ifndef __INC_KeyMapFile */
@@ -0,0 +1,109 @@
+// Sorted runs of a KeyMap on disk, see KeyMapRuns.h
+
+#include "KeyMapRuns.h"
+#include "options.h"
+#include "files.h"
+#include <stdio.h>    // for remove(), sprintf()
+
+
+KeyMapRuns::KeyMapRuns(string d, size_t m) : dir(d), maxBytes(m)
+{
+}
+
+
+KeyMapRuns::~KeyMapRuns(void)
+{
+}
+
+
+// Write km as a new run and free it, nothing is written if km is empty
+//
+void KeyMapRuns::flush(keymap& km)
+{
+  if (km.empty()) return;
+  char buf[32];
+  sprintf(buf,"run_%06d.keymap",(int)runs.size()+1);
+  string filename=prependPath(dir,buf);
+  size_t bytes=km.sizeInBytes()+km.arena.sizeInBytes();
+  KeyMapFile::write(filename,km);
+  runs.push_back(filename);
+  cout << "KeyMapRuns::flush: wrote run " << filename << ", " << km.size() << " keys from " << bytes << " bytes" << endl;
+  // Swap with an empty keymap to free the memory as well as the entries
+  keymap().swap(km);
+}
+
+
+// Merge the runs with a k-way merge, writing keys in at least
+// numDupesToBeCommon documents to commonOut and the others to out (in the
+// format of operator<<(ostream&,keymap&)) and to the KeyMapFile binFile.
+// Lists of more than maxKeysToCount docids become saturated as with
+// KgramInfo::addOccurrence().
+//
+void KeyMapRuns::merge(ostream& out, string binFile, ostream& commonOut, int maxKeysToCount, int numDupesToBeCommon)
+{
+  vector<KeyMapFile*> files;
+  vector<U64> pos(runs.size(),0);
+  for (size_t r=0; r<runs.size(); r++) {
+    files.push_back(new KeyMapFile());
+    files[r]->open(runs[r],true);
+  }
+  KeyMapFileWriter writer(binFile);
+  vector<docid> ids;
+  size_t numKeys=0;
+  size_t numCommon=0;
+  while (true) {
+    // Smallest current key over all runs
+    int minr=-1;
+    for (size_t r=0; r<files.size(); r++) {
+      if (pos[r]<files[r]->numKeys && (minr<0 || files[r]->keys[pos[r]]<files[minr]->keys[pos[minr]])) minr=(int)r;
+    }
+    if (minr<0) break;
+    kgramkey key=files[minr]->keys[pos[minr]];
+    int occurrences=-1;  // stays -1 only if [null] in every run
+    U32 numIds=0;
+    bool saturated=false;
+    ids.clear();
+    for (size_t r=0; r<files.size(); r++) {
+      KeyMapFile* f=files[r];
+      U64 i=pos[r];
+      if (i>=f->numKeys || f->keys[i]!=key) continue;
+      if (f->occurrences[i]>=0) occurrences=(occurrences<0 ? 0 : occurrences)+f->occurrences[i];
+      size_t n=f->numDocidsFor(i);
+      if (n==0 && f->numIds[i]>0) saturated=true;
+      numIds+=f->numIds[i];
+      ids.insert(ids.end(),f->docidsFor(i),f->docidsFor(i)+n);
+      pos[r]++;
+    }
+    if (saturated || (maxKeysToCount>0 && numIds>(U32)maxKeysToCount)) ids.clear();
+    docid* idp=(ids.empty() ? (docid*)NULL : &ids[0]);
+    if (occurrences>=0 && (int)numIds>=numDupesToBeCommon) {
+      KeyMapFile::writeEntry(commonOut,key,occurrences,numIds,idp,ids.size());
+      numCommon++;
+    } else {
+      KeyMapFile::writeEntry(out,key,occurrences,numIds,idp,ids.size());
+      writer.add(key,occurrences,numIds,idp,ids.size());
+      numKeys++;
+    }
+    if ((numKeys+numCommon)%KEYMAP_RUN_RELEASE==0) {
+      for (size_t r=0; r<files.size(); r++) files[r]->releaseBefore(pos[r]);
+    }
+  }
+  writer.close();
+  out.flush();
+  commonOut.flush();
+  for (size_t r=0; r<files.size(); r++) {
+    delete files[r];
+  }
+  cout << "KeyMapRuns::merge: merged " << runs.size() << " runs, " << numKeys << " keys and " << numCommon << " common keys" << endl;
+}
+
+
+// Remove the run files
+//
+void KeyMapRuns::removeAll(void)
+{
+  for (size_t r=0; r<runs.size(); r++) {
+    remove(runs[r].c_str());
+  }
+  runs.clear();
+}
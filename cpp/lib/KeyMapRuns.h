@@ -0,0 +1,40 @@
+// Sorted runs of a KeyMap on disk, for building a KeyMap that doesn't fit
+// in memory (docsim-analyze -a).
+//
+// Documents are added to an in-memory keymap as usual and whenever this
+// reaches maxBytes it is written to dir as a run (a KeyMapFile, so in key
+// order) and freed, see DocSet::getKeymapRuns(). Runs hold consecutive
+// ranges of documents so merge() combines them in run order, which keeps
+// each docid list in increasing order and gives the same result as
+// KgramInfo::merge() in one big keymap. Only the current key of each run is
+// looked at, so memory for the merge doesn't depend on the size of the
+// KeyMap.
+
+#ifndef __INC_KeyMapRuns
+#define __INC_KeyMapRuns 1
+
+#include "definitions.h"
+#include "KeyMap.h"
+#include "KeyMapFile.h"
+
+// Keys merged between giving back the memory they were read from
+#define KEYMAP_RUN_RELEASE 16384
+
+class KeyMapRuns
+{
+public:
+  // DATA
+  string dir;            // directory for run files
+  size_t maxBytes;       // size of keymap at which it is written as a run
+  vector<string> runs;   // run files, in document order
+
+  // METHODS
+  KeyMapRuns(string dir, size_t maxBytes);
+  ~KeyMapRuns(void);
+  bool full(keymap& km) { return(km.sizeInBytes()+km.arena.sizeInBytes()>=maxBytes); }
+  void flush(keymap& km);
+  void merge(ostream& out, string binFile, ostream& commonOut, int maxKeysToCount, int numDupesToBeCommon);
+  void removeAll(void);
+};
+
+#endif /* #ifndef __INC_KeyMapRuns */
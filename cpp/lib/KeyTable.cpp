@@ -8,26 +8,42 @@
 //
 // Uses three tables as a hierarchy of storage:
 //
-// table1 [ 0 ... 2^bits-1 ], one integer for each short key
-// values 0 ... max_docid -> document id where one document has key
-//        -ve             -> pointer into table2
-//        EMPTY           -> element not used (use value INT_MAX)
+// table1 [ 0 ... 2^bits-1 ], one IndexT for each short key, the top two
+// bits (PTR_FLAG and T3_FLAG) say what the rest of the value is
+// values 0 ... MAX_DOCID  -> document id where one document has key
+//        PTR_FLAG|i2      -> pointer to entry i2 in table2
+//        PTR_FLAG|T3_FLAG|i3 -> pointer to entry i3 in table3
+//        EMPTY            -> element not used (all bits set)
 //
-// table2 [ 0 ... TABLE2_SIZE-1 ], two integers for each entry
-// entries are indexed by -(value in table1)*2 with values of
+// table2 [ 0 ... TABLE2_SIZE-1 ], two DocidT for each entry
+// entries are indexed by i2*2 with values of
 //        [doc_id1, doc_id2] -> two document with key
-//        [-ve, 0 ]          -> pointer into table3 for >2 docs with key
+//        [0, 0]             -> free, entry was moved to table3 and
+//                              will be reused (see table2Free)
 //
-// table3 is a vector of vectors of int with values
+// table3 is a vector of KeyTable3Element lists of DocidT with values
 //        [doc_id1, doc_id2, doc_id3 [[,doc_id4..]] ] at least 3 doc ids
+// or, if saturated, just the number of documents with the key
 //
-// The values in table1 are signed int (32bit) with -ve values pointing
-// to entries in table2. This imposes a limitiation on the size of table2
-// as having at most 2^31 entries (2,147,483,648).
+// Keys that occur in very many documents say little about similarity but
+// have the longest lists. With setSaturateAbove(s) a list that grows beyond
+// s docids is replaced by a saturated marker which counts documents but
+// doesn't record them. Lookups and overlap calculations skip saturated
+// keys, they are written as "key *count".
 //
-// (It also imposes a limit on the maximum document id of 2^31-1 (2,147,483,647)
-// but the whole system will break down long before then. Current code has
-// a limit of 1,000,000 built in with strict checks)
+// Documents are deleted (withdrawn, or replaced by a new version added
+// with a new docid) by setting a tombstone with deleteDoc(). Lookups and
+// overlap calculations ignore deleted docids straight away, compact() then
+// removes them from the tables. Docids of deleted documents aren't reused.
+//
+// Pointers to table3 are held in table1 rather than in table2 so that
+// table2 entries need only be wide enough for two docids. With IndexT=U32
+// this gives at most 2^30 entries in each of table2 and table3, and a
+// maximum document id of 2^31-1 (any value without PTR_FLAG). IndexT=U64
+// allows more entries but not larger docids, lookups return docids in an
+// intv so MAX_DOCID is never above INT_MAX. A narrow DocidT
+// further limits the maximum document id (to 65,535 for U16 and 16,777,215
+// for U24), this is MAX_DOCID and is checked in addKey().
 
 #include "definitions.h"
 #include "options.h"
@@ -35,11 +51,36 @@
 #include "KeyMap.h"
 #include "KeyTable.h"
 #include "DocPair.h"
+#include "DocCounter.h"
 #include "pstats.h"
-#include <limits.h>        // for INT_MAX
-#include <math.h>          // for pow()
 #include <string.h>        // for strlen()
 #include <sstream>         // for use in writeMultiFile
+#include <algorithm>       // for sort() and unique()
+#include "parallel.h"
+#include "OutBuffer.h"
+#include "bigalloc.h"
+
+// Number of keys ahead that lookupKeys() prefetches table1 entries. The
+// table2/table3 data for an entry is prefetched half this distance ahead,
+// once the table1 entry is expected to be in cache.
+#define LOOKUP_PREFETCH 16
+// Most decimal digits in a docid read from a file, enough for 2^32-1
+#define DOCID_DIGITS 10
+// Largest total size of per-thread docid histograms in getOverlapIds(),
+// above this threads share one array with atomic increments
+#ifndef HISTOGRAM_MAX_BYTES
+  #define HISTOGRAM_MAX_BYTES (1024.0*1024.0*1024.0)
+#endif
+// Posting lists scanned by getOverlapDocs() before the pairs found are
+// counted, bounds the memory for pairs waiting to be counted
+#ifndef PAIR_BATCH_LISTS
+  #define PAIR_BATCH_LISTS (1<<18)
+#endif
+#ifdef __GNUC__
+  #define PREFETCH(p) __builtin_prefetch(p)
+#else
+  #define PREFETCH(p)
+#endif
 
 
 // Constructor. In usual use dummy is set to false (not specified) and memory
@@ -50,7 +91,8 @@
 //
 // May be call without dummy, bitmask, bitmaskMatch params
 //
-KeyTable::KeyTable(int bits, bool dummy, int selectBits, int selectBitsMatch)
+template <class IndexT, class DocidT>
+KeyTableT<IndexT,DocidT>::KeyTableT(int bits, bool dummy, int selectBits, int selectBitsMatch)
 {
   int max_bits=28; // 2^28 entries of int = 1GB table1
   string system_size="unknown (assuming 32-bit OS limits)"; 
@@ -72,10 +114,23 @@ KeyTable::KeyTable(int bits, bool dummy, int selectBits, int selectBitsMatch)
   KEY_BITS=bits;
   KEY_DIGITS=8; // always use 8 for now, could be (bits+3)/4;
   KEY_FMT=(char*)"%08x";
-  MAX_INDEX=(int)pow((float)2,bits)-1;       //FIXME: where is an all-int function?
+  MAX_INDEX=(U32)(((U64)1<<bits)-1);
   cerr << "KeyTable::KeyTable: creating table with " << KEY_BITS << " bits, MAX_INDEX = "
        << showbase << hex << MAX_INDEX << dec << " (" << MAX_INDEX << ")" << endl;
 
+  // Flags and limits from the storage types
+  PTR_FLAG=((IndexT)1)<<(sizeof(IndexT)*8-1);
+  T3_FLAG=PTR_FLAG>>1;
+  EMPTY=~((IndexT)0);
+  MAX_POINTER=T3_FLAG-2; // so that PTR_FLAG|T3_FLAG|MAX_POINTER!=EMPTY
+  U64 maxDocidT=(sizeof(DocidT)>=4 ? 0xFFFFFFFFULL : (((U64)1<<(sizeof(DocidT)*8))-1));
+  U64 maxDocidI=(U64)(PTR_FLAG-1);
+  MAX_DOCID=(U32)(maxDocidT<maxDocidI ? maxDocidT : maxDocidI);
+  // Lookups return docids in an intv so keep them positive ints
+  if (MAX_DOCID>(U32)INT_MAX) MAX_DOCID=(U32)INT_MAX;
+  cerr << "KeyTable::KeyTable: " << (sizeof(IndexT)*8) << " bit table1 entries, "
+       << (sizeof(DocidT)*8) << " bit docids, MAX_DOCID = " << MAX_DOCID << endl;
+
   // 
   SELECT_MASK=0;
   SELECT_MATCH=0;
@@ -84,12 +139,14 @@ KeyTable::KeyTable(int bits, bool dummy, int selectBits, int selectBitsMatch)
       cerr << "KeyTable::KeyTable: Can't have selectBits(" << selectBits << ") <= selectBitsMatch (" << selectBitsMatch << ")" << endl; 
       exit(2);
     }
-    SELECT_MASK=(int)pow((float)2,selectBits)-1-MAX_INDEX; //FIXME: where is an all-int function?
-    SELECT_MATCH=selectBitsMatch << bits;
-    cerr << "KeyTable::KeyTable: creating table SELECT_MASK=" << hex << SELECT_MASK << " and SELECT_MATCH=" << SELECT_MATCH << dec << endl;
+    SELECT_MASK=(((kgramkey)1)<<selectBits)-1-MAX_INDEX;
+    SELECT_MATCH=((kgramkey)selectBitsMatch) << bits;
+    cerr << "KeyTable::KeyTable: creating table SELECT_MASK=" << kgramkeyToString(SELECT_MASK) << " and SELECT_MATCH=" << kgramkeyToString(SELECT_MATCH) << endl;
   }
-  EMPTY=INT_MAX;
   //
+  table1=(IndexT*)NULL;
+  table2=(DocidT*)NULL;
+  frozen=false;
   if (dummy) {
     // Don't actually assign any storage in the dummy table
     TABLE1_SIZE=0;
@@ -97,66 +154,83 @@ KeyTable::KeyTable(int bits, bool dummy, int selectBits, int selectBitsMatch)
     table2_size=0;
   } else {
     //
-    TABLE1_SIZE=MAX_INDEX+1;
+    TABLE1_SIZE=(size_t)MAX_INDEX+1;
     //
-    // Now allocate table of this size... 
-    table1=new int [TABLE1_SIZE];
-    if (table1==(int*)NULL) {
+    // Now allocate table of this size, huge pages if possible... 
+    table1=(IndexT*)bigAlloc(table1Alloc,sizeof(IndexT)*TABLE1_SIZE);
+    if (table1==(IndexT*)NULL) {
       cerr << "Error - failed to allocate KeyTable::table1 with size " << TABLE1_SIZE << endl;
       exit(2);
     }
-    // Initialize table1 to 0 (no key, no pointer)
-    for (int j=0; j<TABLE1_SIZE; j++) {
-      table1[j]=EMPTY;
-    }
+    // Initialize table1 to EMPTY (no key, no pointer)
+    parallelFill(table1,TABLE1_SIZE,EMPTY,numThreads);
     TABLE2_SIZE=TABLE1_SIZE/4;
+    if (TABLE2_SIZE>(size_t)MAX_POINTER+1) TABLE2_SIZE=(size_t)MAX_POINTER+1;
     //
     // Now allocate table of this size... 
-    table2=new int[TABLE2_SIZE*2];
-    if (table2==(int*)NULL) {
+    table2=(DocidT*)bigAlloc(table2Alloc,sizeof(DocidT)*TABLE2_SIZE*2);
+    if (table2==(DocidT*)NULL) {
       cerr << "Error - failed to allocate KeyTable::table2 with size " << TABLE2_SIZE << endl;
       exit(2);
     }
-    // Initialize table2 to 0 (no key, no pointer)
-    for (int j=0; j<TABLE2_SIZE; j++) {
-      table2[j*2]=0;
-      table2[j*2+1]=0;
+    // Initialize table2 to 0 (no key, no pointer) unless already zero
+    if (!table2Alloc.zeroed) {
+      memset((void*)table2,0,sizeof(DocidT)*TABLE2_SIZE*2);
     }
     table2_size=0;
   }
-  maxDocid=-1;
+  maxDocid=0;
+  numTable1=0;
+  numTable2=0;
+  totTable3=0;
+  t3Bytes=0;
+  numSaturated=0;
+  numDeleted=0;
+  numUncompacted=0;
   //
   numDocidsInRead=-1;
 
-  // Set to no-prune
+  // Set to no-prune and no saturation
   pruneAbove=0;
+  saturateAbove=0;
 }
 
 
-// Just clean up memory
+// Just clean up memory, table3 elements don't free their lists
+// themselves (see KeyTable3ElementT::release())
 //
-KeyTable::~KeyTable(void)
+template <class IndexT, class DocidT>
+KeyTableT<IndexT,DocidT>::~KeyTableT(void)
 {
-  delete table1;
-  delete table2;
+  bigFree(table1Alloc);
+  bigFree(table2Alloc);
+  for (size_t i3=0; i3<table3.size(); i3++) {
+    table3[i3].release();
+  }
 }
 
 
 // Allow extension of table2 if we overrun
 //
-void KeyTable::growTable2(void)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::growTable2(void)
 {
-  int old_table2_max=TABLE2_SIZE;
-  int* old_table2=table2;
+  size_t old_table2_max=TABLE2_SIZE;
+  DocidT* old_table2=table2;
+  BigAlloc old_table2Alloc=table2Alloc;
   //
-  if (TABLE2_SIZE>TABLE1_SIZE) {
+  if (TABLE2_SIZE>(size_t)MAX_POINTER) {
+    cerr << "Error - can't grow KeyTable::table2 beyond " << TABLE2_SIZE << " entries with "
+         << (sizeof(IndexT)*8) << " bit table1 entries, rebuild with -DKEYTABLE_INDEX=U64" << endl;
+    exit(2);
+  } else if (TABLE2_SIZE>TABLE1_SIZE) {
     cerr << "Error - doesn't make sense to grow KeyTable::table2 when size " << TABLE2_SIZE << " already >= table1 size " << TABLE1_SIZE << endl;
-    int num_non_ptr=0;
-    for (int j=0; j<TABLE1_SIZE; j++) {
+    size_t num_non_ptr=0;
+    for (size_t j=0; j<TABLE1_SIZE; j++) {
       // All entries in table1
-      if (table1[j]>=0) {
+      if (table1[j]!=EMPTY && isDocid(table1[j])) {
         if (num_non_ptr==0) {
-          cerr << "   FIRST non pointer entry is # " << j << " with value " << table1[j] << endl;
+          cerr << "   FIRST non pointer entry is # " << j << " with value " << (U32)table1[j] << endl;
         }
         num_non_ptr++;
       }
@@ -170,32 +244,111 @@ void KeyTable::growTable2(void)
     // double
     TABLE2_SIZE=TABLE2_SIZE*2;
   }
-  table2=new int[TABLE2_SIZE*2];
-  if (table2==(int*)NULL) {
+  if (TABLE2_SIZE>(size_t)MAX_POINTER+1) TABLE2_SIZE=(size_t)MAX_POINTER+1;
+  table2=(DocidT*)bigAlloc(table2Alloc,sizeof(DocidT)*TABLE2_SIZE*2);
+  if (table2==(DocidT*)NULL) {
     cerr << "Error - failed to re-allocate KeyTable::table2 with size " << TABLE2_SIZE << endl;
     exit(2);
   }
   // Copy first part of table
-  for (int j=0; j<old_table2_max; j++) {
-    table2[j*2]=old_table2[j*2];
-    table2[j*2+1]=old_table2[j*2+1];
-  }
+  memcpy((void*)table2,(void*)old_table2,sizeof(DocidT)*old_table2_max*2);
   // Initialize rest of table2 to 0 (no key, no pointer)
-  for (int j=old_table2_max; j<TABLE2_SIZE; j++) {
-    table2[j*2]=0;
-    table2[j*2+1]=0;
+  if (!table2Alloc.zeroed) {
+    memset((void*)(table2+old_table2_max*2),0,sizeof(DocidT)*(TABLE2_SIZE-old_table2_max)*2);
   }
   // Finally, delete old table and return
-  delete[] old_table2;
+  bigFree(old_table2Alloc);
 }
 
 // Allow code to drop table1 so that we can save space for code the
 // doesn't need unique keys to be kept.
 //
-void KeyTable::dropTable1(void)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::dropTable1(void)
 {
-  delete[] table1;
+  bigFree(table1Alloc);
+  table1=(IndexT*)NULL;
   TABLE1_SIZE=0;
+  numTable1=0;
+  if (frozen) {
+    t1Occupied.clear();
+    t1IsPtr.clear();
+    t1Docids.clear();
+    vector<IndexT>().swap(t1Ptrs);
+    frozen=false;
+  }
+}
+
+
+// Replace table1 with a compact read-only form for lookups in a table that
+// won't have more keys added. Most table1 entries in large tables are
+// EMPTY or a single docid so we keep just an occupancy bitvector with rank
+// support over all entries, another over the occupied entries saying which
+// are pointers, the singleton docids packed in bitsFor(maxDocid) bits, and
+// the pointers. Lookup is still constant time, see frozenValue().
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::freeze(void)
+{
+  if (frozen || TABLE1_SIZE==0) return;
+  size_t numOccupied=numTable1+numTable2+table3.size();
+  t1Occupied.init(TABLE1_SIZE);
+  t1IsPtr.init(numOccupied);
+  t1Docids.init(numTable1,bitsFor(maxDocid));
+  t1Ptrs.clear();
+  t1Ptrs.reserve(numOccupied-numTable1);
+  size_t r=0;
+  size_t d=0;
+  for (size_t j=0; j<TABLE1_SIZE; j++) {
+    IndexT v=table1[j];
+    if (v==EMPTY) continue;
+    t1Occupied.set(j);
+    if (isDocid(v)) {
+      t1Docids.set(d++,(U64)v);
+    } else {
+      t1IsPtr.set(r);
+      t1Ptrs.push_back(v);
+    }
+    r++;
+  }
+  if (r!=numOccupied || d!=numTable1) {
+    cerr << "KeyTable::freeze: Error - found " << r << " entries (" << d << " docids) in table1, expected "
+         << numOccupied << " (" << numTable1 << ")" << endl;
+    exit(3);
+  }
+  t1Occupied.buildRank();
+  t1IsPtr.buildRank();
+  bigFree(table1Alloc);
+  table1=(IndexT*)NULL;
+  frozen=true;
+  cout << "KeyTable::freeze: table1 now " << frozenBytes() << " bytes, was " << (sizeof(IndexT)*TABLE1_SIZE) 
+       << " bytes, " << t1Docids.bitsPerValue() << " bits per docid" << endl;
+}
+
+
+// Back to normal table1 so that keys can be added
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::thaw(void)
+{
+  if (!frozen) return;
+  IndexT* t1=(IndexT*)bigAlloc(table1Alloc,sizeof(IndexT)*TABLE1_SIZE);
+  for (size_t j=0; j<TABLE1_SIZE; j++) {
+    t1[j]=frozenValue(j);
+  }
+  t1Occupied.clear();
+  t1IsPtr.clear();
+  t1Docids.clear();
+  vector<IndexT>().swap(t1Ptrs);
+  table1=t1;
+  frozen=false;
+}
+
+
+template <class IndexT, class DocidT>
+size_t KeyTableT<IndexT,DocidT>::frozenBytes(void)
+{
+  return(t1Occupied.sizeInBytes()+t1IsPtr.sizeInBytes()+t1Docids.sizeInBytes()+sizeof(IndexT)*t1Ptrs.capacity());
 }
 
 // Since we know that all keys for a specific docid will be added in
@@ -205,346 +358,1048 @@ void KeyTable::dropTable1(void)
 //
 // We also record the highest docid for later use
 //
-void KeyTable::addKey(kgramkey& key, int docid)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::addKey(kgramkey& key, U32 docid)
 {
-  if (SELECT_MASK && (int)(key&SELECT_MASK)!=SELECT_MATCH) {
+  if (SELECT_MASK && (key&SELECT_MASK)!=SELECT_MATCH) {
     return;
   }
   // Chop off high bits with bitwise AND
-  int i=(int)(key&MAX_INDEX);
+  U32 i=(U32)(key&MAX_INDEX);
   addKey(i,docid);
 }
 
-void KeyTable::addKey(int i, int docid)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::addKey(U32 i, U32 docid)
 {
 #ifdef STRICT_CHECKS
-  if (i<0 or i>MAX_INDEX) {
+  if (i>MAX_INDEX) {
     cerr << "KeyTable::addKey: Error - i=" << i << " which is not allowed (must be 0<=i<=" << MAX_INDEX << ")" << endl;
     exit(2);
   }
-  if (docid<1 || docid>1000000) {
-    cerr << "KeyTable::addKey: Error - bad value for docid=" << docid << endl;
+#endif
+  // Always check the docid fits, a narrow DocidT would silently truncate
+  if (docid<1 || docid>MAX_DOCID) {
+    cerr << "KeyTable::addKey: Error - bad value for docid=" << docid << " (must be 1<=docid<=" << MAX_DOCID << ")" << endl;
+    exit(2);
+  }
+  if (frozen) {
+    cerr << "KeyTable::addKey: Error - can't add keys to frozen KeyTable" << endl;
+    exit(2);
+  }
+  if (isDeleted(docid)) {
+    cerr << "KeyTable::addKey: Error - docid=" << docid << " has been deleted, docids can't be reused" << endl;
     exit(2);
   }
-#endif
   if (docid>maxDocid) maxDocid=docid;
-  if (table1[i]==EMPTY) {
+  IndexT v=table1[i];
+  if (v==EMPTY) {
     // no entry for this short key, simply add 
     table1[i]=docid;
-  } else if (table1[i]==docid) {
+    numTable1++;
+  } else if (v==(IndexT)docid) {
     // already in table1, do nothing
-  } else {
-    // either make new entry in table2 or add element
+  } else if (isDocid(v) || !isTable3Ptr(v)) {
+    // either make new entry in table2 or move entry to table3
     table1[i]=addKeyTable2(i,docid);
+  } else {
+    // add to entry in table3
+    table1[i]=addKeyTable3(i,docid);
   }
 }
 
 
-// Adds docid to entry in table2, returns offset into table2
+// Get index of a free table2 entry, reusing one freed by a move to table3
+// if there is one. Grows table2 if necessary.
+//
+template <class IndexT, class DocidT>
+IndexT KeyTableT<IndexT,DocidT>::newTable2(void)
+{
+  if (!table2Free.empty()) {
+    IndexT i2=table2Free.back();
+    table2Free.pop_back();
+    return(i2);
+  }
+  if (table2_size>=TABLE2_SIZE) {
+    growTable2();
+    cerr << "KeyTable::addKeyTable2: Warning - reached max size of table2, " << table2_size << " grown to " << TABLE2_SIZE << endl;
+  }
+  return((IndexT)(table2_size++));
+}
+
+
+// Adds docid to entry in table2, returns new value for table1[i]
 //
 // Document docid may already be entered for short key i in table2 (or table3)
 // so we have to check for this and skip if found.
 //
-int KeyTable::addKeyTable2(int i, int docid)
+template <class IndexT, class DocidT>
+IndexT KeyTableT<IndexT,DocidT>::addKeyTable2(U32 i, U32 docid)
 {
+  IndexT v=table1[i];
 #ifdef STRICT_CHECKS
-  if (table1[i]==EMPTY) {
-    cerr << "KeyTable::addKeyTable2: Error - should not be called with table1[i]==EMPTY, i=" << i << endl;
+  if (v==EMPTY || (!isDocid(v) && isTable3Ptr(v))) {
+    cerr << "KeyTable::addKeyTable2: Error - should not be called with table1[i]==EMPTY or table3 ptr, i=" << i << endl;
     exit(2);
   }
 #endif
-  int i2;
-  if (table1[i]>0) {
-    // Must create new entry in table2, we already know docid isn't dupe, check 
-    // first that we don't need to extend table2
-    if (table2_size>=TABLE2_SIZE) {
-      growTable2();
-      cerr << "KeyTable::addKeyTable2: Warning - reached max size of table2, " << table2_size << " grown to " << TABLE2_SIZE << endl;
-    }
-    i2=++table2_size;
-    table2[(i2-1)*2]=table1[i];
-    table2[(i2-1)*2+1]=docid;
-  } else {
-    // Already have entry in table2 which means that both elements are full
-    // must create or add to an entry in table3 if docid isn't dupe
-    i2=-table1[i];
-    if (table2[(i2-1)*2]<0) {
-      // Already have ptr to table3
-      table2[(i2-1)*2]=addKeyTable3(i,docid);
-    } else if (table2[(i2-1)*2+1]!=docid) {
-      table2[(i2-1)*2]=addKeyTable3(i,docid);
-    }
+  if (isDocid(v)) {
+    // Must create new entry in table2, we already know docid isn't dupe
+    IndexT i2=newTable2();
+    table2[i2*2]=(U32)v;
+    table2[i2*2+1]=docid;
+    numTable1--;
+    numTable2++;
+    // Return ptr to go in table1
+    return(PTR_FLAG|i2);
   }
-  // Return ptr to go in table1
-  return(-i2);
+  // Already have entry in table2 which means that both elements are full
+  // must move to an entry in table3 if docid isn't dupe
+  IndexT i2=ptrValue(v);
+  if ((U32)table2[i2*2+1]==docid) return(v);
+  return(addKeyTable3(i,docid));
 }
 
 
-// Adds docid to entry in table3, returns offset into table3
+// Keep table3Sizes up to date when a list changes from oldSize to newSize
+// entries, oldSize<3 for a new list
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::countTable3Size(int oldSize, int newSize)
+{
+  if ((size_t)newSize>=table3Sizes.size()) table3Sizes.resize(newSize+1,0);
+  if (oldSize>=3) table3Sizes[oldSize]--;
+  table3Sizes[newSize]++;
+}
+
+
+// Adds docid to entry in table3, returns new value for table1[i]
+//
+// If table1[i] points to table2 then a new table3 entry is created from the
+// two docids there and the table2 entry is freed for reuse.
 //
-int KeyTable::addKeyTable3(int i, int docid)
+template <class IndexT, class DocidT>
+IndexT KeyTableT<IndexT,DocidT>::addKeyTable3(U32 i, U32 docid)
 {
-  int i2=-table1[i];
+  IndexT v=table1[i];
 #ifdef STRICT_CHECKS
-  if (table1[i]>=0) {
-    cerr << "KeyTable::addKeyTable3: Error - should not be called with table1[i]>=0, i=" << i << endl;
-    exit(3);
-  }
-  if (table2[(i2-1)*2]==0) {
-    cerr << "KeyTable::addKeyTable3: Error - should not be called with table2[(i2-1)*2]==0, i2=" << i2 << endl;
+  if (v==EMPTY || isDocid(v)) {
+    cerr << "KeyTable::addKeyTable3: Error - should not be called with table1[i] EMPTY or docid, i=" << i << endl;
     exit(3);
   }
 #endif
-  int i3;
-  if (table2[(i2-1)*2]>0) {
+  IndexT i3;
+  if (!isTable3Ptr(v)) {
     // Must create new entry in table3, we already know docid isn't dupe
+    IndexT i2=ptrValue(v);
     int initialSize=3;
     if (numDocidsInRead>0) {
       initialSize=numDocidsInRead;
     }
-    KeyTable3Element entry(initialSize);
+    if (table3.size()>(size_t)MAX_POINTER) {
+      cerr << "KeyTable::addKeyTable3: Error - table3 full with " << table3.size() << " entries, rebuild with -DKEYTABLE_INDEX=U64" << endl;
+      exit(2);
+    }
+    table3_element entry(initialSize);
     table3.push_back(entry);
-    i3=table3.size(); // there has to be a better way to get index of new element+1
-    // Now take entries from table2 and put as first and second in table3[i3-1]
-    table3[i3-1].push_back(table2[(i2-1)*2]);
-    table3[i3-1].push_back(table2[(i2-1)*2+1]);
+    i3=(IndexT)(table3.size()-1);
+    // Now take entries from table2 and put as first and second in table3[i3]
+    table3[i3].push_back((U32)table2[i2*2]);
+    table3[i3].push_back((U32)table2[i2*2+1]);
+    // and free the table2 entry
+    table2[i2*2]=0;
+    table2[i2*2+1]=0;
+    table2Free.push_back(i2);
+    numTable2--;
+    totTable3+=2;
+    t3Bytes+=table3[i3].size_in_bytes();
   } else {
     // Already have entry in table3, just check against dupe
-    i3=-table2[(i2-1)*2];
-    if (table3[i3-1].back()==docid) return(-i3);
+    i3=ptrValue(v);
+    if (table3[i3].isSaturated()) {
+      table3[i3].addSaturated(docid);
+      return(v);
+    }
+    if (table3[i3].back()==docid) return(v);
   }
   // Now simply add to table3 
-  table3[i3-1].push_back(docid);
-  //cout << "table3[" << i3 << "] added " << docid << " size=" << table3[i3-1].size() << endl;
+  int oldSize=table3[i3].size();
+  int oldBytes=table3[i3].size_in_bytes();
+  table3[i3].push_back(docid);
+  totTable3++;
+  t3Bytes+=table3[i3].size_in_bytes()-oldBytes;
+  countTable3Size(oldSize,oldSize+1);
+  if (saturateAbove>0 && oldSize+1>saturateAbove) saturateTable3(i3);
+  //cout << "table3[" << i3 << "] added " << docid << " size=" << table3[i3].size() << endl;
   //
-  // Return ptr to go in table2
-  return(-i3);
+  // Return ptr to go in table1
+  return(PTR_FLAG|T3_FLAG|i3);
+}
+
+
+// Replace list table3[i3] with a saturated marker, keeping stats up to date
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::saturateTable3(IndexT i3)
+{
+  int size=table3[i3].size();
+  int oldBytes=table3[i3].size_in_bytes();
+  table3[i3].saturate();
+  if (size>=3) table3Sizes[size]--;
+  totTable3-=size;
+  t3Bytes-=oldBytes-table3[i3].size_in_bytes();
+  numSaturated++;
+}
+
+
+// Add a key known to be in count documents but without their docids (e.g.
+// a saturated key read from file). Any docids already held for short key i
+// are counted in and dropped.
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::addSaturatedKey(U32 i, U32 count)
+{
+  if (frozen) {
+    cerr << "KeyTable::addSaturatedKey: Error - can't add keys to frozen KeyTable" << endl;
+    exit(2);
+  }
+  IndexT v=table1[i];
+  if (v!=EMPTY && isTable3Ptr(v) && !isDocid(v)) {
+    IndexT i3=ptrValue(v);
+    if (!table3[i3].isSaturated()) saturateTable3(i3);
+    table3[i3].setSaturated(table3[i3].saturatedCount()+count,table3[i3].back());
+    return;
+  }
+  U32 lastDocid=0;
+  if (v==EMPTY) {
+    // new key
+  } else if (isDocid(v)) {
+    count++;
+    lastDocid=(U32)v;
+    numTable1--;
+  } else {
+    IndexT i2=ptrValue(v);
+    count+=2;
+    lastDocid=(U32)table2[i2*2+1];
+    table2[i2*2]=0;
+    table2[i2*2+1]=0;
+    table2Free.push_back(i2);
+    numTable2--;
+  }
+  if (table3.size()>(size_t)MAX_POINTER) {
+    cerr << "KeyTable::addSaturatedKey: Error - table3 full with " << table3.size() << " entries, rebuild with -DKEYTABLE_INDEX=U64" << endl;
+    exit(2);
+  }
+  table3_element entry(0);
+  entry.saturate();
+  entry.setSaturated(count,lastDocid);
+  table3.push_back(entry);
+  t3Bytes+=entry.size_in_bytes();
+  numSaturated++;
+  table1[i]=PTR_FLAG|T3_FLAG|(IndexT)(table3.size()-1);
 }
 
 
-void KeyTable::getDocids(intv& docids, int i)
+// True if short key i has a saturated list
+//
+template <class IndexT, class DocidT>
+bool KeyTableT<IndexT,DocidT>::isSaturated(U32 i)
 {
+  IndexT v=table1Value(i);
+  return(v!=EMPTY && !isDocid(v) && isTable3Ptr(v) && table3[ptrValue(v)].isSaturated());
+}
+
+
+// Docids for short key i are appended to docids, nothing is added if the
+// key is saturated. Deleted docids are skipped.
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::getDocids(intv& docids, U32 i)
+{
+  size_t start=docids.size();
 #ifdef STRICT_CHECKS
-  if (i<0 || i>=TABLE1_SIZE) {
+  if ((size_t)i>=TABLE1_SIZE) {
     cerr << "KeyTable::getDocids: Out of bounds error, attempt to access KeyTable index " << i << " where TABLE1_SIZE=" << TABLE1_SIZE << endl;
     exit(2);
   }
 #endif
-  if (table1[i]==EMPTY) {
+  IndexT v=table1Value(i);
+  if (v==EMPTY) {
     // no entry for this short key, do nothing
-  } else if (table1[i]>0) {
+  } else if (isDocid(v)) {
     // one docid in table1
-    docids.push_back(table1[i]);
+    docids.push_back((int)v);
+  } else if (!isTable3Ptr(v)) {
+    // Take the two elements from table2
+    size_t i2=(size_t)ptrValue(v)*2; //index in table2
+    if (table2[i2]==0) {
+      cerr << "KeyTable::getDocids: bad table2[" << i2 << "] entry of 0" << endl;
+    } else {
+      docids.push_back((U32)table2[i2]);
+      docids.push_back((U32)table2[i2+1]);
+    }
   } else {
-    // Something in table2 or table3
-    int i2=(-table1[i]-1)*2; //index in table2
-    if (table2[i2]>0) {
-      // Take the two elements from table2
-      docids.push_back(table2[i2]);
-      docids.push_back(table2[i2+1]);
-    } else if (table2[i2]<0) {
-      // copy all of entries from table3
-      KeyTable3Element* t3=&table3[-table2[i2]-1];
-      for (KeyTable3Element::iterator t3i=t3->begin(); t3i!=t3->end(); t3i++) {
-        docids.push_back(*t3i);
+    // copy all of entries from table3
+    table3[ptrValue(v)].appendTo(docids);
+  }
+  if (numUncompacted>0) {
+    size_t m=start;
+    for (size_t k=start; k<docids.size(); k++) {
+      if (!isDeleted((U32)docids[k])) docids[m++]=docids[k];
+    }
+    docids.resize(m);
+  }
+}
+
+
+// Mark docid as deleted. It is ignored from now on and removed from the
+// tables by the next compact().
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::deleteDoc(U32 docid)
+{
+  if (docid<1 || docid>MAX_DOCID) {
+    cerr << "KeyTable::deleteDoc: Error - bad value for docid=" << docid << " (must be 1<=docid<=" << MAX_DOCID << ")" << endl;
+    exit(2);
+  }
+  if (isDeleted(docid)) return;
+  if (docid>=deleted.size()) deleted.resize((docid>maxDocid ? docid : maxDocid)+1,false);
+  deleted[docid]=true;
+  numDeleted++;
+  numUncompacted++;
+}
+
+
+// Physically remove deleted docids from the tables. Lists left too short
+// for their table move down, a table3 list to table2 or table1 and a
+// table2 pair to table1. Freed table2 entries go on table2Free for reuse
+// and emptied table3 entries are removed with table3 renumbered. Saturated
+// lists are left alone as they don't record which documents they count.
+//
+// Without table1 (after dropTable1()) lists can't move so table2 pairs and
+// table3 lists with fewer than two docids left are simply dropped.
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::compact(void)
+{
+  if (frozen) {
+    cerr << "KeyTable::compact: Error - can't compact frozen KeyTable, thaw() first" << endl;
+    exit(2);
+  }
+  if (numUncompacted==0) return;
+  size_t oldTable3=table3.size();
+  int minKeep=(TABLE1_SIZE>0 ? 3 : 2); // shortest list kept in table3
+
+  // Filter table3 lists in place, kept entries get new numbers in remap
+  vector<IndexT> remap(table3.size(),EMPTY);
+  size_t kept=0;
+  for (size_t i3=0; i3<table3.size(); i3++) {
+    table3_element* t3=&table3[i3];
+    if (!t3->isSaturated()) {
+      int s=t3->size();
+      int oldBytes=t3->size_in_bytes();
+      t3->unpack(); // filter bitmap lists as arrays
+      DocidT* x=t3->begin();
+      int r=0;
+      for (int k=0; k<s; k++) {
+        if (!isDeleted((U32)x[k])) x[r++]=x[k];
+      }
+      if (r<s) {
+        table3Sizes[s]--;
+        totTable3-=s;
+        t3Bytes-=oldBytes;
+        t3->resize(r);
+        if (r>KT3_BITMAP_MIN) t3->pack();
+        if (r>=minKeep) {
+          totTable3+=r;
+          t3Bytes+=t3->size_in_bytes();
+          countTable3Size(0,r);
+        }
+      } else if (s>KT3_BITMAP_MIN) {
+        t3->pack();
       }
+      if (r<minKeep) continue;
+    }
+    remap[i3]=(IndexT)(kept++);
+  }
+
+  if (TABLE1_SIZE>0) {
+    for (size_t i=0; i<TABLE1_SIZE; i++) {
+      IndexT v=table1[i];
+      if (v==EMPTY) {
+        // nothing
+      } else if (isDocid(v)) {
+        if (isDeleted((U32)v)) {
+          table1[i]=EMPTY;
+          numTable1--;
+        }
+      } else if (!isTable3Ptr(v)) {
+        IndexT i2=ptrValue(v);
+        U32 a=(U32)table2[i2*2];
+        U32 b=(U32)table2[i2*2+1];
+        if (isDeleted(a) || isDeleted(b)) {
+          table2[i2*2]=0;
+          table2[i2*2+1]=0;
+          table2Free.push_back(i2);
+          numTable2--;
+          if (isDeleted(a) && isDeleted(b)) {
+            table1[i]=EMPTY;
+          } else {
+            table1[i]=(IndexT)(isDeleted(a) ? b : a);
+            numTable1++;
+          }
+        }
+      } else {
+        IndexT i3=ptrValue(v);
+        table3_element* t3=&table3[i3];
+        if (remap[i3]!=EMPTY) {
+          table1[i]=PTR_FLAG|T3_FLAG|remap[i3];
+        } else if (t3->size()==0) {
+          table1[i]=EMPTY;
+        } else if (t3->size()==1) {
+          table1[i]=(IndexT)(*t3)[0];
+          numTable1++;
+        } else {
+          IndexT i2=newTable2();
+          table2[i2*2]=(*t3)[0];
+          table2[i2*2+1]=(*t3)[1];
+          numTable2++;
+          table1[i]=PTR_FLAG|i2;
+        }
+      }
+    }
+  } else {
+    for (size_t j=0; j<table2_size; j++) {
+      if (table2[j*2]>0 && (isDeleted((U32)table2[j*2]) || isDeleted((U32)table2[j*2+1]))) {
+        table2[j*2]=0;
+        table2[j*2+1]=0;
+        table2Free.push_back((IndexT)j);
+        numTable2--;
+      }
+    }
+  }
+
+  // Rebuild table3 with just the kept entries
+  table3_type newTable3;
+  newTable3.reserve(kept);
+  for (size_t i3=0; i3<table3.size(); i3++) {
+    if (remap[i3]!=EMPTY) {
+      newTable3.push_back(table3[i3]);
     } else {
-      cerr << "KeyTable::getDocids: bad table2[" << i2 << "] entry of 0" << endl;
+      table3[i3].release();
     }
   }
+  table3.swap(newTable3);
+
+  cout << "KeyTable::compact: removed " << numUncompacted << " deleted documents, table3 entries "
+       << oldTable3 << " -> " << table3.size() << ", " << table2Free.size() << " free table2 entries" << endl;
+  numUncompacted=0;
+}
+
+
+//=======================================================================================
+// Whole table passes
+//
+// scanPostings() runs one visitor per thread over the posting lists of
+// table2 (free entries skipped) and table3, numbered 0..numPostingLists()-1,
+// each thread getting a contiguous range (of start..end-1 if given). A visitor must provide
+//
+//   bool decodeBitmaps;
+//   void visit(const DocidT* ids, size_t n, table3_element* t3)
+//
+// where t3 is NULL for lists in table2. Bitmap lists in table3 are only
+// decoded into ids for visitors with decodeBitmaps set, otherwise ids is
+// NULL and the visitor reads t3->bitmap() itself (or just n). The caller
+// combines the visitors afterwards.
+//
+
+template <class IndexT, class DocidT>
+template <class Visitor>
+void KeyTableT<IndexT,DocidT>::scanPostingRange(Visitor& visitor, size_t start, size_t end)
+{
+  vector<DocidT> ids; // bitmap lists decoded here
+  for (size_t j=start; j<end; j++) {
+    if (j<table2_size) {
+      if (table2[j*2]>0) {
+        visitor.visit(&table2[j*2],2,(table3_element*)NULL);
+      }
+    } else {
+      table3_element* t3=&table3[j-table2_size];
+      if (t3->isBitmap() && !visitor.decodeBitmaps) {
+        visitor.visit((DocidT*)NULL,(size_t)t3->size(),t3);
+      } else if (t3->isBitmap()) {
+        ids.clear();
+        t3->appendTo(ids);
+        visitor.visit(&ids[0],ids.size(),t3);
+      } else {
+        visitor.visit(t3->begin(),(size_t)t3->size(),t3);
+      }
+    }
+  }
+}
+
+
+template <class KT, class Visitor>
+struct ScanWork {
+  KT* kt;
+  Visitor* visitor;
+  size_t start;
+  size_t end;
+};
+
+
+template <class KT, class Visitor>
+void* scanThread(void* arg)
+{
+  ScanWork<KT,Visitor>* w=(ScanWork<KT,Visitor>*)arg;
+  w->kt->scanPostingRange(*(w->visitor),w->start,w->end);
+  return(NULL);
+}
+
+
+template <class IndexT, class DocidT>
+template <class Visitor>
+void KeyTableT<IndexT,DocidT>::scanPostings(vector<Visitor>& visitors)
+{
+  scanPostings(visitors,0,numPostingLists());
+}
+
+
+template <class IndexT, class DocidT>
+template <class Visitor>
+void KeyTableT<IndexT,DocidT>::scanPostings(vector<Visitor>& visitors, size_t start, size_t end)
+{
+  typedef KeyTableT<IndexT,DocidT> KT;
+  vector< ScanWork<KT,Visitor> > work(visitors.size());
+  for (size_t t=0; t<visitors.size(); t++) {
+    work[t].kt=this;
+    work[t].visitor=&visitors[t];
+    splitRange(end-start,visitors.size(),t,work[t].start,work[t].end);
+    work[t].start+=start;
+    work[t].end+=start;
+  }
+  runThreads(work,scanThread<KT,Visitor>);
+}
+
+
+// Docid histogram for getOverlapIds. Each thread has its own count array
+// unless memory is tight in which case all share one and use atomic
+// increments.
+//
+template <class DocidT>
+struct HistogramVisitor {
+  int* count;
+  bool atomic;
+  vector<bool>* deleted; // NULL unless there are uncompacted deletions
+  bool decodeBitmaps;    // only to filter deleted docids
+  // Counting straight from a bitmap list
+  struct BitmapCount {
+    int* count;
+    void operator()(U32 d) { count[d]++; }
+  };
+  struct BitmapCountAtomic {
+    int* count;
+    void operator()(U32 d) { __sync_fetch_and_add(&count[d],1); }
+  };
+  void visit(const DocidT* ids, size_t n, KeyTable3ElementT<DocidT>* t3) {
+    if (ids==NULL && atomic) {
+      BitmapCountAtomic c;
+      c.count=count;
+      t3->bitmap()->forEach(c);
+    } else if (ids==NULL) {
+      BitmapCount c;
+      c.count=count;
+      t3->bitmap()->forEach(c);
+    } else if (deleted!=NULL) {
+      // Count only live docids and only if the key is still shared
+      size_t live=0;
+      for (size_t k=0; k<n; k++) {
+        U32 d=(U32)ids[k];
+        if (d>=deleted->size() || !(*deleted)[d]) live++;
+      }
+      if (live<2) return;
+      for (size_t k=0; k<n; k++) {
+        U32 d=(U32)ids[k];
+        if (d<deleted->size() && (*deleted)[d]) continue;
+        if (atomic) {
+          __sync_fetch_and_add(&count[d],1);
+        } else {
+          count[d]++;
+        }
+      }
+    } else if (atomic) {
+      for (size_t k=0; k<n; k++) __sync_fetch_and_add(&count[(U32)ids[k]],1);
+    } else {
+      for (size_t k=0; k<n; k++) count[(U32)ids[k]]++;
+    }
+  }
+};
+
+
+// Sum histograms hist[1..] into hist[0] over docid range [start,end)
+//
+struct HistogramReduceWork {
+  vector<int*>* hist;
+  size_t start;
+  size_t end;
+};
+
+
+static void* histogramReduceThread(void* arg)
+{
+  HistogramReduceWork* w=(HistogramReduceWork*)arg;
+  vector<int*>& hist=*(w->hist);
+  for (size_t h=1; h<hist.size(); h++) {
+    for (size_t j=w->start; j<w->end; j++) {
+      hist[0][j]+=hist[h][j];
+    }
+  }
+  return(NULL);
+}
+
+
+// Counts for writeStats
+//
+template <class DocidT>
+struct StatsVisitor {
+  size_t numTable2;
+  size_t numTable3;
+  size_t totTable3;
+  size_t t3Bytes;
+  size_t numSaturated;
+  int minTable3;
+  int maxTable3;
+  bool decodeBitmaps;   // no, only sizes are needed
+  StatsVisitor(void) : numTable2(0), numTable3(0), totTable3(0), t3Bytes(0), numSaturated(0), minTable3(9999999), maxTable3(0), decodeBitmaps(false) {}
+  void visit(const DocidT* ids, size_t n, KeyTable3ElementT<DocidT>* t3) {
+    if (t3==NULL) {
+      numTable2++;
+    } else if (t3->isSaturated()) {
+      numTable3++;
+      numSaturated++;
+      t3Bytes+=t3->size_in_bytes();
+    } else {
+      numTable3++;
+      int s=(int)n;
+      totTable3+=s;
+      t3Bytes+=t3->size_in_bytes();
+      if (s>maxTable3) maxTable3=s;
+      if (s<minTable3) minTable3=s;
+    }
+  }
+};
+
+
+template <class KT>
+struct Table1CountWork {
+  KT* kt;
+  size_t start;
+  size_t end;
+  size_t numTable1;
+  size_t ptrTable1;
+};
+
+
+template <class KT>
+void* table1CountThread(void* arg)
+{
+  Table1CountWork<KT>* w=(Table1CountWork<KT>*)arg;
+  KT* kt=w->kt;
+  w->numTable1=0;
+  w->ptrTable1=0;
+  for (size_t j=w->start; j<w->end; j++) {
+    typename KT::index_type v=kt->table1Value(j);
+    if (v==kt->EMPTY) {
+      // nothing, unused
+    } else if (kt->isDocid(v)) {
+      w->numTable1++;
+    } else {
+      w->ptrTable1++;
+    }
+  }
+  return(NULL);
+}
+
+
+// Pair counting for getOverlapDocs
+//
+#ifdef __NO_TR1__
+  typedef hash_map<U64,int> paircountmap;
+#else
+  typedef std::tr1::unordered_map<U64,int> paircountmap;
+#endif
+
+// Finds pairs (i,k), i<k, in the posting lists of one scan range. Each
+// pair goes in pairs[i%pairs.size()] to be counted by the thread that
+// owns it. Lists in table2 and table3 are in ascending docid order.
+//
+template <class DocidT>
+struct PairListVisitor {
+  vector<bool>* candidate;        // NULL for all docids
+  vector< vector<U64> > pairs;    // (i<<32)|k by owner thread
+  vector<U32> ids;                // candidate docids of current list
+  bool decodeBitmaps;             // yes, pairs need the docids
+  PairListVisitor(void) : candidate((vector<bool>*)NULL), decodeBitmaps(true) {}
+  void visit(const DocidT* list, size_t n, KeyTable3ElementT<DocidT>* t3) {
+    ids.clear();
+    for (size_t k=0; k<n; k++) {
+      U32 d=(U32)list[k];
+      if (candidate==NULL || (*candidate)[d]) ids.push_back(d);
+    }
+    size_t owners=pairs.size();
+    for (size_t p=0; p+1<ids.size(); p++) {
+      vector<U64>& owned=pairs[ids[p]%owners];
+      for (size_t q=p+1; q<ids.size(); q++) {
+        if (ids[q]>ids[p]) owned.push_back(((U64)ids[p]<<32)|ids[q]);
+      }
+    }
+  }
+};
+
+template <class DocidT>
+struct OverlapPairsWork {
+  vector< PairListVisitor<DocidT> >* visitors;
+  int thread;
+  paircountmap counts;     // pairs owned by this thread
+};
+
+
+static bool docPairLess(const DocPair& a, const DocPair& b)
+{
+  return(a.id1<b.id1 || (a.id1==b.id1 && a.id2<b.id2));
+}
+
+
+// Count the pairs owned by this thread found by all visitors
+//
+template <class DocidT>
+void* overlapPairsThread(void* arg)
+{
+  OverlapPairsWork<DocidT>* w=(OverlapPairsWork<DocidT>*)arg;
+  vector< PairListVisitor<DocidT> >& visitors=*(w->visitors);
+  for (size_t v=0; v<visitors.size(); v++) {
+    vector<U64>& owned=visitors[v].pairs[w->thread];
+    for (size_t j=0; j<owned.size(); j++) {
+      w->counts[owned[j]]++;
+    }
+    owned.clear();
+  }
+  return(NULL);
 }
 
 
 // Extract a list of ids that have at least n keys shared with other documents
 //
-void KeyTable::getOverlapIds(intv& docids, int n)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::getOverlapIds(intv& docids, int n, int threads)
 {
   cout << "KeyTable::getOverlapIds(" << n << ")" << endl;
+  if (threads<1) threads=1;
    
-  // Allocate an array where we can count the number of times we see
-  // each docid
-  if (maxDocid<0) {
+  // Allocate arrays where we can count the number of times we see
+  // each docid, one per thread unless that would be more than
+  // HISTOGRAM_MAX_BYTES
+  if (maxDocid==0) {
     cerr << "KeyTable::getOverlapIds: maxDocid not set..." << endl;
     exit(3);
   }
-  int* did=new int[maxDocid+1];
-  if (did==(int*)NULL) {
-    cerr << "KeyTable::getOverlapIds: Error - failes to allocate did[" << (maxDocid+1) << "] arrary" << endl;
-    exit(4);
-  }
-  // Initialize to all zero
-  for (int j=0; j<=maxDocid; j++) {
-    did[j]=0;
+  bool atomic=(threads>1 && (double)threads*(maxDocid+1)*sizeof(int)>HISTOGRAM_MAX_BYTES);
+  vector<int*> hist(atomic ? 1 : threads);
+  for (size_t h=0; h<hist.size(); h++) {
+    hist[h]=new int[maxDocid+1];
+    if (hist[h]==(int*)NULL) {
+      cerr << "KeyTable::getOverlapIds: Error - failes to allocate did[" << (maxDocid+1) << "] arrary" << endl;
+      exit(4);
+    }
+    // Initialize to all zero
+    memset(hist[h],0,sizeof(int)*(maxDocid+1));
   }
   
   // Now run through complete table2 and table3 incrementing did[docid] for
   // each time docid appears. We can simply ignore table1 as this has only
   // uniquely occuring keys
-  for (int j=0; j<table2_size; j++) {
-    if (table2[j*2]>0) {
-      did[table2[j*2]]++;
-      did[table2[j*2+1]]++;
-    } else {
-      KeyTable3Element *t3=&table3[-table2[j*2]-1];
-      for (KeyTable3Element::iterator t3i=t3->begin(); t3i!=t3->end(); t3i++) {
-        did[*t3i]++;
-      } 
+  vector< HistogramVisitor<DocidT> > visitors(threads);
+  for (int t=0; t<threads; t++) {
+    visitors[t].count=hist[atomic ? 0 : t];
+    visitors[t].atomic=atomic;
+    visitors[t].deleted=(numUncompacted>0 ? &deleted : (vector<bool>*)NULL);
+    visitors[t].decodeBitmaps=(numUncompacted>0);
+  }
+  scanPostings(visitors);
+
+  // Combine per-thread counts into hist[0], split by docid range
+  if (hist.size()>1) {
+    vector<HistogramReduceWork> work(threads);
+    for (int t=0; t<threads; t++) {
+      work[t].hist=&hist;
+      splitRange(maxDocid+1,threads,t,work[t].start,work[t].end);
     }
+    runThreads(work,histogramReduceThread);
   }
 
   // Got through an add docids for which did[docid]>n to docids
-  for (int j=1; j<=maxDocid; j++) {
+  int* did=hist[0];
+  for (U32 j=1; j<=maxDocid; j++) {
     if (did[j]>n) docids.push_back(j);
   }
    
   cout << "KeyTable::getOverlapIds: looked at " << maxDocid << " ids and returned " 
        << docids.size() << " ids which have at least " << n << " overlaps" << endl;
-  delete did;
+  for (size_t h=0; h<hist.size(); h++) {
+    delete[] hist[h];
+  }
 } 
 
 
 // Find candidate similar documents based on which pairs of documents
-// ids in docids share more than n keys. 
+// ids in docids share at least n keys (all documents if docids is empty).
+//
+// Makes a single pass over table2 and table3 with scanPostings(), in
+// batches of PAIR_BATCH_LISTS posting lists. Each thread generates every
+// pair of docids (i,k), i<k, that share a key in its range of the batch,
+// then thread t counts the pairs with i%threads==t from all threads in
+// its own sparse map, so each pair has one count. The results are sorted
+// into (i,k) order at the end. Memory is
+// proportional to the number of distinct pairs rather than to maxDocid
+// per candidate.
 // 
 // Note, we could actually undercount matching keys here if two kgrams
 // that match between the documents happen to give the same short key and
 // thus are counted only once. [Simeon/2005-08-04]
 //
-void KeyTable::getOverlapDocs(DocPairVector& docpairs, intv& docids, int n)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::getOverlapDocs(DocPairVector& docpairs, intv& docids, int n, int threads)
 {
-  // Easiest to work in docid space here rather than in the indexes of
-  // the docids array. This is wasteful
-  int* overlap=new int[maxDocid+1];
-  if (overlap==(int*)NULL) {
-    cerr << "KeyTable::getOverlapDocs: Error - failes to allocate overlap[" << (maxDocid+1) << "] arrary" << endl;
-    exit(4);
+  cout << "KeyTable::getOverlapDocs(" << n << ") using " << threads << " threads" << endl;
+  if (threads<1) threads=1;
+
+  // Mark candidate docids, empty means all, deleted docids never are
+  vector<bool> candidate;
+  if (docids.size()>0) {
+    candidate.resize(maxDocid+1,false);
+    for (intv::const_iterator dit=docids.begin(); dit!=docids.end(); dit++) {
+      if (*dit>=0 && (U32)*dit<=maxDocid) candidate[*dit]=true;
+    }
+  } else if (numUncompacted>0) {
+    candidate.resize(maxDocid+1,true);
   }
-  
-  cout << "KeyTable::getOverlapDocs(" << n << ")" << endl;
-  for (int j=1; j<((int)docids.size()-1); j++) {
-    // Clear overlap array (only need to worry about entries > j)
-    for (int k=(j+1); k<=maxDocid; k++) {
-      overlap[k]=0;
-    }
-    // Look for overlap of docid[j] with all docids>docid[j] (avoid double counting)
-    // Note that we know that in both table2 and table3 arrays, they ids are in 
-    // ascending order. Thus we need only add ids that occur after that one matching
-    // j
-    for (int k=0; k<table2_size; k++) {
-      if (table2[k*2]>0) {
-        if (table2[k*2]==j) {
-          overlap[table2[k*2+1]]++;
-        }
-      } else {
-	KeyTable3Element *t3=&table3[-table2[k*2]-1];
-	bool gotMatch=false;
-        for (KeyTable3Element::iterator t3i=t3->begin(); t3i!=t3->end(); t3i++) {
-	  if (!gotMatch) {
-            if (*t3i==j) gotMatch=true;
-	  } else {
-	    overlap[*t3i]++;
-	  }
-	}
-      } 
+  if (numUncompacted>0) {
+    for (U32 j=0; j<=maxDocid; j++) {
+      if (isDeleted(j)) candidate[j]=false;
     }
-    //
-    // Run though overlap array an pick out documents which have overlap=>n
-    // with document j
-    for (int k=(j+1); k<=maxDocid; k++) {
-      if (overlap[k]>=n) { 
-        DocPair d(j,k,overlap[k]);
+  }
+
+  vector< PairListVisitor<DocidT> > visitors(threads);
+  vector< OverlapPairsWork<DocidT> > work(threads);
+  for (int t=0; t<threads; t++) {
+    visitors[t].candidate=(candidate.size()>0 ? &candidate : (vector<bool>*)NULL);
+    visitors[t].pairs.resize(threads);
+    work[t].visitors=&visitors;
+    work[t].thread=t;
+  }
+  for (size_t start=0; start<numPostingLists(); start+=PAIR_BATCH_LISTS) {
+    size_t end=start+PAIR_BATCH_LISTS;
+    if (end>numPostingLists()) end=numPostingLists();
+    scanPostings(visitors,start,end);
+    runThreads(work,overlapPairsThread<DocidT>);
+  }
+  visitors.clear();
+  size_t numPairs=0;
+  for (int t=0; t<threads; t++) {
+    numPairs+=work[t].counts.size();
+  }
+  cout << "KeyTable::getOverlapDocs: counted " << numPairs << " distinct document pairs sharing keys" << endl;
+
+  // Combine and put in (id1,id2) order
+  for (int t=0; t<threads; t++) {
+    paircountmap& counts=work[t].counts;
+    for (paircountmap::const_iterator cit=counts.begin(); cit!=counts.end(); cit++) {
+      if (cit->second>=n) {
+        DocPair d((docid)(cit->first>>32),(docid)(cit->first&0xffffffff),cit->second);
         docpairs.push_back(d);
       }
     }
-    if (j%100==0) cout << "KeyTable::getOverlapDocs[" << j << "] Got " << docpairs.size() << " pairs so far" << endl;
+    paircountmap().swap(counts);
   }
+  sort(docpairs.begin(),docpairs.end(),docPairLess);
   cout << "Found " << docpairs.size() << " document pairs sharing >= " << n << " keys" << endl;
-  delete overlap;
 }
 
 
 // Given the current KeyTable (representing the keys in the corpus), find the
 // overlap with keys in the keymap kms and put all of these in kmd.
 //
-void KeyTable::getOverlapKeys(keymap& kms, keymap& kmd)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::getOverlapKeys(keymap& kms, keymap& kmd)
 {
-  indexhashset indexes;
+  vector<U32> indexes;
   keysToIndexes(kms,indexes);
   getOverlapKeys(indexes,kmd);
 }
 
 
-void KeyTable::getOverlapKeys(indexhashset& indexes, keymap& kmd)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::getOverlapKeys(indexhashset& indexes, keymap& kmd)
 {
-  intv docids;
-  for (indexhashset::const_iterator iit=indexes.begin(); iit!=indexes.end(); iit++) {
-    docids.clear();
-    getDocids(docids,*iit);
-    if (docids.size()>0) {
-      // There is overlap and we have a list of docids to insert
-      KgramInfo* kip=new KgramInfo(docids);
+  vector<U32> sorted(indexes.begin(),indexes.end());
+  sort(sorted.begin(),sorted.end());
+  getOverlapKeys(sorted,kmd);
+}
+
+
+// As above with indexes already sorted, see lookupKeys()
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::getOverlapKeys(vector<U32>& indexes, keymap& kmd)
+{
+  if (indexes.size()==0) return;
+  KeyTableLookup lookup;
+  lookupKeys(&indexes[0],indexes.size(),lookup);
+  for (size_t k=0; k<lookup.size(); k++) {
+    // There is overlap and we have a list of docids to insert
+    KgramInfo* kip=new(kmd.arena) KgramInfo(lookup.docidsFor(k),lookup.numDocids(k),&kmd.arena);
+    kgramkey key=(kgramkey)lookup.keys[k];
 #ifdef STRICT_CHECKS
-      // There should not be any occasion where there is already a value
-      // in the KeyMap with the same key (index). If this occurs then
-      // the kmd.insert(..) below will do nothing and will leave the newly
-      // create KgramInfo object kip as a memory leak.
-      keymap::const_iterator kmdi=kmd.find((kgramkey)*iit);
-      if (kmdi!=kmd.end()) {
-        cerr << "KeyTable::getOverlapKeys: Doing replace of replace of index " << *iit << endl;
-        KgramInfo* old_kip=kmdi->second;
-        cerr << "KeyTable::getOverlapKeys: < " << *old_kip << endl 
-             << "KeyTable::getOverlapKeys: > " << *kip << endl;
-        exit(4);
-        //Comment exit above and uncomment lines below to replace instead of aborting
-        //delete kmdi->second; // remove current data, else this is memory leak
-        //kmd.erase(kmdi);
-      }
-#endif
-      kmd.insert(keymap::value_type((kgramkey)*iit,kip));
+    // There should not be any occasion where there is already a value
+    // in the KeyMap with the same key (index). If this occurs then
+    // the kmd.insert(..) below will do nothing and the newly created
+    // KgramInfo object kip will be unused in the kmd arena.
+    keymap::const_iterator kmdi=kmd.find(key);
+    if (kmdi!=kmd.end()) {
+      cerr << "KeyTable::getOverlapKeys: Doing replace of replace of index " << lookup.keys[k] << endl;
+      KgramInfo* old_kip=kmdi->second;
+      cerr << "KeyTable::getOverlapKeys: < " << *old_kip << endl 
+           << "KeyTable::getOverlapKeys: > " << *kip << endl;
+      exit(4);
+      //Comment exit above and uncomment lines below to replace instead of aborting
+      //kmd.erase(kmdi); // old KgramInfo stays in the kmd arena
     }
+#endif
+    kmd.insert(keymap::value_type(key,kip));
   }
 }
 
- 
-void KeyTable::writeStats(ostream& out) {
-  int numTable1=0;
-  int ptrTable1=0;
-  int numTable2=0;
-  int numTable3=0;
-  int totTable3=0;
-  int minTable3=9999999;
-  int maxTable3=0;
 
-  float t1_mem= sizeof(*table1)*TABLE1_SIZE / (1024.0*1024.0);    // 1 int per entry
-  float t2_mem= sizeof(*table2)*TABLE2_SIZE*2 / (1024.0*1024.0);  // 2 ints per entry
-  float t3_mem= sizeof(int)*table3.capacity() / (1024.0*1024.0);  // 1 ptr per entry (+ vectors later)
+// Prefetch the table1 entry for i, for a frozen table1 this is the
+// occupancy word (the packed entries need its rank)
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::prefetchTable1(U32 i)
+{
+  if (frozen) {
+    PREFETCH(t1Occupied.word(i));
+  } else {
+    PREFETCH(&table1[i]);
+  }
+}
+
 
-  // Count up everything for table1 if it exists
-  for (int j=0; j<TABLE1_SIZE; j++) {
-    if (table1[j]==EMPTY) {
-      // nothing, unused
-    } else if (table1[j]>0) {
-      numTable1++;
+// Batched lookup of short keys keys[0..n-1], matches are appended to
+// result (see KeyTableLookup), keys with no entry, a saturated list or
+// only deleted docids are skipped. Keys should
+// be sorted so that table1 is walked in address order, repeated keys are
+// looked up once. Each table1 access is otherwise a cache miss so entries
+// are prefetched LOOKUP_PREFETCH keys ahead, and the table2 or table3 data
+// they point to is prefetched before it is needed. No allocation is done
+// beyond growth of the result vectors.
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::lookupKeys(const U32* keys, size_t n, KeyTableLookup& result)
+{
+  const size_t ahead2=LOOKUP_PREFETCH/2;
+  for (size_t k=0; k<n && k<LOOKUP_PREFETCH; k++) {
+    prefetchTable1(keys[k]);
+  }
+  for (size_t k=0; k<n; k++) {
+    if (k+LOOKUP_PREFETCH<n) {
+      prefetchTable1(keys[k+LOOKUP_PREFETCH]);
+    }
+    if (k+ahead2<n) {
+      IndexT v=table1Value(keys[k+ahead2]);
+      if (v!=EMPTY && !isDocid(v)) {
+        if (isTable3Ptr(v)) {
+          PREFETCH(table3[ptrValue(v)].begin());
+        } else {
+          PREFETCH(&table2[(size_t)ptrValue(v)*2]);
+        }
+      }
+    }
+    U32 i=keys[k];
+    if (k>0 && i==keys[k-1]) continue;
+#ifdef STRICT_CHECKS
+    if ((size_t)i>=TABLE1_SIZE) {
+      cerr << "KeyTable::lookupKeys: Out of bounds error, attempt to access KeyTable index " << i << " where TABLE1_SIZE=" << TABLE1_SIZE << endl;
+      exit(2);
+    }
+#endif
+    IndexT v=table1Value(i);
+    if (v==EMPTY) continue;
+    size_t start=result.docids.size();
+    if (isDocid(v)) {
+      result.docids.push_back((docid)v);
+    } else if (!isTable3Ptr(v)) {
+      size_t i2=(size_t)ptrValue(v)*2;
+      result.docids.push_back((docid)table2[i2]);
+      result.docids.push_back((docid)table2[i2+1]);
     } else {
-      ptrTable1++;
+      table3_element* t3=&table3[ptrValue(v)];
+      if (t3->isSaturated()) continue;
+      if (t3->isBitmap()) {
+        t3->appendTo(result.docids);
+      } else {
+        result.docids.insert(result.docids.end(),t3->begin(),t3->end());
+      }
+    }
+    if (numUncompacted>0) {
+      size_t m=start;
+      for (size_t d=start; d<result.docids.size(); d++) {
+        if (!isDeleted(result.docids[d])) result.docids[m++]=result.docids[d];
+      }
+      result.docids.resize(m);
+      if (m==start) continue;
     }
+    result.keys.push_back(i);
+    result.offsets.push_back(result.docids.size());
   }
+}
 
-  // ...and table2 and table3 (which will still be counted correctly
-  // if there is no table1)
-  for (int j=0; j<table2_size; j++) {
-    if (table2[j*2]>0) {
-      numTable2++;
-    } else {
-      numTable3++;
-      int s=table3[-table2[j*2]-1].size();
-      totTable3+=s;
-      t3_mem+=table3[-table2[j*2]-1].size_in_bytes();
-      if (s>maxTable3) maxTable3=s;
-      if (s<minTable3) minTable3=s;
+
+// Bytes of memory used by the tables, as in writeStats(memory)
+//
+template <class IndexT, class DocidT>
+size_t KeyTableT<IndexT,DocidT>::memoryBytes(void) {
+  size_t t1=(frozen ? frozenBytes() : sizeof(IndexT)*TABLE1_SIZE);
+  return(t1+sizeof(DocidT)*TABLE2_SIZE*2+sizeof(table3_element)*table3.capacity()+t3Bytes);
+}
+
+ 
+// Write summary of table use. Counts are maintained incrementally by addKey()
+// and friends so this is cheap. If verify is set then all tables are scanned
+// (using threads) to check the counts, any disagreement gives a WARNING, and
+// the table3 lists are broken down by container.
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::writeStats(ostream& out, bool verify, int threads) {
+  size_t numTable3=table3.size();
+  size_t ptrTable1=(TABLE1_SIZE>0 ? numTable2+numTable3 : 0);
+  int minTable3=0;
+  int maxTable3=0;
+  for (size_t s=0; s<table3Sizes.size(); s++) {
+    if (table3Sizes[s]>0) {
+      if (minTable3==0) minTable3=(int)s;
+      maxTable3=(int)s;
     }
   }
 
+  float t1_mem= sizeof(IndexT)*TABLE1_SIZE / (1024.0*1024.0);     // 1 IndexT per entry
+  if (frozen) t1_mem=frozenBytes() / (1024.0*1024.0);
+  float t2_mem= sizeof(DocidT)*TABLE2_SIZE*2 / (1024.0*1024.0);   // 2 DocidT per entry
+  float t3_mem= sizeof(table3_element)*table3.capacity()+t3Bytes; // 1 element per entry + lists
+
+  if (verify) {
+    verifyStats(out,ptrTable1,minTable3,maxTable3,threads);
+  }
+
   // Calculate % of keys in each table
   float keys_pct = (numTable1 + numTable2 + table3.size() ) / 100.0;
   cout.precision(3);
@@ -554,25 +1409,51 @@ void KeyTable::writeStats(ostream& out) {
     out << "KeyTable::writeStats(table1): numTable1=" << numTable1
         << " (" << (numTable1/keys_pct) << "%)"
         << " ptrTable1=" << ptrTable1 
-        << " TABLE1_SIZE=" << TABLE1_SIZE << endl;
-    if (ptrTable1!=table2_size) {
-      out << "KeyTable::writeStats(table1): WARNING: ptrTable1!=table2_size\n";
-    }
+        << " TABLE1_SIZE=" << TABLE1_SIZE << (frozen ? " (frozen)" : "") << endl;
   } else {
     out << "KeyTable::writeStats(table1): none" << endl;
   }
   if (table2_size>0) {
     out << "KeyTable::writeStats(table2): numTable2=" << numTable2
         << " (" << (numTable2/keys_pct) << "%)"
-        << " ptrTable2=" << numTable3 
+        << " freeTable2=" << table2Free.size() 
         << " table2_size=" << table2_size << " TABLE2_SIZE=" << TABLE2_SIZE << endl;
   } 
   if (numTable3>0) {
     out << "KeyTable::writeStats(table3): numTable3=" << table3.size() 
         << " (" << (table3.size()/keys_pct) << "%)"
         << " min=" << minTable3 
-        << " max=" << maxTable3 << " ave=" << ((float)totTable3/(float)numTable3) << endl;
+        << " max=" << maxTable3 << " ave=" << (numTable3>numSaturated ? (float)totTable3/(float)(numTable3-numSaturated) : 0.0) << endl;
+  }
+  if (numTable3>0 && verify) {
+    // Container used for each list, arrays unless longer than KT3_BITMAP_MIN.
+    // Needs a pass over table3 so only with verify.
+    size_t numBitmap=0;
+    size_t bitmapDocids=0;
+    size_t bitmapContainers=0;
+    size_t denseContainers=0;
+    for (size_t i3=0; i3<numTable3; i3++) {
+      PostingBitmap* bm=table3[i3].bitmap();
+      if (bm==(PostingBitmap*)NULL) continue;
+      numBitmap++;
+      bitmapDocids+=bm->size();
+      bitmapContainers+=bm->containers.size();
+      denseContainers+=bm->numBitmapContainers();
+    }
+    out << "KeyTable::writeStats(table3): containers array=" << (numTable3-numBitmap-numSaturated)
+        << " bitmap=" << numBitmap << " (docids=" << bitmapDocids
+        << ", containers=" << bitmapContainers << " of which dense=" << denseContainers << ")"
+        << " bitmapAbove=" << KT3_BITMAP_MIN << endl;
   } 
+  if (numDeleted>0) {
+    out << "KeyTable::writeStats(deleted): numDeleted=" << numDeleted
+        << " uncompacted=" << numUncompacted << endl;
+  }
+  if (numSaturated>0) {
+    out << "KeyTable::writeStats(table3): numSaturated=" << numSaturated;
+    if (saturateAbove>0) out << " saturateAbove=" << saturateAbove;
+    out << endl;
+  }
 
   // Memory usage from C++ perspective
   t3_mem=int ( t3_mem / (1024.0*1024.0) + 0.5);
@@ -582,6 +1463,12 @@ void KeyTable::writeStats(ostream& out) {
       << "MB, table2=" << t2_mem 
       << "MB, table3=" << t3_mem
       << "MB" << endl;
+  if (TABLE1_SIZE>0 && !frozen) {
+    out << "KeyTable::writeStats(pages): table1 " << bigAllocDescription(table1Alloc) << endl;
+  }
+  if (TABLE2_SIZE>0) {
+    out << "KeyTable::writeStats(pages): table2 " << bigAllocDescription(table2Alloc) << endl;
+  }
   
   // Memory usage from system persective
   out << "KeyTable::writeStats(system): " << get_pstats_string() << endl; 
@@ -589,6 +1476,74 @@ void KeyTable::writeStats(ostream& out) {
 }
 
 
+// Scan all tables and check against the incremental counts
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::verifyStats(ostream& out, size_t ptrTable1, int minTable3, int maxTable3, int threads) {
+  typedef KeyTableT<IndexT,DocidT> KT;
+  if (threads<1) threads=1;
+
+  // Count up everything for table1 if it exists
+  size_t scanTable1=0;
+  size_t scanPtrTable1=0;
+  vector< Table1CountWork<KT> > work(threads);
+  for (int t=0; t<threads; t++) {
+    work[t].kt=this;
+    splitRange(TABLE1_SIZE,threads,t,work[t].start,work[t].end);
+  }
+  runThreads(work,table1CountThread<KT>);
+  for (int t=0; t<threads; t++) {
+    scanTable1+=work[t].numTable1;
+    scanPtrTable1+=work[t].ptrTable1;
+  }
+
+  // ...and table2 and table3 (which will still be counted correctly
+  // if there is no table1)
+  StatsVisitor<DocidT> scan;
+  vector< StatsVisitor<DocidT> > visitors(threads);
+  scanPostings(visitors);
+  for (int t=0; t<threads; t++) {
+    scan.numTable2+=visitors[t].numTable2;
+    scan.numTable3+=visitors[t].numTable3;
+    scan.totTable3+=visitors[t].totTable3;
+    scan.t3Bytes+=visitors[t].t3Bytes;
+    scan.numSaturated+=visitors[t].numSaturated;
+    if (visitors[t].maxTable3>scan.maxTable3) scan.maxTable3=visitors[t].maxTable3;
+    if (visitors[t].minTable3<scan.minTable3) scan.minTable3=visitors[t].minTable3;
+  }
+  if (scan.numTable3==scan.numSaturated) scan.minTable3=0;
+
+  int bad=0;
+  if (scanTable1!=numTable1) {
+    out << "KeyTable::writeStats(verify): WARNING: numTable1=" << numTable1 << " but scan found " << scanTable1 << endl;
+    bad++;
+  }
+  if (scanPtrTable1!=ptrTable1) {
+    out << "KeyTable::writeStats(verify): WARNING: ptrTable1=" << ptrTable1 << " but scan found " << scanPtrTable1 << endl;
+    bad++;
+  }
+  if (scan.numTable2!=numTable2) {
+    out << "KeyTable::writeStats(verify): WARNING: numTable2=" << numTable2 << " but scan found " << scan.numTable2 << endl;
+    bad++;
+  }
+  if (scan.numTable3!=table3.size() || scan.totTable3!=totTable3 || scan.t3Bytes!=t3Bytes ||
+      scan.minTable3!=minTable3 || scan.maxTable3!=maxTable3) {
+    out << "KeyTable::writeStats(verify): WARNING: table3 counts " << table3.size() << "/" << totTable3 << "/" 
+        << t3Bytes << "/" << minTable3 << "/" << maxTable3 << " (num/total/bytes/min/max) but scan found "
+        << scan.numTable3 << "/" << scan.totTable3 << "/" << scan.t3Bytes << "/" 
+        << scan.minTable3 << "/" << scan.maxTable3 << endl;
+    bad++;
+  }
+  if (scan.numSaturated!=numSaturated) {
+    out << "KeyTable::writeStats(verify): WARNING: numSaturated=" << numSaturated << " but scan found " << scan.numSaturated << endl;
+    bad++;
+  }
+  if (bad==0) {
+    out << "KeyTable::writeStats(verify): scan agrees with counts" << endl;
+  }
+}
+
+
 // Extract keys from input keymap and add to list of KeyTable indexes
 // in indexes. Does this using the MAX_INDEX bitmask to chop off all 
 // but the required number of low bytes.
@@ -596,15 +1551,31 @@ void KeyTable::writeStats(ostream& out) {
 // By using an unordered_set (type indexhashset) for indexes we avoid 
 // duplicate entries in indexes.
 //
-void KeyTable::keysToIndexes(keymap& km, indexhashset& indexes)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::keysToIndexes(keymap& km, indexhashset& indexes)
 {
   for (keymap::const_iterator kmit=km.begin(); kmit!=km.end(); kmit++) {
-    int i=(int)((kmit->first)&MAX_INDEX);
+    U32 i=(U32)((kmit->first)&MAX_INDEX);
     indexes.insert(i);
   }
 }
 
 
+// Sorted and without duplicates, ready for lookupKeys()
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::keysToIndexes(keymap& km, vector<U32>& indexes)
+{
+  indexes.clear();
+  indexes.reserve(km.size());
+  for (keymap::const_iterator kmit=km.begin(); kmit!=km.end(); kmit++) {
+    indexes.push_back((U32)((kmit->first)&MAX_INDEX));
+  }
+  sort(indexes.begin(),indexes.end());
+  indexes.erase(unique(indexes.begin(),indexes.end()),indexes.end());
+}
+
+
 
 //=======================================================================================
 // Write KeyTable routines
@@ -625,141 +1596,349 @@ int numChars(unsigned int x) {
   return(10);
 }
 
+// Number of hex digits in x
+int numChars16(size_t x) {
+  int n=1;
+  while (x>=16) {
+    x>>=4;
+    n++;
+  }
+  return(n);
+}
+
 // Write complete KeyTable (tables 1, 2 and 3) to out
 //
-int KeyTable::writeTables123(ostream& out, int* positionPtr, long int bytes) {
-  char buf[10];
-  long int bytesWritten=0;
+// If positionPtr and bytes are given then write a chunk starting at
+// *positionPtr of just over bytes, and set *positionPtr to the start of
+// the next chunk (-1 if complete).
+//
+template <class IndexT, class DocidT>
+long int KeyTableT<IndexT,DocidT>::writeTables123(ostream& out, size_t* positionPtr, long int bytes) {
   // Sanity check, barf if no table1
   if (TABLE1_SIZE<=0) {
     cerr << "KeyTable::writeTables123: Attempt to write KeyTable with no/empty table1, nothing written\n";
-    return(bytesWritten);
-  }
-  // Now see if we want just a chunk
-  int startPosition=0;
-  bool chunk=false;
-  if (positionPtr!=(int*)NULL && bytes>0) {
-    startPosition=*positionPtr;
-    chunk=true;
-  }
-  // Normal, table1,2,3...
-  int j;
-  for (j=startPosition; j<TABLE1_SIZE; j++) {
-    if (table1[j]!=EMPTY) {
-      sprintf(buf,KEY_FMT,(j|SELECT_MATCH));
-      if (table1[j]>=0) {
-        out << buf << " " << table1[j] << endl;
-        bytesWritten+=10+numChars(table1[j]);
-      } else {  // table1[j]<0 => entry in table2
-        int i2=-table1[j];
-        if (table2[(i2-1)*2]>=0) {
-          out << buf << " " << table2[(i2-1)*2] << " " << table2[(i2-1)*2+1] << endl;
-          bytesWritten+=10+numChars(table2[(i2-1)*2])+numChars(table2[(i2-1)*2+1]);
-        } else {  // table2[(i2-1)*2]<0 => entry in table3
-          out << buf;
-          bytesWritten+=9; //include endl
-          KeyTable3Element *t3=&table3[-table2[(i2-1)*2]-1];
-          for (KeyTable3Element::iterator t3i=t3->begin(); t3i!=t3->end(); t3i++) {
-            out << " " << *t3i;
-            bytesWritten+=1+numChars(*t3i);
-          } 
-          out << endl;
-        }
-      }
-    }
-    if (chunk && bytesWritten>=bytes) break;
+    return(0);
   }
-  // Sort out position if we were writing a chunk
-  if (chunk) {
-    j++;
-    while (table1[j]==EMPTY && j<TABLE1_SIZE) {
-      j++; // Skip any following empty positions
-    }
-    if (j>=TABLE1_SIZE) { // complete
-      *positionPtr=-1;
-    } else {
-      *positionPtr=j;
-    }
+  size_t start=0;
+  size_t end=TABLE1_SIZE;
+  if (positionPtr!=(size_t*)NULL && bytes>0) {
+    start=*positionPtr;
+    end=chunkEnd(true,start,bytes,*positionPtr);
   }
-  return(bytesWritten);
+  OutBuffer ob(out);
+  writeRange(ob,true,start,end);
+  ob.flush();
+  return((long int)ob.bytes());
 }
 
 
 // Write just tables 2 and 3.
 //
 // Without table1 we don't know which short keys docs share, 
-// just that they share them
+// just that they share them. Positions 0...table2_size-1 are the table2
+// entries (free entries are skipped) and table2_size... are the table3
+// entries.
 //
-int KeyTable::writeTables23(ostream& out, int* positionPtr, long int bytes) {
-  char buf[10];
-  long int bytesWritten=0;
-  // Now see if we want just a chunk
-  int startPosition=0;
-  bool chunk=false;
-  if (positionPtr!=(int*)NULL && bytes>0) {
-    startPosition=*positionPtr;
-    chunk=true;
-  }
-  int j;
-  for (j=startPosition; j<table2_size; j++) {
-    sprintf(buf,"XX%06x",j);
-    if (table2[j*2]>0) {
-      out << buf << " "  << table2[j*2] << " " << table2[j*2+1] << endl;
-      bytesWritten+=10+numChars(table2[j*2])+numChars(table2[j*2+1]);
+template <class IndexT, class DocidT>
+long int KeyTableT<IndexT,DocidT>::writeTables23(ostream& out, size_t* positionPtr, long int bytes) {
+  size_t start=0;
+  size_t end=table2_size+table3.size();
+  if (positionPtr!=(size_t*)NULL && bytes>0) {
+    start=*positionPtr;
+    end=chunkEnd(false,start,bytes,*positionPtr);
+  }
+  OutBuffer ob(out);
+  writeRange(ob,false,start,end);
+  ob.flush();
+  return((long int)ob.bytes());
+}
+
+
+// Number of bytes in the line written for position j (0 for none), see
+// writeRange() for positions
+//
+template <class IndexT, class DocidT>
+long int KeyTableT<IndexT,DocidT>::lineBytes(bool allTables, size_t j) {
+  long int b=KEY_DIGITS+1; // key and newline
+  // Positions without table1 are written "XX" and at least 6 hex digits,
+  // table2 and table3 alike
+  if (!allTables && j>=0x1000000) b+=numChars16(j)-6;
+  if (numUncompacted>0) {
+    // Deleted docids are left out, see liveIds()
+    vector<U32> ids;
+    U32 saturatedCount;
+    if (!liveIds(allTables,j,ids,saturatedCount)) return(0);
+    if (saturatedCount>0) return(b+2+numChars(saturatedCount));
+    for (size_t k=0; k<ids.size(); k++) b+=1+numChars(ids[k]);
+    return(b);
+  }
+  if (allTables) {
+    IndexT v=table1Value(j);
+    if (v==EMPTY) {
+      return(0);
+    } else if (isDocid(v)) {
+      return(b+1+numChars((U32)v));
+    } else if (!isTable3Ptr(v)) {
+      size_t i2=ptrValue(v);
+      return(b+2+numChars(table2[i2*2])+numChars(table2[i2*2+1]));
+    }
+    j=table2_size+ptrValue(v);
+  } else if (j<table2_size) {
+    if (table2[j*2]==0) return(0); // free
+    return(b+2+numChars(table2[j*2])+numChars(table2[j*2+1]));
+  }
+  table3_element* t3=&table3[j-table2_size];
+  if (t3->isSaturated()) return(b+2+numChars(t3->saturatedCount()));
+  if (t3->isBitmap()) {
+    vector<U32> ids;
+    t3->appendTo(ids);
+    for (size_t k=0; k<ids.size(); k++) b+=1+numChars(ids[k]);
+    return(b);
+  }
+  for (typename table3_element::iterator t3i=t3->begin(); t3i!=t3->end(); t3i++) {
+    b+=1+numChars(*t3i);
+  }
+  return(b);
+}
+
+
+// Find the end (exclusive) of the chunk starting at start which is the
+// first point at which at least bytes will have been written. Sets next to
+// the start of the following chunk (skipping unused positions) or -1 if
+// this chunk completes the table.
+//
+template <class IndexT, class DocidT>
+size_t KeyTableT<IndexT,DocidT>::chunkEnd(bool allTables, size_t start, long int bytes, size_t& next) {
+  size_t endPosition=(allTables ? TABLE1_SIZE : table2_size+table3.size());
+  long int b=0;
+  size_t j;
+  for (j=start; j<endPosition; j++) {
+    b+=lineBytes(allTables,j);
+    if (b>=bytes) break;
+  }
+  if (j<endPosition) j++;
+  size_t end=j;
+  while (j<endPosition && lineBytes(allTables,j)==0) {
+    j++; // Skip any following empty positions
+  }
+  next=(j>=endPosition ? (size_t)-1 : j);
+  return(end);
+}
+
+
+// Docids written for position j (see writeRange()) in ids, less any
+// deleted docids, so that a table with deletions not yet compacted (maybe
+// frozen) is written as compact() would leave it without changing it.
+// Sets saturatedCount for a saturated list, else 0. Returns false if
+// nothing is written for j: no docids left, or fewer than two without
+// table1 as a single docid shares no key.
+//
+template <class IndexT, class DocidT>
+bool KeyTableT<IndexT,DocidT>::liveIds(bool allTables, size_t j, vector<U32>& ids, U32& saturatedCount) {
+  ids.clear();
+  saturatedCount=0;
+  table3_element* t3=(table3_element*)NULL;
+  if (allTables) {
+    IndexT v=table1Value(j);
+    if (v==EMPTY) return(false);
+    if (isDocid(v)) {
+      ids.push_back((U32)v);
+    } else if (!isTable3Ptr(v)) {
+      size_t i2=ptrValue(v);
+      ids.push_back((U32)table2[i2*2]);
+      ids.push_back((U32)table2[i2*2+1]);
     } else {
-      out << buf;
-      bytesWritten+=9; //include endl
-      KeyTable3Element* t3=&table3[-table2[j*2]-1];
-      for (KeyTable3Element::iterator t3i=t3->begin(); t3i!=t3->end(); t3i++) {
-         out << " " << *t3i;
-         bytesWritten+=1+numChars(*t3i);
-      } 
-      out << endl;
+      t3=&table3[ptrValue(v)];
     }
-    if (chunk && bytesWritten>=bytes) break;
+  } else if (j<table2_size) {
+    if (table2[j*2]==0) return(false); // free
+    ids.push_back((U32)table2[j*2]);
+    ids.push_back((U32)table2[j*2+1]);
+  } else {
+    t3=&table3[j-table2_size];
+  }
+  if (t3!=(table3_element*)NULL) {
+    if (t3->isSaturated()) {
+      // Left alone as by compact(), doesn't record the documents
+      saturatedCount=(U32)t3->saturatedCount();
+      return(true);
+    }
+    t3->appendTo(ids);
+  }
+  size_t m=0;
+  for (size_t k=0; k<ids.size(); k++) {
+    if (!isDeleted(ids[k])) ids[m++]=ids[k];
   }
-  // Sort out position if we were writing a chunk
-  if (chunk) {
-    if ((++j)>=table2_size) { // complete
-      *positionPtr=-1;
+  ids.resize(m);
+  return(m>=(allTables ? (size_t)1 : (size_t)2));
+}
+
+
+// Write positions [start,end) to ob. With allTables the positions are
+// table1 indexes and lines are keyed by short key, otherwise positions are
+// as described for writeTables23(). Deleted docids are left out.
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::writeRange(OutBuffer& ob, bool allTables, size_t start, size_t end) {
+  vector<U32> ids; // bitmap lists decoded here
+  for (size_t j=start; j<end; j++) {
+    if (numUncompacted>0) {
+      // Slower path, filter each list, see liveIds()
+      U32 saturatedCount;
+      if (!liveIds(allTables,j,ids,saturatedCount)) continue;
+      if (allTables) {
+        ob.putHex((U32)(j|SELECT_MATCH),KEY_DIGITS);
+      } else {
+        ob.putStr("XX");
+        ob.putHex(j,6);
+      }
+      if (saturatedCount>0) {
+        ob.putStr(" *");
+        ob.putDec(saturatedCount);
+      } else {
+        for (size_t k=0; k<ids.size(); k++) {
+          ob.putChar(' ');
+          ob.putDec(ids[k]);
+        }
+      }
+      ob.putChar('\n');
+      continue;
+    }
+    table3_element* t3=(table3_element*)NULL;
+    if (allTables) {
+      IndexT v=table1Value(j);
+      if (v==EMPTY) continue;
+      ob.putHex((U32)(j|SELECT_MATCH),KEY_DIGITS);
+      if (isDocid(v)) {
+        ob.putChar(' ');
+        ob.putDec((U32)v);
+      } else if (!isTable3Ptr(v)) { // entry in table2
+        size_t i2=ptrValue(v);
+        ob.putChar(' ');
+        ob.putDec((U32)table2[i2*2]);
+        ob.putChar(' ');
+        ob.putDec((U32)table2[i2*2+1]);
+      } else {  // entry in table3
+        t3=&table3[ptrValue(v)];
+      }
+    } else if (j<table2_size) {
+      if (table2[j*2]==0) continue; // free
+      ob.putStr("XX");
+      ob.putHex(j,6);
+      ob.putChar(' ');
+      ob.putDec((U32)table2[j*2]);
+      ob.putChar(' ');
+      ob.putDec((U32)table2[j*2+1]);
     } else {
-      *positionPtr=j;
+      ob.putStr("XX");
+      ob.putHex(j,6);
+      t3=&table3[j-table2_size];
     }
+    if (t3!=(table3_element*)NULL && t3->isSaturated()) {
+      ob.putStr(" *");
+      ob.putDec((U32)t3->saturatedCount());
+    } else if (t3!=(table3_element*)NULL && t3->isBitmap()) {
+      ids.clear();
+      t3->appendTo(ids);
+      for (size_t k=0; k<ids.size(); k++) {
+        ob.putChar(' ');
+        ob.putDec(ids[k]);
+      }
+    } else if (t3!=(table3_element*)NULL) {
+      for (typename table3_element::iterator t3i=t3->begin(); t3i!=t3->end(); t3i++) {
+        ob.putChar(' ');
+        ob.putDec(*t3i);
+      } 
+    }
+    ob.putChar('\n');
   }
-  return(bytesWritten);
 }
 
 
-// Write table to multiple files of up to maxFileSize bytes each
+// Work for one thread of writeMultiFile, writes every threads'th file
 //
-int KeyTable::writeMultiFile(string& baseName, bool allTables, long int maxFileSize) {
-  int numFiles=0;
-  int position=0;
-  long int bytesWritten=0;
-  do {
-    numFiles++;
+template <class KT>
+struct WriteFilesWork {
+  KT* kt;
+  string* baseName;
+  bool allTables;
+  vector<size_t>* starts; // start of each file, last entry is end of table
+  int thread;
+  int threads;
+  long int bytesWritten;
+};
+
+
+template <class KT>
+void* writeFilesThread(void* arg)
+{
+  WriteFilesWork<KT>* w=(WriteFilesWork<KT>*)arg;
+  vector<size_t>& starts=*(w->starts);
+  w->bytesWritten=0;
+  for (size_t f=w->thread; f+1<starts.size(); f+=w->threads) {
     ostringstream fileName;
-    fileName << baseName << "_" << numFiles << ".keytable";
+    fileName << *(w->baseName) << "_" << (f+1) << ".keytable";
     ofstream ktout;
     ktout.open(fileName.str().c_str(),ios_base::out);
     if (!ktout.good()) {
       cerr << "KeyTable::writeMultiFile: Error - can't write to " << fileName.str() << endl;
       exit(2);
     }
-    if (allTables) {
-      bytesWritten+=writeTables123(ktout,&position,maxFileSize);
-    } else {
-      bytesWritten+=writeTables23(ktout,&position,maxFileSize);
-    }
-  } while (position>0);
+    OutBuffer ob(ktout);
+    w->kt->writeRange(ob,w->allTables,starts[f],starts[f+1]);
+    ob.flush();
+    w->bytesWritten+=ob.bytes();
+  }
+  return(NULL);
+}
+
+
+// Write table to multiple files of up to maxFileSize bytes each
+//
+// The chunk boundaries are found first (cheap, no formatting) so that the
+// files can then be written by several threads at once.
+//
+template <class IndexT, class DocidT>
+int KeyTableT<IndexT,DocidT>::writeMultiFile(string& baseName, bool allTables, long int maxFileSize, int threads) {
+  typedef KeyTableT<IndexT,DocidT> KT;
+  if (allTables && TABLE1_SIZE<=0) {
+    cerr << "KeyTable::writeMultiFile: Attempt to write KeyTable with no/empty table1, nothing written\n";
+    return(0);
+  }
+  vector<size_t> starts;
+  size_t position=0;
+  do {
+    starts.push_back(position);
+    chunkEnd(allTables,position,maxFileSize,position);
+  } while (position!=(size_t)-1);
+  starts.push_back(allTables ? TABLE1_SIZE : table2_size+table3.size());
+  int numFiles=starts.size()-1;
+
+  if (threads<1) threads=1;
+  if (threads>numFiles) threads=numFiles;
+  vector< WriteFilesWork<KT> > work(threads);
+  for (int t=0; t<threads; t++) {
+    work[t].kt=this;
+    work[t].baseName=&baseName;
+    work[t].allTables=allTables;
+    work[t].starts=&starts;
+    work[t].thread=t;
+    work[t].threads=threads;
+  }
+  runThreads(work,writeFilesThread<KT>);
+  long int bytesWritten=0;
+  for (int t=0; t<threads; t++) {
+    bytesWritten+=work[t].bytesWritten;
+  }
   cout << "KeyTable::writeMultiFile: wrote " << bytesWritten << " in " << numFiles << " files." << endl;
   return(numFiles);
 }
 
 
-void KeyTable::writeIndexes(ostream& out, indexhashset& indexes)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::writeIndexes(ostream& out, indexhashset& indexes)
 {
-  char buf[10];
+  char buf[20];
   for (indexhashset::const_iterator iit=indexes.begin(); iit!=indexes.end(); iit++) {
     sprintf(buf,KEY_FMT,*iit);
     out << buf << endl;
@@ -773,7 +1952,8 @@ void KeyTable::writeIndexes(ostream& out, indexhashset& indexes)
 
 // Simple setter method fro pruneAbove Control
 //
-void KeyTable::setPruneAbove(int p)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::setPruneAbove(int p)
 {
   if (p<0 || p>1000000) {
     cerr << "KeyTable::pruneAbove: non-sensical pruneAbove value '" << p << "', aborting!" << endl;
@@ -785,29 +1965,73 @@ void KeyTable::setPruneAbove(int p)
 
 // Set to not prune
 //
-void KeyTable::noPrune(void)
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::noPrune(void)
 {
   setPruneAbove(0);
 }
 
 
-bool KeyTable::readDocidList(istream& in, intv &docids)
+// Set the number of docids above which a table3 list is saturated, 0 for
+// no limit. Applies to lists as they are next added to.
+//
+template <class IndexT, class DocidT>
+void KeyTableT<IndexT,DocidT>::setSaturateAbove(int s)
+{
+  if (s<0) s=0;
+  if (s>0 && s<3) {
+    cerr << "KeyTable::setSaturateAbove: saturateAbove value '" << s << "' must be 0 or at least 3, aborting!" << endl;
+    exit(2);
+  }
+  saturateAbove=s;
+}
+
+
+// Read space separated docids to end of line, or "*count" for a saturated
+// key in which case saturatedCount is set (else 0)
+//
+template <class IndexT, class DocidT>
+bool KeyTableT<IndexT,DocidT>::readDocidList(istream& in, intv &docids, U32& saturatedCount)
 {
   int ch;
   char buf[12];
+  saturatedCount=0;
+  while ((ch=in.get())==' ') { /*nuttin*/ }
+  if (ch=='*') {
+    in >> saturatedCount;
+    if (!in || saturatedCount==0) {
+      cerr << "KeyTable::readDocidList: Error - bad saturated count" << endl;
+      return(false);
+    }
+    while ((ch=in.get())==' ') { /*nuttin*/ }
+    if (ch!='\n') {
+      cerr << "KeyTable::readDocidList: Error - bad char '" << (char)ch << "' (" << ch << ") after saturated count" << endl;
+      return(false);
+    }
+    return(true);
+  }
+  in.putback(ch);
   while ((ch=in.get())==' ' || (ch>='0' && ch<='9')) {
     in.putback(ch);    
     while ((ch=in.get())==' ') { /*nuttin*/ }
     in.putback(ch);
     int j;
-    for (j=0; (((ch=in.get())>='0' && ch<='9') && j<KEY_DIGITS); j++) { 
+    for (j=0; (((ch=in.get())>='0' && ch<='9') && j<DOCID_DIGITS); j++) { 
       buf[j]=(char)ch;
     }
     buf[j]='\0';
+    if (ch>='0' && ch<='9') {
+      cerr << "KeyTable::readDocidList: Error - docid '" << buf << (char)ch << "...' too long" << endl;
+      return(false);
+    }
     in.putback(ch);
-    if (j<KEY_DIGITS) {
-      int docid=atoi(buf);
-      docids.push_back(docid);
+    if (j>0) {
+      unsigned long docid=strtoul(buf,(char**)NULL,10);
+      if (docid>(unsigned long)MAX_DOCID) {
+        cerr << "KeyTable::readDocidList: Error - docid " << docid << " > MAX_DOCID (" << MAX_DOCID << ")" << endl;
+        return(false);
+      }
+      docids.push_back((int)docid);
     }
   }
   if (ch!='\n') {
@@ -820,13 +2044,14 @@ bool KeyTable::readDocidList(istream& in, intv &docids)
 
 // Parse index to table1 from string (KEY_DIGITS byte hex)
 //
-int KeyTable::stringToIndex(char* keystr)
+template <class IndexT, class DocidT>
+U32 KeyTableT<IndexT,DocidT>::stringToIndex(char* keystr)
 {
   if ((int)strlen(keystr)!=KEY_DIGITS) {
     cerr << "KeyTable::readIndex: bad index length, " << strlen(keystr) << " not " << KEY_DIGITS << " chars" << endl;
     exit(1);
   }
-  int key=0;
+  U32 key=0;
   for (int j=0; j<KEY_DIGITS; j++) {
     int d;
     if (keystr[j]>='0' and keystr[j]<='9') {
@@ -850,7 +2075,8 @@ int KeyTable::stringToIndex(char* keystr)
 //
 // Returns the number of keys added to the KeyTable/keymap
 //
-int KeyTable::readTables123(istream& in, indexhashset* filterKeys, keymap* km)
+template <class IndexT, class DocidT>
+int KeyTableT<IndexT,DocidT>::readTables123(istream& in, indexhashset* filterKeys, keymap* km)
 {
   // Sanity check
   if (!in || in.eof()) {
@@ -861,7 +2087,7 @@ int KeyTable::readTables123(istream& in, indexhashset* filterKeys, keymap* km)
   int numKeys=0;
   int line=0;
   char* buf = new char[18];
-  int key;
+  U32 key;
   intv docids;
   while (in && !in.eof()) {
     line++;
@@ -880,7 +2106,8 @@ int KeyTable::readTables123(istream& in, indexhashset* filterKeys, keymap* km)
     }
     //===== Get docids =====
     docids.clear();
-    if (!readDocidList(in,docids)) {
+    U32 saturatedCount;
+    if (!readDocidList(in,docids,saturatedCount)) {
       cerr << "KeyTable::readTables123[" << line << "] bad line, error reading docid list" << endl;
       exit(2);
     }
@@ -896,19 +2123,23 @@ int KeyTable::readTables123(istream& in, indexhashset* filterKeys, keymap* km)
     //
     // Check key against supplied list if filterKeys, ignore this entry if 
     // list is given by there is no match
-    if ( (pruneAbove==0 || (int)docids.size()<=pruneAbove) &&
+    int numDocs=(saturatedCount>0 ? (int)saturatedCount : (int)docids.size());
+    if ( (pruneAbove==0 || numDocs<=pruneAbove) &&
          (filterKeys==(indexhashset*)NULL || (filterKeys->find(key)==filterKeys->end())) ) {
       //===== Add key and ids to KeyTable or keymap =====
-      if (km==(keymap*)NULL) {
+      if (saturatedCount>0) {
+        // Saturated key, no docids to put in a keymap
+        if (km==(keymap*)NULL) addSaturatedKey((U32)(key&MAX_INDEX),saturatedCount);
+      } else if (km==(keymap*)NULL) {
         // KeyTable...
         numDocidsInRead=docids.size()+1+docids.size()/4;
         for (unsigned int j=0; j<docids.size(); j++) {
-          addKey(key,docids[j]);
+          addKey((U32)(key&MAX_INDEX),(U32)docids[j]);
         }
       } else {
         // keymap...
         //cout << "km->insert(" << kgramkeyToString(key) << ",...)" << endl;
-        KgramInfo* kip=new KgramInfo(docids);
+        KgramInfo* kip=new(km->arena) KgramInfo(docids,&km->arena);
         km->insert(keymap::value_type((kgramkey)key,kip));
       }
     }
@@ -929,7 +2160,8 @@ int KeyTable::readTables123(istream& in, indexhashset* filterKeys, keymap* km)
 // Format is dummy number (must be in sequence but not necessarily complete) and 
 // then document list on each line. Dummy number is 'XX######' where # is a hex digit.
 // 
-int KeyTable::readTables23(istream& in, indexhashset* filterKeys, keymap* km)
+template <class IndexT, class DocidT>
+int KeyTableT<IndexT,DocidT>::readTables23(istream& in, indexhashset* filterKeys, keymap* km)
 {
   cerr << "KeyTable::readTables23 NOT YET IMPLEMENTED!!" << endl;
   exit(99);
@@ -938,7 +2170,8 @@ int KeyTable::readTables23(istream& in, indexhashset* filterKeys, keymap* km)
 }
 
 
-int KeyTable::readMultiFile(string& baseName, indexhashset* filterKeys, keymap* km)
+template <class IndexT, class DocidT>
+int KeyTableT<IndexT,DocidT>::readMultiFile(string& baseName, indexhashset* filterKeys, keymap* km)
 {
   int numFiles=0;
   bool allTables=true;
@@ -958,7 +2191,7 @@ int KeyTable::readMultiFile(string& baseName, indexhashset* filterKeys, keymap*
         cout << "KeyTable::readMultiFile: First char is '" << (char)ch << "', expecting tables";
         if (allTables) { cout << "123" << endl; } else { cout << "23" << endl; }
       } else if (allTables!=(ch!='X')) {
-        cout << "KeyTable::readMultiFile: Filetype mistmatch in file " << fileName << ", first char is '" << (char)ch << "'" << endl;
+        cout << "KeyTable::readMultiFile: Filetype mistmatch in file " << fileName.str() << ", first char is '" << (char)ch << "'" << endl;
         exit(2);
       }
       if (allTables) {
@@ -988,7 +2221,8 @@ int KeyTable::readMultiFile(string& baseName, indexhashset* filterKeys, keymap*
 
 // Need to cope also with case of no table1, test for TABLE1_SIZE==0 [Simeon/2005-08-05]
 //
-ostream& operator<<(ostream& out, KeyTable& k) {
+template <class IndexT, class DocidT>
+ostream& operator<<(ostream& out, KeyTableT<IndexT,DocidT>& k) {
   if (k.TABLE1_SIZE>0) {
     // Normal, table1,2,3...
     k.writeTables123(out);
@@ -1007,7 +2241,8 @@ ostream& operator<<(ostream& out, KeyTable& k) {
 // First character is examined to determin whether this is a table123 or table23
 // data dump. If it is 'X' then we assume table23.
 //
-istream& operator>>(istream& in, KeyTable& k) {
+template <class IndexT, class DocidT>
+istream& operator>>(istream& in, KeyTableT<IndexT,DocidT>& k) {
   int ch=in.get();
   in.putback(ch);
   if (ch=='X') {
@@ -1017,3 +2252,52 @@ istream& operator>>(istream& in, KeyTable& k) {
   }
   return(in);
 }
+
+
+//=======================================================================================
+// KeyTableLookup, results from KeyTable::lookupKeys()
+//=======================================================================================
+
+KeyTableLookup::KeyTableLookup(void)
+{
+  clear();
+}
+
+
+void KeyTableLookup::clear(void)
+{
+  keys.clear();
+  docids.clear();
+  offsets.clear();
+  offsets.push_back(0);
+}
+
+
+// Find docids that appear in the postings of more than n keys, same
+// semantics and order as KeyMap::getCommonDocs(). Counts with this
+// thread's DocCounter so the cost depends only on the number of postings.
+//
+void KeyTableLookup::getCommonDocs(DocPairVector& dpv, int n, docid id2)
+{
+  DocCounter& counter=DocCounter::forThread();
+  counter.clear();
+  for (size_t j=0; j<docids.size(); j++) {
+    counter.add(docids[j]);
+  }
+  counter.getCommonDocs(dpv,n,id2);
+}
+
+
+//=======================================================================================
+// Instantiations for the storage types we expect to use, see KeyTable.h
+//=======================================================================================
+
+#define INSTANTIATE_KEYTABLE(I,D) \
+  template class KeyTableT<I,D>; \
+  template ostream& operator<<(ostream& out, KeyTableT<I,D>& k); \
+  template istream& operator>>(istream& in, KeyTableT<I,D>& k);
+
+INSTANTIATE_KEYTABLE(U32,U32)
+INSTANTIATE_KEYTABLE(U64,U32)
+INSTANTIATE_KEYTABLE(U32,U24)
+INSTANTIATE_KEYTABLE(U32,U16)
@@ -1,6 +1,16 @@
-// A lookup table of short keys to document ids. Optimized for the case where 
-// most keys point to zero or one document id. 
+// A lookup table of short keys to document ids. Optimized for the case where
+// most keys point to zero or one document id.
 // Simeon Warner - 2005-08-03...
+//
+// The table is a template on the types used for storage:
+//
+//   IndexT - unsigned type of table1 entries (U32 or U64), this sets the
+//            limit on the number of entries in table2 and table3
+//   DocidT - type used to store docids in table2 and table3 (U16, U24
+//            or U32), this sets the limit on the maximum docid
+//
+// Most code uses the KeyTable typedef at the end of this file which is
+// selected at build time, see KEYTABLE_INDEX and KEYTABLE_DOCID below.
 
 #ifndef __INC_KeyTable
 #define __INC_KeyTable 1
@@ -10,70 +20,186 @@
 #include "KeyMap.h"
 #include "DocPair.h"
 #include "KeyTable3Element.h"
+#include "OutBuffer.h"
+#include "succinct.h"
+#include "bigalloc.h"
 
-typedef vector<KeyTable3Element> table3_type;
+// Result of a batched lookup with KeyTable::lookupKeys(). The docids for
+// the matched short key keys[k] are docids[offsets[k]..offsets[k+1]-1] so
+// that all postings are in one contiguous buffer. Reuse the same object for
+// successive lookups to avoid reallocation.
+class KeyTableLookup
+{
+public:
+  vector<U32> keys;       // short keys that had entries, in lookup order
+  vector<size_t> offsets; // start of postings for each key, plus end marker
+  vector<docid> docids;   // all postings
+
+  KeyTableLookup(void);
+  void clear(void);
+  size_t size(void) { return(keys.size()); }
+  size_t numDocids(size_t k) { return(offsets[k+1]-offsets[k]); }
+  docid* docidsFor(size_t k) { return(&docids[0]+offsets[k]); }
+  void getCommonDocs(DocPairVector& dpv, int n, docid id2=9999999);
+};
 
-class KeyTable
+template <class IndexT, class DocidT>
+class KeyTableT
 {
 public:
+  typedef KeyTable3ElementT<DocidT> table3_element;
+  typedef vector<table3_element> table3_type;
+  typedef IndexT index_type;
+
   // SETUP
   int KEY_BITS;    // number of bits used in key
   int KEY_DIGITS;  // number of hex digits use to read/write key
   char* KEY_FMT;   // printf format for KEY_DIGITS hex digits
-  int MAX_INDEX;   // largest index value, usually same as TABLE1_SIZE-1
-  int EMPTY;       // value used to mark empty spaces in table1
+  U32 MAX_INDEX;   // largest index value, usually same as TABLE1_SIZE-1
+  IndexT EMPTY;    // value used to mark empty spaces in table1
+  U32 MAX_DOCID;   // largest docid that can be stored with IndexT/DocidT, <=INT_MAX
+  IndexT MAX_POINTER; // largest pointer into table2 or table3
   // DATA
-  int TABLE1_SIZE;
-  int* table1;
-  int TABLE2_SIZE;
-  int* table2;
-  int table2_size;
+  size_t TABLE1_SIZE;
+  IndexT* table1;
+  size_t TABLE2_SIZE;
+  DocidT* table2;
+  size_t table2_size;
   table3_type table3;
-  int maxDocid;
+  U32 maxDocid;
+  bool frozen;     // table1 replaced by compact read-only form, see freeze()
+  // STATS, kept up to date by addKey() etc. so writeStats() needn't scan
+  size_t numTable1;     // keys with one docid in table1
+  size_t numTable2;     // keys with two docids in table2 (excludes free)
+  size_t totTable3;     // total docids in table3 lists
+  size_t t3Bytes;       // memory used by table3 lists
+  size_t numSaturated;  // table3 lists saturated, see setSaturateAbove()
+  // DELETED DOCUMENTS, see deleteDoc()
+  vector<bool> deleted; // tombstone for each deleted docid
+  size_t numDeleted;    // documents deleted
+  size_t numUncompacted; // deleted documents whose docids are still in the tables
+  vector<size_t> table3Sizes; // number of table3 lists of each length
 
   // METHODS
-  KeyTable(int bits, bool dummy=false, int bitmask=0, int bitmaskMatch=0);
-  ~KeyTable(void);
+  KeyTableT(int bits, bool dummy=false, int bitmask=0, int bitmaskMatch=0);
+  ~KeyTableT(void);
   void growTable2(void);
   void dropTable1(void);
-  void addKey(kgramkey& key, int docid);
-  void addKey(int i, int docid);
-  int addKeyTable2(int i, int docid);
-  int addKeyTable3(int i, int docid);
+  void freeze(void);
+  void thaw(void);
+  void addKey(kgramkey& key, U32 docid);
+  void addKey(U32 i, U32 docid);
+  IndexT addKeyTable2(U32 i, U32 docid);
+  IndexT addKeyTable3(U32 i, U32 docid);
+  void addSaturatedKey(U32 i, U32 count);
+  bool isSaturated(U32 i);
   //intv& operator[](int i);
-  void getDocids(intv& docids, int i);
+  void getDocids(intv& docids, U32 i);
+  void deleteDoc(U32 docid);
+  bool isDeleted(U32 docid) { return(docid<deleted.size() && deleted[docid]); }
+  void compact(void);
 
-  void getOverlapIds(intv& docids, int n);
-  void getOverlapDocs(DocPairVector& docpairs, intv& docids, int n);
+  void getOverlapIds(intv& docids, int n, int threads=1);
+  void getOverlapDocs(DocPairVector& docpairs, intv& docids, int n, int threads=1);
   void getOverlapKeys(keymap& kms, keymap& kmd);
   void getOverlapKeys(indexhashset& indexes, keymap& kmd);
+  void getOverlapKeys(vector<U32>& indexes, keymap& kmd);
+  void lookupKeys(const U32* keys, size_t n, KeyTableLookup& result);
   void keysToIndexes(keymap& km, indexhashset& indexes);
-  
-  void writeStats(ostream& out);
-  int writeTables123(ostream& out, int* positionPtr=(int*)NULL, long int bytes=-1);
-  int writeTables23(ostream& out, int* postionPtr=(int*)NULL, long int bytes=-1);
-  int writeMultiFile(string& baseName, bool allTables=1, long int maxFileSize=MAX_FILE_SIZE);
+  void keysToIndexes(keymap& km, vector<U32>& indexes);
+
+  void writeStats(ostream& out, bool verify=false, int threads=1);
+  size_t memoryBytes(void);
+  long int writeTables123(ostream& out, size_t* positionPtr=(size_t*)NULL, long int bytes=-1);
+  long int writeTables23(ostream& out, size_t* postionPtr=(size_t*)NULL, long int bytes=-1);
+  int writeMultiFile(string& baseName, bool allTables=1, long int maxFileSize=MAX_FILE_SIZE, int threads=1);
+  void writeRange(OutBuffer& ob, bool allTables, size_t start, size_t end);
   void writeIndexes(ostream& out, indexhashset& indexes);
 
   void setPruneAbove(int p);
   void noPrune(void);
+  void setSaturateAbove(int s);
   int readTables123(istream& in, indexhashset* filterKeys=(indexhashset*)NULL, keymap* km=(keymap*)NULL);
   int readTables23(istream& in, indexhashset* filterKeys=(indexhashset*)NULL, keymap* km=(keymap*)NULL);
   int readMultiFile(string& baseName, indexhashset* filterKeys=(indexhashset*)NULL, keymap* km=(keymap*)NULL);
 
-  friend ostream& operator<<(ostream& out, KeyTable& k);
-  friend istream& operator>>(istream& in, KeyTable& k);
+  // Whole table passes over the posting lists in table2 and table3 split
+  // across threads, see notes in KeyTable.cpp
+  size_t numPostingLists(void) { return(table2_size+table3.size()); }
+  template <class Visitor> void scanPostings(vector<Visitor>& visitors);
+  template <class Visitor> void scanPostings(vector<Visitor>& visitors, size_t start, size_t end);
+  template <class Visitor> void scanPostingRange(Visitor& visitor, size_t start, size_t end);
+
+  // Value of table1[i] whether frozen or not
+  IndexT table1Value(size_t i) { return(frozen ? frozenValue(i) : table1[i]); }
+
+  // Decoding of table1 values, see notes in KeyTable.cpp
+  bool isDocid(IndexT v) { return((v&PTR_FLAG)==0); }
+  bool isTable3Ptr(IndexT v) { return((v&T3_FLAG)!=0); }
+  IndexT ptrValue(IndexT v) { return(v&(T3_FLAG-1)); }
 
 private:
-  bool readDocidList(istream& in, intv& docids);
-  int stringToIndex(char* keystr);
+  long int lineBytes(bool allTables, size_t j);
+  bool liveIds(bool allTables, size_t j, vector<U32>& ids, U32& saturatedCount);
+  size_t chunkEnd(bool allTables, size_t start, long int bytes, size_t& next);
+  bool readDocidList(istream& in, intv& docids, U32& saturatedCount);
+  U32 stringToIndex(char* keystr);
+  IndexT newTable2(void);
+  void countTable3Size(int oldSize, int newSize);
+  void saturateTable3(IndexT i3);
+  void prefetchTable1(U32 i);
+  size_t frozenBytes(void);
+  void verifyStats(ostream& out, size_t ptrTable1, int minTable3, int maxTable3, int threads);
+
+  IndexT PTR_FLAG; // top bit, set for all pointers (and EMPTY)
+  IndexT T3_FLAG;  // next bit, set for pointers into table3
+  vector<IndexT> table2Free; // table2 entries freed by moving to table3
+
+  BigAlloc table1Alloc;
+  BigAlloc table2Alloc;
+
+  // Frozen table1: bit set in t1Occupied for each non-EMPTY entry, then
+  // among those t1IsPtr is set for pointers. Singleton docids are packed
+  // in t1Docids and pointers kept in t1Ptrs, both in table1 order.
+  RankBitVector t1Occupied;
+  RankBitVector t1IsPtr;
+  PackedArray t1Docids;
+  vector<IndexT> t1Ptrs;
+  IndexT frozenValue(size_t i)
+  {
+    if (!t1Occupied.get(i)) return(EMPTY);
+    size_t r=t1Occupied.rank(i);
+    size_t p=t1IsPtr.rank(r);
+    if (t1IsPtr.get(r)) return(t1Ptrs[p]);
+    return((IndexT)t1Docids.get(r-p));
+  }
 
-  int SELECT_MASK;
-  int SELECT_MATCH;
+  kgramkey SELECT_MASK;
+  kgramkey SELECT_MATCH;
   int numDocidsInRead;
-  
+
   int pruneAbove;
+  int saturateAbove;
 
 };
 
+template <class IndexT, class DocidT>
+ostream& operator<<(ostream& out, KeyTableT<IndexT,DocidT>& k);
+template <class IndexT, class DocidT>
+istream& operator>>(istream& in, KeyTableT<IndexT,DocidT>& k);
+
+// Storage types for the KeyTable used throughout docsim. Default is U32 for
+// both which allows for 2^30 shared keys and 2^31-1 docids. Override in the
+// Makefile (KEYTABLE_DEFS) with -DKEYTABLE_INDEX=U64 for more shared keys,
+// or with -DKEYTABLE_DOCID=U16 or U24 to save memory for small corpora.
+// Instantiations for these combinations are in KeyTable.cpp.
+//
+#ifndef KEYTABLE_INDEX
+  #define KEYTABLE_INDEX U32
+#endif
+#ifndef KEYTABLE_DOCID
+  #define KEYTABLE_DOCID U32
+#endif
+typedef KeyTableT<KEYTABLE_INDEX,KEYTABLE_DOCID> KeyTable;
+
 #endif /* #ifndef __INC_KeyTable */
@@ -1,6 +1,6 @@
 // Class for use as element in table3 of KeyTable. Designed to mimic
 // a STL vector<int> but to be efficient for small lists while still
-// growable to large lists. Doing this because using a vector of 
+// growable to large lists. Doing this because using a vector of
 // vector<int> for table3 ended up taking up too much memory.
 //
 // $Id: KeyTable3Element.cpp,v 1.2 2011-03-03 14:20:24 simeon Exp $
@@ -11,95 +11,242 @@
 #include <fstream>
 
 
-KeyTable3Element::KeyTable3Element()
+template <class T>
+KeyTable3ElementT<T>::KeyTable3ElementT()
 {
   max = 3;
-  x = new int[max+1];
+  x = new T[max+1];
   last = -1;
 }
 
 
-KeyTable3Element::KeyTable3Element(int n)
+template <class T>
+KeyTable3ElementT<T>::KeyTable3ElementT(int n)
 {
   max = n;
-  x = new int[max+1];
+  x = new T[max+1];
   last = -1;
 }
 
 
-KeyTable3Element::~KeyTable3Element(void)
+template <class T>
+KeyTable3ElementT<T>::~KeyTable3ElementT(void)
 {
   //should self-clean OK
 }
 
 
-void KeyTable3Element::push_back(int i)
+template <class T>
+void KeyTable3ElementT<T>::push_back(U32 i)
 {
+  if (isBitmap()) {
+    if (i>(U32)last) {
+      bm->append(i);
+      last=(int)i;
+      return;
+    }
+    unpack(); // out of order, go back to an array
+  }
   // Do we need to grow?
   if (last+1>=max) {
     // New space
     int max_new=(max+1)*2;
-    int* xnew = new int[max_new+1];
+    T* xnew = new T[max_new+1];
     // Copy
     for (int j=0; j<=max; j++) {
       xnew[j]=x[j];
     }
     // Switch (destroy old table)
-    delete x; 
+    delete[] x;
     x=xnew;
     max=max_new;
   }
 
   // Add in new element
   x[++last]=i;
+  if (last+1==KT3_BITMAP_MIN+1 && sizeof(T)>2) pack();
+}
+
+
+// Convert a long array list to a bitmap list, does nothing unless the
+// docids are in increasing order
+//
+template <class T>
+void KeyTable3ElementT<T>::pack(void)
+{
+  if (x==NULL || max<0) return;
+  for (int j=1; j<=last; j++) {
+    if ((U32)x[j]<=(U32)x[j-1]) return;
+  }
+  PostingBitmap* b=new PostingBitmap();
+  for (int j=0; j<=last; j++) {
+    b->append((U32)x[j]);
+  }
+  int lastDocid=(last>=0 ? (int)(U32)x[last] : 0);
+  delete[] x;
+  bm=b;
+  max=-1;
+  last=lastDocid;
 }
 
 
-// Last element, will die if attempt to read from empty
+// Convert a bitmap list back to an array list
 //
-int KeyTable3Element::back(void)
+template <class T>
+void KeyTable3ElementT<T>::unpack(void)
 {
+  if (!isBitmap()) return;
+  vector<U32> ids;
+  ids.reserve(bm->size());
+  bm->appendTo(ids);
+  delete bm;
+  max=(ids.size()<3 ? 3 : (int)ids.size());
+  x=new T[max+1];
+  for (size_t j=0; j<ids.size(); j++) {
+    x[j]=ids[j];
+  }
+  last=(int)ids.size()-1;
+}
+
+
+// Last element, will die if attempt to read from empty. For a saturated
+// list this is the last docid added.
+//
+template <class T>
+U32 KeyTable3ElementT<T>::back(void)
+{
+  if (x==NULL || max<0) return((U32)last);
   if (last<0) {
     std::cerr << "KeyTable3Element::back: Attempt to read from empty array" << std::endl;
     exit(1);
   }
-  return(x[last]);
+  return((U32)x[last]);
 }
 
 
 // Number of entries. We count from 0 so add
 // one to index to get number.
 //
-int KeyTable3Element::size(void)
+template <class T>
+int KeyTable3ElementT<T>::size(void)
 {
-  return(last+1);
+  if (isBitmap()) return((int)bm->size());
+  return(x==NULL ? 0 : last+1);
 }
 
-int KeyTable3Element::capacity(void)
+template <class T>
+int KeyTable3ElementT<T>::capacity(void)
 {
-  return(max);
+  if (isBitmap()) return((int)bm->size());
+  return(x==NULL ? 0 : max);
 }
 
-int KeyTable3Element::operator[](int i)
+template <class T>
+U32 KeyTable3ElementT<T>::operator[](int i)
 {
-  return(x[i]);
+  return((U32)x[i]);
 }
 
-int KeyTable3Element::size_in_bytes(void)
+template <class T>
+int KeyTable3ElementT<T>::size_in_bytes(void)
 {
-  return(sizeof(int)*(max+3));
+  if (x==NULL) return(2*sizeof(int));
+  if (isBitmap()) return((int)bm->sizeInBytes()+2*sizeof(int));
+  return(sizeof(T)*(max+1)+2*sizeof(int));
 }
 
 
-int* KeyTable3Element::begin(void)
+// Shrink to the first n entries (n<=size()), freeing unused space
+//
+template <class T>
+void KeyTable3ElementT<T>::resize(int n)
 {
+  unpack();
+  if (x==NULL || n>=last+1) return;
+  int max_new=(n<3 ? 3 : n);
+  T* xnew = new T[max_new+1];
+  for (int j=0; j<n; j++) {
+    xnew[j]=x[j];
+  }
+  delete[] x;
+  x=xnew;
+  max=max_new;
+  last=n-1;
+}
+
+
+// Free the list memory, the destructor doesn't as elements are copied
+// about by value in table3
+//
+template <class T>
+void KeyTable3ElementT<T>::release(void)
+{
+  if (isBitmap()) {
+    delete bm;
+  } else if (x!=NULL) {
+    delete[] x;
+  }
+  x=NULL;
+  max=0;
+  last=0;
+}
+
+
+// Drop the docids and keep just the count and last docid. Then max holds
+// the count and last holds the last docid.
+//
+template <class T>
+void KeyTable3ElementT<T>::saturate(void)
+{
+  if (x==NULL) return;
+  int count=size();
+  U32 lastDocid=(isBitmap() || last>=0 ? back() : 0);
+  if (isBitmap()) {
+    delete bm;
+  } else {
+    delete[] x;
+  }
+  setSaturated(count,lastDocid);
+}
+
+
+template <class T>
+void KeyTable3ElementT<T>::setSaturated(int count, U32 lastDocid)
+{
+  x=NULL;
+  max=count;
+  last=(int)lastDocid;
+}
+
+
+// Count docid i in a saturated list, returns false if it was a repeat of
+// the last docid
+//
+template <class T>
+bool KeyTable3ElementT<T>::addSaturated(U32 i)
+{
+  if ((U32)last==i) return(false);
+  last=(int)i;
+  max++;
+  return(true);
+}
+
+
+// Start of array list, NULL for a saturated or bitmap list
+//
+template <class T>
+T* KeyTable3ElementT<T>::begin(void)
+{
+  if (max<0) return((T*)NULL);
   return(x);
 }
 
 // Last index (-1 for no entries)
 //
-int* KeyTable3Element::end(void)
+template <class T>
+T* KeyTable3ElementT<T>::end(void)
 {
+  if (x==NULL || max<0) return((T*)NULL);
   return(x+last+1);
 }
 
@@ -107,16 +254,25 @@ int* KeyTable3Element::end(void)
 
 // Write out space separated
 //
-std::ostream& operator<<(std::ostream& out, KeyTable3Element& k) {
-  //out << "operator<<:: begin=" << k.begin() << " end=" << k.end() << std::endl;
-  for (KeyTable3Element::iterator kti=k.begin();
-       kti!=k.end();
-       kti++) {
-    if (kti!=k.begin()) {
+template <class T>
+std::ostream& operator<<(std::ostream& out, KeyTable3ElementT<T>& k) {
+  vector<U32> ids;
+  k.appendTo(ids);
+  for (size_t j=0; j<ids.size(); j++) {
+    if (j>0) {
       out << " ";
     }
-    out << *kti;
+    out << ids[j];
   }
   return(out);
 }
 
+
+// Instantiate for the docid types used in KeyTable
+//
+template class KeyTable3ElementT<U16>;
+template class KeyTable3ElementT<U24>;
+template class KeyTable3ElementT<U32>;
+template std::ostream& operator<<(std::ostream& out, KeyTable3ElementT<U16>& k);
+template std::ostream& operator<<(std::ostream& out, KeyTable3ElementT<U24>& k);
+template std::ostream& operator<<(std::ostream& out, KeyTable3ElementT<U32>& k);
@@ -1,39 +1,85 @@
 // Class for use as element in table3 of KeyTable. Designed to mimic
 // a STL vector<int> but to be efficient for small lists while still
-// growable to large lists. Doing this because using a vector of 
+// growable to large lists. Doing this because using a vector of
 // vector<int> for table3 ended up taking up too much memory.
 //
+// Templated on the stored docid type T so that KeyTables with narrow
+// docids (U16, U24) also get narrow table3 lists. Explicitly instantiated
+// in KeyTable3Element.cpp for U16, U24 and U32.
+//
+// A list may be "saturated" (see KeyTable::setSaturateAbove) in which case
+// the docids are dropped and just the number of documents and the last
+// docid (to catch repeats) are kept. A saturated list has size() 0.
+//
+// A list longer than KT3_BITMAP_MIN whose docids are in increasing order is
+// stored as a compressed PostingBitmap instead of an array (not for U16
+// docids which are already as small as a bitmap array container). Then
+// begin()/end() don't apply, use appendTo() to get the docids.
+//
 // $Id: KeyTable3Element.h,v 1.1 2011-03-03 14:10:58 simeon Exp $
 
+#ifndef __INC_KeyTable3Element
+#define __INC_KeyTable3Element 1
+
+#include "definitions.h"
+#include "PostingBitmap.h"
 #include <iostream>
 
-class KeyTable3Element {
-  int max;
-  int last;
-  int* x;
+// Lists longer than this are stored as a PostingBitmap
+#define KT3_BITMAP_MIN 1024
+
+template <class T>
+class KeyTable3ElementT {
+  int max;   // capacity, or -1 for a bitmap list
+  int last;  // index of last entry, or last docid if saturated or bitmap
+  union {
+    T* x;
+    PostingBitmap* bm;
+  };
 
 public:
-  KeyTable3Element(void);
-  KeyTable3Element(int n);
-  ~KeyTable3Element(void);
-  void push_back(int i);
-  int back(void);
+  KeyTable3ElementT(void);
+  KeyTable3ElementT(int n);
+  ~KeyTable3ElementT(void);
+  void push_back(U32 i);
+  U32 back(void);
   int size(void);
   int capacity(void);
-  int* begin(void);
-  int* end(void);
-  int operator[](int i);
+  T* begin(void);
+  T* end(void);
+  U32 operator[](int i);
   // my addition
   int size_in_bytes(void);
-  friend std::ostream& operator<<(std::ostream& out, KeyTable3Element& k);
+  void saturate(void);
+  void setSaturated(int count, U32 lastDocid);
+  bool addSaturated(U32 i);
+  void resize(int n);
+  void release(void);
+  bool isSaturated(void) { return(x==NULL); }
+  int saturatedCount(void) { return(x==NULL ? max : 0); }
+  bool isBitmap(void) { return(max<0 && x!=NULL); }
+  PostingBitmap* bitmap(void) { return(isBitmap() ? bm : (PostingBitmap*)NULL); }
+  void pack(void);
+  void unpack(void);
+
+  // Append all docids to out (any vector-like type), for array or bitmap lists
+  template <class V>
+  void appendTo(V& out)
+  {
+    if (isBitmap()) {
+      bm->appendTo(out);
+    } else if (x!=NULL) {
+      for (int j=0; j<=last; j++) out.push_back(x[j]);
+    }
+  }
 
   // Here is a custom iterator which I've based on the example at
   // http://www.oreillynet.com/pub/a/network/2005/11/21/what-is-iterator-in-c-plus-plus-part2.html?page=5
   // This provides mimimal functionality to mimic the STD vector iterator
   //
-  class iterator : public std::iterator<std::forward_iterator_tag, KeyTable3Element> {
+  class iterator : public std::iterator<std::forward_iterator_tag, T> {
     public:
-      iterator(int* i) { ptr=i; }
+      iterator(T* i) { ptr=i; }
       ~iterator() {}
 
       // The assignment and relational operators are straightforward
@@ -43,7 +89,7 @@ public:
 	return(*this);
       }
 
-      iterator& operator=(int* i)
+      iterator& operator=(T* i)
       {
 	ptr = i;
 	return(*this);
@@ -59,7 +105,7 @@ public:
 	return(ptr == other->ptr);
       }
 
-      bool operator!=(int* i)
+      bool operator!=(T* i)
       {
 	return(ptr != i);
       }
@@ -81,13 +127,21 @@ public:
 	return(*this);
       }
 
-      int operator*()
+      U32 operator*()
       {
-        return(*ptr);
+        return((U32)*ptr);
       }
 
     private:
-      int* ptr;
+      T* ptr;
   };
 
 };
+
+template <class T>
+std::ostream& operator<<(std::ostream& out, KeyTable3ElementT<T>& k);
+
+// The original int-like element, used where the docid width doesn't matter
+typedef KeyTable3ElementT<U32> KeyTable3Element;
+
+#endif /* #ifndef __INC_KeyTable3Element */
@@ -0,0 +1,511 @@
+// Log-structured set of KeyTable segments, see KeyTableSegments.h
+
+#include "KeyTableSegments.h"
+#include "files.h"
+#include "OutBuffer.h"
+#include <stdio.h>    // for rename(), remove()
+#include <stdlib.h>   // for strtoul()
+#include <sstream>
+#include <algorithm>  // for sort() and unique()
+
+
+// Streaming reader for the lines of a multi-file KeyTable segment, in key
+// order. After next() returns true the line is in key/index and either
+// docids or saturatedCount (>0 for "key *count").
+//
+class SegmentReader
+{
+public:
+  string base;
+  int fileNum;
+  ifstream in;
+  bool done;
+  string key;
+  U32 index;
+  vector<U32> docids;
+  U32 saturatedCount;
+
+  SegmentReader(const string& b) : base(b), fileNum(0), done(false), index(0), saturatedCount(0) {}
+
+  bool next(void)
+  {
+    string line;
+    while (!done) {
+      if (in.is_open() && getline(in,line)) {
+        if (line.length()==0) continue;
+        parse(line);
+        return(true);
+      }
+      in.close();
+      in.clear();
+      fileNum++;
+      ostringstream fileName;
+      fileName << base << "_" << fileNum << ".keytable";
+      in.open(fileName.str().c_str(),ios_base::in);
+      if (!in.good()) {
+        if (fileNum==1) {
+          cerr << "KeyTableSegments: Error - can't read from first file " << fileName.str() << endl;
+          exit(2);
+        }
+        done=true;
+      }
+    }
+    return(false);
+  }
+
+private:
+  void parse(const string& line)
+  {
+    size_t sp=line.find(' ');
+    key=line.substr(0,sp);
+    index=(U32)strtoul(key.c_str(),NULL,16);
+    docids.clear();
+    saturatedCount=0;
+    if (sp==string::npos) return;
+    const char* p=line.c_str()+sp;
+    while (*p==' ') p++;
+    if (*p=='*') {
+      saturatedCount=(U32)strtoul(p+1,NULL,10);
+      return;
+    }
+    while (*p!='\0') {
+      char* end;
+      U32 d=(U32)strtoul(p,&end,10);
+      if (end==p) {
+        cerr << "KeyTableSegments: Error - bad docid list in " << base << " file " << fileNum << ": " << line << endl;
+        exit(2);
+      }
+      docids.push_back(d);
+      p=end;
+      while (*p==' ') p++;
+    }
+  }
+};
+
+
+KeyTableSegments::KeyTableSegments(int b, string d, int t, int sb, int sm) : bits(b), dir(d), delta((KeyTable*)NULL), threads(t), selectBits(sb), selectMatch(sm), saturateAbove(0), nextSegment(1), compacting(false), compactCount(0)
+{
+  pthread_mutex_init(&lock,NULL);
+}
+
+
+KeyTableSegments::~KeyTableSegments(void)
+{
+  waitCompaction();
+  if (delta!=(KeyTable*)NULL) delete delta;
+  clearTables();
+  pthread_mutex_destroy(&lock);
+}
+
+
+string KeyTableSegments::segmentPath(const string& name)
+{
+  return(prependPath(dir,name));
+}
+
+
+// New segment name seg_NNNNNN, numbers are never reused
+//
+string KeyTableSegments::newSegmentName(void)
+{
+  pthread_mutex_lock(&lock);
+  char buf[20];
+  sprintf(buf,"seg_%06d",nextSegment++);
+  pthread_mutex_unlock(&lock);
+  return(string(buf));
+}
+
+
+// Read the list of segments from the manifest, no manifest means no
+// segments yet
+//
+void KeyTableSegments::readManifest(void)
+{
+  pthread_mutex_lock(&lock);
+  segments.clear();
+  ifstream mfin;
+  mfin.open(segmentPath(SEGMENT_MANIFEST).c_str(),ios_base::in);
+  string line;
+  while (getline(mfin,line)) {
+    if (line.length()==0) continue;
+    segments.push_back(line);
+    int num=0;
+    if (sscanf(line.c_str(),"seg_%d",&num)==1 && num>=nextSegment) nextSegment=num+1;
+  }
+  pthread_mutex_unlock(&lock);
+  cout << "KeyTableSegments::readManifest: " << segments.size() << " segments in " << dir << endl;
+}
+
+
+// Write manifest, lock must be held. Written to a temporary file and
+// renamed so that readers never see a partial manifest.
+//
+void KeyTableSegments::writeManifest(void)
+{
+  string manifest=segmentPath(SEGMENT_MANIFEST);
+  string tmp=manifest+".tmp";
+  ofstream mout;
+  mout.open(tmp.c_str(),ios_base::out);
+  if (!mout.good()) {
+    cerr << "KeyTableSegments::writeManifest: Error - can't write to " << tmp << endl;
+    exit(2);
+  }
+  for (size_t j=0; j<segments.size(); j++) {
+    mout << segments[j] << endl;
+  }
+  mout.close();
+  if (rename(tmp.c_str(),manifest.c_str())!=0) {
+    cerr << "KeyTableSegments::writeManifest: Error - can't rename " << tmp << " to " << manifest << endl;
+    exit(2);
+  }
+}
+
+
+void KeyTableSegments::removeSegmentFiles(const string& name)
+{
+  for (int f=1; ; f++) {
+    ostringstream fileName;
+    fileName << segmentPath(name) << "_" << f << ".keytable";
+    if (remove(fileName.str().c_str())!=0) break;
+  }
+}
+
+
+// In-memory KeyTable for new documents, created on first use with the
+// select bits so that it takes only the keys of this KeyTable shard
+//
+KeyTable& KeyTableSegments::deltaTable(void)
+{
+  if (delta==(KeyTable*)NULL) {
+    delta=new KeyTable(bits,false,selectBits,selectMatch);
+    delta->setSaturateAbove(saturateAbove);
+  }
+  return(*delta);
+}
+
+
+// Saturate lists of more than s docids (0 for no limit) in the delta and
+// in every merge, so that merged segments stay saturated like the deltas
+// they came from. See KeyTable::setSaturateAbove().
+//
+void KeyTableSegments::setSaturateAbove(int s)
+{
+  if (s>0 && s<3) {
+    cerr << "KeyTableSegments::setSaturateAbove: saturateAbove value '" << s << "' must be 0 or at least 3, aborting!" << endl;
+    exit(2);
+  }
+  saturateAbove=s;
+  if (delta!=(KeyTable*)NULL) delta->setSaturateAbove(s);
+}
+
+
+// Write the delta KeyTable as a new segment and free it. Returns the
+// segment name, or "" if there was nothing to write.
+//
+string KeyTableSegments::flushDelta(void)
+{
+  if (delta==(KeyTable*)NULL) return("");
+  if (delta->numTable1+delta->numTable2+delta->table3.size()==0) {
+    delete delta;
+    delta=(KeyTable*)NULL;
+    return("");
+  }
+  string name=newSegmentName();
+  string base=segmentPath(name);
+  delta->writeMultiFile(base,true,MAX_FILE_SIZE,threads);
+  delete delta;
+  delta=(KeyTable*)NULL;
+  pthread_mutex_lock(&lock);
+  segments.push_back(name);
+  writeManifest();
+  pthread_mutex_unlock(&lock);
+  cout << "KeyTableSegments::flushDelta: wrote segment " << name << endl;
+  return(name);
+}
+
+
+// Merge segments[first..first+n-1] into a new segment. The manifest
+// isn't changed, returns the new segment name.
+//
+string KeyTableSegments::mergeSegments(size_t first, size_t n)
+{
+  pthread_mutex_lock(&lock);
+  vector<string> names(segments.begin()+first,segments.begin()+first+n);
+  pthread_mutex_unlock(&lock);
+  string name=newSegmentName();
+  mergeFiles(names,segmentPath(name));
+  return(name);
+}
+
+
+// Merge all segments into the multi-file KeyTable base (base_1.keytable...),
+// which needn't be in the segment directory. Returns the number of files
+// written.
+//
+int KeyTableSegments::writeMerged(string base)
+{
+  pthread_mutex_lock(&lock);
+  vector<string> names(segments);
+  pthread_mutex_unlock(&lock);
+  return(mergeFiles(names,base));
+}
+
+
+// Remove the files of all segments and the manifest
+//
+void KeyTableSegments::removeAll(void)
+{
+  waitCompaction();
+  pthread_mutex_lock(&lock);
+  vector<string> names(segments);
+  segments.clear();
+  pthread_mutex_unlock(&lock);
+  for (size_t j=0; j<names.size(); j++) {
+    removeSegmentFiles(names[j]);
+  }
+  remove(segmentPath(SEGMENT_MANIFEST).c_str());
+}
+
+
+// Open file number num of multi-file KeyTable base for mergeFiles(), exits
+// if it can't be written
+//
+static ofstream* openMergeFile(const string& base, int num)
+{
+  ostringstream fileName;
+  fileName << base << "_" << num << ".keytable";
+  ofstream* out=new ofstream(fileName.str().c_str(),ios_base::out);
+  if (!out->good()) {
+    cerr << "KeyTableSegments::mergeFiles: Error - can't write to " << fileName.str() << endl;
+    exit(2);
+  }
+  return(out);
+}
+
+
+// Close and free a file from openMergeFile(), exits if writing it failed
+//
+static void closeMergeFile(ofstream* out, const string& base, int num)
+{
+  out->close();
+  if (!out->good()) {
+    cerr << "KeyTableSegments::mergeFiles: Error - failed writing " << base << "_" << num << ".keytable" << endl;
+    exit(2);
+  }
+  delete out;
+}
+
+
+// Merge the segments names into the multi-file KeyTable base with a
+// streaming k-way merge of their files, which are in key order. Only one
+// line per segment is held in memory. Docid lists for the same key are
+// combined, a saturated list in any segment gives a saturated result with
+// the total count, as does a list of more than saturateAbove docids (if
+// >0). Returns the number of files written.
+//
+int KeyTableSegments::mergeFiles(const vector<string>& names, const string& base)
+{
+  vector<SegmentReader*> readers;
+  for (size_t j=0; j<names.size(); j++) {
+    SegmentReader* r=new SegmentReader(segmentPath(names[j]));
+    r->next();
+    readers.push_back(r);
+  }
+
+  int numFiles=1;
+  long int bytesWritten=0;
+  size_t numKeys=0;
+  ofstream* out=openMergeFile(base,numFiles);
+  OutBuffer* ob=new OutBuffer(*out);
+  vector<U32> ids;
+  while (true) {
+    // Smallest current key over all segments
+    SegmentReader* minr=(SegmentReader*)NULL;
+    for (size_t j=0; j<readers.size(); j++) {
+      if (!readers[j]->done && (minr==(SegmentReader*)NULL || readers[j]->index<minr->index)) minr=readers[j];
+    }
+    if (minr==(SegmentReader*)NULL) break;
+    U32 index=minr->index;
+    string key=minr->key;
+    ids.clear();
+    U32 saturatedCount=0;
+    for (size_t j=0; j<readers.size(); j++) {
+      SegmentReader* r=readers[j];
+      if (r->done || r->index!=index) continue;
+      saturatedCount+=r->saturatedCount;
+      ids.insert(ids.end(),r->docids.begin(),r->docids.end());
+      r->next();
+    }
+    ob->putStr(key.c_str());
+    if (saturatedCount==0) {
+      sort(ids.begin(),ids.end());
+      ids.erase(unique(ids.begin(),ids.end()),ids.end());
+    }
+    if (saturatedCount>0 || (saturateAbove>0 && ids.size()>(size_t)saturateAbove)) {
+      ob->putStr(" *");
+      ob->putDec(saturatedCount+ids.size());
+    } else {
+      for (size_t k=0; k<ids.size(); k++) {
+        ob->putChar(' ');
+        ob->putDec(ids[k]);
+      }
+    }
+    ob->putChar('\n');
+    numKeys++;
+    if (ob->bytes()>=(size_t)MAX_FILE_SIZE) {
+      // Start next file
+      ob->flush();
+      bytesWritten+=ob->bytes();
+      delete ob;
+      closeMergeFile(out,base,numFiles);
+      numFiles++;
+      out=openMergeFile(base,numFiles);
+      ob=new OutBuffer(*out);
+    }
+  }
+  ob->flush();
+  bytesWritten+=ob->bytes();
+  delete ob;
+  closeMergeFile(out,base,numFiles);
+  for (size_t j=0; j<readers.size(); j++) {
+    delete readers[j];
+  }
+  cout << "KeyTableSegments::mergeFiles: merged " << names.size() << " segments into " << base << ", "
+       << numKeys << " keys, " << bytesWritten << " bytes in " << numFiles << " files" << endl;
+  return(numFiles);
+}
+
+
+static void* compactionThread(void* arg)
+{
+  ((KeyTableSegments*)arg)->runCompaction();
+  return(NULL);
+}
+
+
+// Merge the compactCount oldest segments and replace them in the manifest.
+// Segments flushed meanwhile are kept after the merged one.
+//
+void KeyTableSegments::runCompaction(void)
+{
+  string merged=mergeSegments(0,compactCount);
+  pthread_mutex_lock(&lock);
+  vector<string> old(segments.begin(),segments.begin()+compactCount);
+  segments.erase(segments.begin(),segments.begin()+compactCount);
+  segments.insert(segments.begin(),merged);
+  writeManifest();
+  pthread_mutex_unlock(&lock);
+  for (size_t j=0; j<old.size(); j++) {
+    removeSegmentFiles(old[j]);
+  }
+}
+
+
+// Start merging all current segments on a background thread if there are
+// at least fanIn of them. Returns true if compaction was started.
+//
+bool KeyTableSegments::startCompaction(size_t fanIn)
+{
+  if (compacting) return(false);
+  pthread_mutex_lock(&lock);
+  compactCount=segments.size();
+  pthread_mutex_unlock(&lock);
+  if (compactCount<fanIn || compactCount<2) return(false);
+  if (pthread_create(&compactor,NULL,compactionThread,this)!=0) {
+    cerr << "KeyTableSegments::startCompaction: Error - failed to create thread" << endl;
+    exit(4);
+  }
+  compacting=true;
+  cout << "KeyTableSegments::startCompaction: merging " << compactCount << " segments in background" << endl;
+  return(true);
+}
+
+
+void KeyTableSegments::waitCompaction(void)
+{
+  if (!compacting) return;
+  pthread_join(compactor,NULL);
+  compacting=false;
+}
+
+
+void KeyTableSegments::clearTables(void)
+{
+  for (size_t j=0; j<tables.size(); j++) {
+    delete tables[j];
+  }
+  tables.clear();
+}
+
+
+// Read each segment into its own KeyTable for lookupKeys()
+//
+void KeyTableSegments::load(void)
+{
+  clearTables();
+  pthread_mutex_lock(&lock);
+  vector<string> names(segments);
+  pthread_mutex_unlock(&lock);
+  for (size_t j=0; j<names.size(); j++) {
+    KeyTable* kt=new KeyTable(bits);
+    string base=segmentPath(names[j]);
+    kt->readMultiFile(base);
+    tables.push_back(kt);
+  }
+}
+
+
+// Read all segments, in order, into the one KeyTable kt
+//
+void KeyTableSegments::readInto(KeyTable& kt)
+{
+  pthread_mutex_lock(&lock);
+  vector<string> names(segments);
+  pthread_mutex_unlock(&lock);
+  for (size_t j=0; j<names.size(); j++) {
+    string base=segmentPath(names[j]);
+    kt.readMultiFile(base);
+  }
+}
+
+
+// Batched lookup (see KeyTable::lookupKeys()) over the loaded segments and
+// the delta. Keys must be sorted, the results for each table are then in
+// key order and are merged, docids for a key being taken from the oldest
+// segment first.
+//
+void KeyTableSegments::lookupKeys(const U32* keys, size_t n, KeyTableLookup& result)
+{
+  vector<KeyTable*> all(tables);
+  if (delta!=(KeyTable*)NULL) all.push_back(delta);
+  if (all.size()==0) return;
+  if (all.size()==1) {
+    all[0]->lookupKeys(keys,n,result);
+    return;
+  }
+  vector<KeyTableLookup> parts(all.size());
+  for (size_t t=0; t<all.size(); t++) {
+    all[t]->lookupKeys(keys,n,parts[t]);
+  }
+  vector<size_t> pos(all.size(),0);
+  while (true) {
+    bool found=false;
+    U32 minKey=0;
+    for (size_t t=0; t<parts.size(); t++) {
+      if (pos[t]<parts[t].size() && (!found || parts[t].keys[pos[t]]<minKey)) {
+        minKey=parts[t].keys[pos[t]];
+        found=true;
+      }
+    }
+    if (!found) break;
+    for (size_t t=0; t<parts.size(); t++) {
+      if (pos[t]<parts[t].size() && parts[t].keys[pos[t]]==minKey) {
+        docid* d=parts[t].docidsFor(pos[t]);
+        result.docids.insert(result.docids.end(),d,d+parts[t].numDocids(pos[t]));
+        pos[t]++;
+      }
+    }
+    result.keys.push_back(minKey);
+    result.offsets.push_back(result.docids.size());
+  }
+}
@@ -0,0 +1,82 @@
+// Log-structured set of KeyTable segments so that new documents can be
+// added without reloading and rewriting the whole corpus KeyTable.
+//
+// A segment directory holds a manifest (segments.txt) listing segment base
+// names, oldest first, and each segment is an ordinary immutable multi-file
+// KeyTable (base_1.keytable, base_2.keytable...) that can be read with -T.
+//
+//   delta       - in-memory KeyTable that new documents are added to,
+//                 flushDelta() writes it as a new segment
+//   compaction  - streaming k-way merge of the sorted segment files into one
+//                 segment, run on a background thread with startCompaction()
+//                 so that it overlaps with building the next delta
+//   queries     - load() reads each segment into its own KeyTable and
+//                 lookupKeys() merges postings across these and the delta
+//   runs        - for a build with bounded memory the delta is flushed
+//                 whenever it reaches a size limit (see
+//                 DocSet::addToKeyTableRuns()) and writeMerged() then
+//                 merges all the segments into an ordinary KeyTable
+//
+// Segments must be added in increasing docid order, as for a KeyTable.
+
+#ifndef __INC_KeyTableSegments
+#define __INC_KeyTableSegments 1
+
+#include "definitions.h"
+#include "KeyTable.h"
+#include <pthread.h>
+
+// Name of manifest file in the segment directory
+#define SEGMENT_MANIFEST "segments.txt"
+// Number of segments at which startCompaction() merges them all
+#define SEGMENT_FANIN 4
+
+class KeyTableSegments
+{
+public:
+  // DATA
+  int bits;                // bits in KeyTable short keys
+  string dir;              // segment directory
+  vector<string> segments; // base names of segments (in dir), oldest first
+  KeyTable* delta;         // new documents not yet flushed, NULL if none
+  vector<KeyTable*> tables; // segments loaded for queries, see load()
+  int threads;             // threads used to write segments
+  int selectBits;          // select bits for the delta, see KeyTable(bits,dummy,selectBits,selectMatch)
+  int selectMatch;
+  int saturateAbove;       // lists saturated above this in the delta and merges, 0 for none
+
+  // METHODS
+  KeyTableSegments(int bits, string dir, int threads=1, int selectBits=0, int selectMatch=0);
+  ~KeyTableSegments(void);
+  void readManifest(void);
+  KeyTable& deltaTable(void);
+  void setSaturateAbove(int s);
+  string flushDelta(void);
+  string mergeSegments(size_t first, size_t n);
+  int writeMerged(string base);
+  void removeAll(void);
+  bool startCompaction(size_t fanIn=SEGMENT_FANIN);
+  void waitCompaction(void);
+  void load(void);
+  void readInto(KeyTable& kt);
+  void lookupKeys(const U32* keys, size_t n, KeyTableLookup& result);
+
+  // Used by the compaction thread
+  void runCompaction(void);
+
+private:
+  string segmentPath(const string& name);
+  string newSegmentName(void);
+  void writeManifest(void);
+  void removeSegmentFiles(const string& name);
+  int mergeFiles(const vector<string>& names, const string& base);
+  void clearTables(void);
+
+  int nextSegment;         // number for next new segment name
+  pthread_mutex_t lock;    // protects segments and nextSegment
+  pthread_t compactor;
+  bool compacting;
+  size_t compactCount;     // segments being merged by the compactor
+};
+
+#endif /* #ifndef __INC_KeyTableSegments */
@@ -0,0 +1,332 @@
+// Scatter-gather lookups over KeyTable shards, see KeyTableShards.h
+
+#include "KeyTableShards.h"
+#include "parallel.h"
+#include "DocCounter.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <sys/time.h> // for struct timeval
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>   // for exit()
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>  // for sort() and unique()
+
+// Seconds to wait for a shard to accept, take or answer a request before
+// the query fails
+#ifndef SHARD_TIMEOUT_SECONDS
+  #define SHARD_TIMEOUT_SECONDS 30
+#endif
+
+
+// Write all of s to socket fd, no SIGPIPE if the other end has gone
+//
+static bool writeAll(int fd, const string& s)
+{
+  size_t done=0;
+  while (done<s.size()) {
+    ssize_t w=send(fd,s.data()+done,s.size()-done,MSG_NOSIGNAL);
+    if (w<=0) return(false);
+    done+=(size_t)w;
+  }
+  return(true);
+}
+
+
+// Read from socket fd until the other end closes or shuts down writing
+//
+static bool readAll(int fd, string& s)
+{
+  char buf[65536];
+  s.clear();
+  while (true) {
+    ssize_t r=recv(fd,buf,sizeof(buf),0);
+    if (r<0) return(false);
+    if (r==0) return(true);
+    s.append(buf,(size_t)r);
+  }
+}
+
+
+KeyTableShards::KeyTableShards(int b, int sb)
+{
+  bits=b;
+  selectBits=sb;
+  if (selectBits<=bits || selectBits>bits+16) {
+    cerr << "KeyTableShards::KeyTableShards: Error - selectBits (" << selectBits << ") must be from "
+         << (bits+1) << " to " << (bits+16) << " for " << bits << " bit KeyTable" << endl;
+    exit(1);
+  }
+  MAX_INDEX=(U32)(((U64)1<<bits)-1);
+  SELECT_MASK=(((kgramkey)1)<<selectBits)-1-MAX_INDEX;
+  size_t numShards=(size_t)1<<(selectBits-bits);
+  hosts.assign(numShards,"");
+  ports.assign(numShards,0);
+}
+
+
+void KeyTableShards::setShard(U32 match, string host, int port)
+{
+  if (match>=hosts.size()) {
+    cerr << "KeyTableShards::setShard: Error - selectMatch " << match << " out of range for "
+         << hosts.size() << " shards" << endl;
+    exit(1);
+  }
+  hosts[match]=host;
+  ports[match]=port;
+}
+
+
+// Read shards file with lines "<selectMatch> <host> <port>", blank lines
+// and lines starting # are ignored. Every shard must be given.
+//
+void KeyTableShards::readShardsFile(string file)
+{
+  ifstream in(file.c_str());
+  if (!in.good()) {
+    cerr << "KeyTableShards::readShardsFile: Error - failed to open '" << file << "'" << endl;
+    exit(2);
+  }
+  string line;
+  while (getline(in,line)) {
+    if (line.length()==0 || line[0]=='#') continue;
+    istringstream ls(line);
+    U32 match;
+    string host;
+    int port;
+    if (!(ls >> match >> host >> port)) {
+      cerr << "KeyTableShards::readShardsFile: Error - bad line '" << line << "' in " << file << endl;
+      exit(2);
+    }
+    setShard(match,host,port);
+  }
+  for (size_t s=0; s<hosts.size(); s++) {
+    if (hosts[s]=="") {
+      cerr << "KeyTableShards::readShardsFile: Error - no shard for selectMatch " << s << " in " << file << endl;
+      exit(2);
+    }
+  }
+  cout << "KeyTableShards::readShardsFile: read " << hosts.size() << " shards from " << file << endl;
+}
+
+
+// Split the keys of km into a sorted list of short keys for each shard
+//
+void KeyTableShards::splitKeys(keymap& km, vector< vector<U32> >& slices)
+{
+  slices.assign(hosts.size(),vector<U32>());
+  for (keymap::const_iterator kmit=km.begin(); kmit!=km.end(); kmit++) {
+    slices[shardFor(kmit->first)].push_back((U32)((kmit->first)&MAX_INDEX));
+  }
+  for (size_t s=0; s<slices.size(); s++) {
+    sort(slices[s].begin(),slices[s].end());
+    slices[s].erase(unique(slices[s].begin(),slices[s].end()),slices[s].end());
+  }
+}
+
+
+// One shard query, run on its own thread
+//
+struct ShardQuery {
+  string host;
+  int port;
+  vector<U32>* keys;
+  vector< pair<docid,int> > counts;
+  bool ok;
+};
+
+static void* shardQueryThread(void* arg)
+{
+  ShardQuery* q=(ShardQuery*)arg;
+  q->ok=false;
+  if (q->keys->size()==0) {
+    q->ok=true;
+    return(NULL);
+  }
+  struct addrinfo hints;
+  struct addrinfo* res;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  ostringstream port;
+  port << q->port;
+  if (getaddrinfo(q->host.c_str(),port.str().c_str(),&hints,&res)!=0) {
+    cerr << "KeyTableShards: Error - can't resolve shard host " << q->host << endl;
+    return(NULL);
+  }
+  int fd=-1;
+  for (struct addrinfo* a=res; a!=NULL; a=a->ai_next) {
+    fd=socket(a->ai_family,a->ai_socktype,a->ai_protocol);
+    if (fd<0) continue;
+    // Timeouts apply to connect() as well as send() and recv()
+    struct timeval tv;
+    tv.tv_sec=SHARD_TIMEOUT_SECONDS;
+    tv.tv_usec=0;
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    if (connect(fd,a->ai_addr,a->ai_addrlen)==0) break;
+    close(fd);
+    fd=-1;
+  }
+  freeaddrinfo(res);
+  if (fd<0) {
+    cerr << "KeyTableShards: Error - can't connect to shard " << q->host << ":" << q->port << endl;
+    return(NULL);
+  }
+  ostringstream req;
+  req << q->keys->size() << "\n" << hex;
+  for (size_t k=0; k<q->keys->size(); k++) {
+    req << (*q->keys)[k] << "\n";
+  }
+  string resp;
+  bool ok=writeAll(fd,req.str()) && shutdown(fd,SHUT_WR)==0 && readAll(fd,resp);
+  close(fd);
+  if (!ok) {
+    cerr << "KeyTableShards: Error - request to shard " << q->host << ":" << q->port << " failed" << endl;
+    return(NULL);
+  }
+  istringstream rs(resp);
+  size_t m;
+  if (!(rs >> m)) {
+    cerr << "KeyTableShards: Error - bad response from shard " << q->host << ":" << q->port << endl;
+    return(NULL);
+  }
+  q->counts.resize(m);
+  for (size_t j=0; j<m; j++) {
+    if (!(rs >> q->counts[j].first >> q->counts[j].second)) {
+      cerr << "KeyTableShards: Error - truncated response from shard " << q->host << ":" << q->port << endl;
+      return(NULL);
+    }
+  }
+  q->ok=true;
+  return(NULL);
+}
+
+
+// Find docs sharing more than n keys with km by querying all shards in
+// parallel and summing their per-docid counts, as KeyTableLookup::getCommonDocs().
+// Returns false, with dpv empty, if any shard can't be queried in
+// SHARD_TIMEOUT_SECONDS so that just this query fails.
+//
+bool KeyTableShards::getCommonDocs(keymap& km, DocPairVector& dpv, int n, docid id2)
+{
+  dpv.clear();
+  vector< vector<U32> > slices;
+  splitKeys(km,slices);
+  vector<ShardQuery> work(hosts.size());
+  for (size_t s=0; s<hosts.size(); s++) {
+    work[s].host=hosts[s];
+    work[s].port=ports[s];
+    work[s].keys=&slices[s];
+  }
+  runThreads(work,shardQueryThread);
+  DocCounter& counter=DocCounter::forThread();
+  counter.clear();
+  for (size_t s=0; s<work.size(); s++) {
+    if (!work[s].ok) {
+      cerr << "KeyTableShards::getCommonDocs: Error - shard " << s << " failed, no result for this query" << endl;
+      return(false);
+    }
+    for (size_t j=0; j<work[s].counts.size(); j++) {
+      counter.add(work[s].counts[j].first,work[s].counts[j].second);
+    }
+  }
+  counter.getCommonDocs(dpv,n,id2);
+  return(true);
+}
+
+
+// Open socket listening on port (0 for any free port) on all interfaces,
+// exits on failure
+//
+int shardListen(int port)
+{
+  int fd=socket(AF_INET,SOCK_STREAM,0);
+  if (fd<0) {
+    cerr << "shardListen: Error - failed to create socket" << endl;
+    exit(2);
+  }
+  int on=1;
+  setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_ANY);
+  addr.sin_port=htons((unsigned short)port);
+  if (bind(fd,(struct sockaddr*)&addr,sizeof(addr))!=0 || listen(fd,100)!=0) {
+    cerr << "shardListen: Error - failed to listen on port " << port << endl;
+    exit(2);
+  }
+  return(fd);
+}
+
+
+// Port actually bound by listening socket fd
+//
+int shardListenPort(int fd)
+{
+  struct sockaddr_in addr;
+  socklen_t len=sizeof(addr);
+  if (getsockname(fd,(struct sockaddr*)&addr,&len)!=0) return(0);
+  return(ntohs(addr.sin_port));
+}
+
+
+// Accept one connection on listening socket fd and answer its shard
+// request from kt. Returns false if the request failed.
+//
+bool shardServe(int fd, KeyTable& kt)
+{
+  int s=accept(fd,NULL,NULL);
+  if (s<0) {
+    cerr << "shardServe: Error - accept failed" << endl;
+    return(false);
+  }
+  string req;
+  if (!readAll(s,req)) {
+    close(s);
+    return(false);
+  }
+  istringstream rs(req);
+  size_t n=0;
+  vector<U32> indexes;
+  bool ok=(rs >> n);
+  // Each key takes at least two chars ("0\n") and they are distinct short
+  // keys, so reject a count the request can't hold before reserving
+  if (ok && (n>req.size()/2 || n>(size_t)kt.MAX_INDEX+1)) {
+    cerr << "shardServe: Error - bad request, " << n << " keys won't fit in " << req.size() << " bytes" << endl;
+    close(s);
+    return(false);
+  }
+  if (ok) {
+    indexes.reserve(n);
+    U32 i;
+    rs >> hex;
+    while (indexes.size()<n && rs >> i) indexes.push_back(i&kt.MAX_INDEX);
+  }
+  if (!ok || indexes.size()!=n) {
+    cerr << "shardServe: Error - bad request, expected " << n << " keys, got " << indexes.size() << endl;
+    close(s);
+    return(false);
+  }
+  sort(indexes.begin(),indexes.end());
+  indexes.erase(unique(indexes.begin(),indexes.end()),indexes.end());
+  KeyTableLookup lookup;
+  if (indexes.size()>0) {
+    kt.lookupKeys(&indexes[0],indexes.size(),lookup);
+  }
+  DocPairVector dpv;
+  lookup.getCommonDocs(dpv,0);
+  ostringstream resp;
+  resp << dpv.size() << "\n";
+  for (size_t j=0; j<dpv.size(); j++) {
+    resp << dpv[j].id1 << " " << dpv[j].sharedKeys << "\n";
+  }
+  ok=writeAll(s,resp.str());
+  close(s);
+  return(ok);
+}
@@ -0,0 +1,52 @@
+// Scatter-gather lookups over a KeyTable split into shards by key range.
+//
+// Each shard is a KeyTable built with selectBits/selectMatch (-x/-X) so
+// it holds only keys whose bits selectBits..bits match its selectMatch
+// value, and it is served by its own process (overlapd -p <port>). A
+// coordinator fingerprints a document once, splits the short keys between
+// shards by their select bits, queries all shards in parallel and sums the
+// per-docid counts before applying the match threshold.
+//
+// Shard protocol, plain TCP with one request per connection:
+//   request   "<n>\n" then n short keys in hex, one per line
+//   response  "<m>\n" then m lines "<docid> <count>" where count is the
+//             number of the requested keys with docid in their posting list
+//
+// Shards file for the coordinator, one shard per line:
+//   <selectMatch> <host> <port>
+// and there must be a shard for every selectMatch value 0..2^(selectBits-bits)-1.
+
+#ifndef __INC_KeyTableShards
+#define __INC_KeyTableShards 1
+
+#include "definitions.h"
+#include "KeyTable.h"
+#include "KeyMap.h"
+#include "DocPair.h"
+
+class KeyTableShards
+{
+public:
+  // DATA
+  int bits;                // bits in KeyTable short keys
+  int selectBits;          // bits of key used to select shard (> bits)
+  kgramkey SELECT_MASK;    // as for KeyTable with the same bits and selectBits
+  U32 MAX_INDEX;
+  vector<string> hosts;    // shard host for each selectMatch value
+  vector<int> ports;       // shard port for each selectMatch value
+
+  // METHODS
+  KeyTableShards(int bits, int selectBits);
+  void readShardsFile(string file);
+  void setShard(U32 match, string host, int port);
+  U32 shardFor(kgramkey key) { return((U32)((key&SELECT_MASK)>>bits)); }
+  void splitKeys(keymap& km, vector< vector<U32> >& slices);
+  bool getCommonDocs(keymap& km, DocPairVector& dpv, int n, docid id2=9999999);
+};
+
+// Shard server side
+int shardListen(int port);
+int shardListenPort(int fd);
+bool shardServe(int fd, KeyTable& kt);
+
+#endif /* #ifndef __INC_KeyTableShards */
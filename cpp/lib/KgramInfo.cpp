@@ -4,59 +4,219 @@
 #include "definitions.h"
 #include "KgramInfo.h"
 
-#define INITIAL_SIZE 2
-#define MAX_SIZE 60000
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// KgramArena
+
+KgramArena::KgramArena(void)
+{
+  next=(char*)NULL;
+  avail=0;
+  bytes=0;
+}
+
+
+KgramArena::~KgramArena(void)
+{
+  release();
+}
+
+
+// Get bytes of memory (8 byte aligned) which is only freed with the arena
+//
+void* KgramArena::allocate(size_t n)
+{
+  n=(n+7)&~(size_t)7;
+  if (n>KGRAM_ARENA_CHUNK/4) {
+    // Large block on its own, still freed with the arena
+    char* p=new char[n];
+    chunks.insert(chunks.begin(),p); // keep last chunk as the current one
+    bytes+=n;
+    return(p);
+  }
+  if (n>avail) {
+    next=new char[KGRAM_ARENA_CHUNK];
+    chunks.push_back(next);
+    avail=KGRAM_ARENA_CHUNK;
+    bytes+=KGRAM_ARENA_CHUNK;
+  }
+  void* p=next;
+  next+=n;
+  avail-=n;
+  return(p);
+}
+
+
+// Get an id array of at least n entries, n is rounded up to a power of 2
+//
+docid* KgramArena::allocateIds(U32& n)
+{
+  int b=0;
+  while (((U32)1<<b)<n) b++;
+  n=(U32)1<<b;
+  if (!freeLists[b].empty()) {
+    docid* p=freeLists[b].back();
+    freeLists[b].pop_back();
+    return(p);
+  }
+  return((docid*)allocate(n*sizeof(docid)));
+}
+
 
+// Give back an id array of n (a power of 2) entries from allocateIds()
+//
+void KgramArena::freeIds(docid* ids, U32 n)
+{
+  int b=0;
+  while (((U32)1<<b)<n) b++;
+  freeLists[b].push_back(ids);
+}
+
+
+void KgramArena::release(void)
+{
+  for (size_t j=0; j<chunks.size(); j++) {
+    delete[] chunks[j];
+  }
+  vector<char*>().swap(chunks);
+  for (int b=0; b<32; b++) {
+    vector<docid*>().swap(freeLists[b]);
+  }
+  next=(char*)NULL;
+  avail=0;
+  bytes=0;
+}
+
+
+void KgramArena::swap(KgramArena& other)
+{
+  chunks.swap(other.chunks);
+  std::swap(next,other.next);
+  std::swap(avail,other.avail);
+  std::swap(bytes,other.bytes);
+  for (int b=0; b<32; b++) {
+    freeLists[b].swap(other.freeLists[b]);
+  }
+}
+
+
+// Take over all memory of other, which is left empty. Objects allocated
+// from other are then freed with this arena.
+//
+void KgramArena::adopt(KgramArena& other)
+{
+  // keep our last chunk last as it is the current one
+  chunks.insert(chunks.begin(),other.chunks.begin(),other.chunks.end());
+  bytes+=other.bytes;
+  for (int b=0; b<32; b++) {
+    freeLists[b].insert(freeLists[b].end(),other.freeLists[b].begin(),other.freeLists[b].end());
+    vector<docid*>().swap(other.freeLists[b]);
+  }
+  vector<char*>().swap(other.chunks);
+  other.next=(char*)NULL;
+  other.avail=0;
+  other.bytes=0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// KgramInfo
 
 KgramInfo::KgramInfo(void)
 {
-  idsSize=INITIAL_SIZE;
-  ids=new docid[idsSize];
+  idsSize=KGRAMINFO_INLINE_IDS;
+  arenaIds=false;
   numIds=0;
   occurrences=0;
-  //cerr << "KgramInfo::KgramInfo(void) -- attempt to create blank KgramInfo object, not allowed" << endl;
-  //exit(3);
 }
 
 
 KgramInfo::KgramInfo(docid id)
 {
-  idsSize=INITIAL_SIZE;
-  ids=new docid[idsSize];
+  idsSize=KGRAMINFO_INLINE_IDS;
+  arenaIds=false;
   numIds=1;
-  ids[0]=id;
+  inlineIds[0]=id;
   occurrences=1;
-  //cout << "KgramInfo::new[" << (ptr_to_int)this << "] id=" << id << " numIds=" << numIds << " occurrences=" << occurrences << "\n";
 }
 
 
-KgramInfo::KgramInfo(intv& idv)
+KgramInfo::KgramInfo(intv& idv, KgramArena* arena)
 {
-  idsSize=idv.size();
-  ids=new docid[idsSize];
-  numIds=idsSize;
-  for (int j=0; j<numIds; j++) ids[j]=idv[j];
-  occurrences=idsSize; // don't actually have data on real occurrences so fudge to number of docs
+  allocIds(idv.size(),arena);
+  numIds=idv.size();
+  docid* x=idArray();
+  for (U32 j=0; j<numIds; j++) x[j]=idv[j];
+  occurrences=numIds; // don't actually have data on real occurrences so fudge to number of docs
+}
+
+
+KgramInfo::KgramInfo(docid* idv, int n, KgramArena* arena)
+{
+  allocIds(n,arena);
+  numIds=n;
+  docid* x=idArray();
+  for (U32 j=0; j<numIds; j++) x[j]=idv[j];
+  occurrences=numIds; // as above, fudge
 }
 
 
 // Initialize as simple copy of existing KgramInfo object
 // 
-KgramInfo::KgramInfo(KgramInfo* ki)
+KgramInfo::KgramInfo(KgramInfo* ki, KgramArena* arena)
 {
-  idsSize=ki->idsSize;
-  ids=new docid[idsSize];
+  if (ki->saturated()) {
+    idsSize=0;
+    arenaIds=false;
+    inlineIds[0]=ki->inlineIds[0];
+  } else {
+    allocIds(ki->numIds,arena);
+    docid* x=idArray();
+    docid* y=ki->idArray();
+    for (U32 j=0; j<ki->numIds; j++) x[j]=y[j];
+  }
   numIds=ki->numIds;
-  for (int j=0; j<numIds; j++) ids[j]=ki->ids[j];
   occurrences=ki->occurrences;
 }
 
 
-// Destructor: Free memory in ids array
+// Destructor: Free memory in ids array unless inline or from an arena
 //
 KgramInfo::~KgramInfo(void)
 {
-  delete[] ids;
+  freeIds((KgramArena*)NULL);
+}
+
+
+// Set up empty ids array of at least n entries
+//
+void KgramInfo::allocIds(U32 n, KgramArena* arena)
+{
+  arenaIds=false;
+  if (n<=KGRAMINFO_INLINE_IDS) {
+    idsSize=KGRAMINFO_INLINE_IDS;
+  } else if (arena!=(KgramArena*)NULL) {
+    ids=arena->allocateIds(n);
+    idsSize=n;
+    arenaIds=true;
+  } else {
+    ids=new docid[n];
+    idsSize=n;
+  }
+}
+
+
+// Free ids array if not inline, arena arrays go back to arena if given
+//
+void KgramInfo::freeIds(KgramArena* arena)
+{
+  if (idsSize<=KGRAMINFO_INLINE_IDS) return;
+  if (!arenaIds) {
+    delete[] ids;
+  } else if (arena!=(KgramArena*)NULL) {
+    arena->freeIds(ids,idsSize);
+  }
 }
 
 
@@ -73,13 +233,25 @@ KgramInfo& KgramInfo::operator=(const KgramInfo& ki)
 // Here we recklessly use the fact that we add documents in order of docid
 // We can thus check the last entry to see if the docid is the same
 //
-// maxDupesToCount is currently unused.
+// If maxDupesToCount>0 then once the kgram is in more than maxDupesToCount
+// documents the ids are dropped and just the number of documents counted.
+//
+// If the KgramInfo is in a keymap then arena should be the keymap's arena
+// so that a larger ids array comes from there.
 //
-void KgramInfo::addOccurrence(docid id, int maxDupesToCount)
+void KgramInfo::addOccurrence(docid id, int maxDupesToCount, KgramArena* arena)
 {
+  if (saturated()) {
+    if (id>inlineIds[0]) {
+      inlineIds[0]=id;
+      numIds++;
+    }
+    occurrences++;
+    return;
+  }
   docid lastId=0; // less than smallest docid (==1)
   if (numIds>0) {
-    lastId=ids[numIds-1];
+    lastId=idArray()[numIds-1];
     //cout << "KgramInfo::addOccurrence[" << (ptr_to_int)this << "] add " << id << "\n";
     if (id<lastId) {
       cerr << "KgramInfo::addOccurrence: ERROR -- attempt to use with docs out of order!\n";
@@ -89,8 +261,17 @@ void KgramInfo::addOccurrence(docid id, int maxDupesToCount)
   }
   if (id>lastId) {
     // Got new id
-    if (numIds==idsSize) growIds();
-    ids[numIds++]=id;
+    if (maxDupesToCount>0 && numIds>=(U32)maxDupesToCount) {
+      // Saturate, keep just this id to check for repeats
+      freeIds(arena);
+      inlineIds[0]=id;
+      idsSize=0;
+      arenaIds=false;
+      numIds++;
+    } else {
+      if (numIds==idsSize) growIds(arena);
+      idArray()[numIds++]=id;
+    }
     //cout << "KgramInfo::addOccurrence: added id=" << id << " numIds=" << numIds << " (lastId=" << lastId << ")\n";
   } else {
     //cout << "KgramInfo::addOccurrence: same id=" << id << ", incrementing occurrences to " << (occurrences+1) << "\n";
@@ -100,32 +281,84 @@ void KgramInfo::addOccurrence(docid id, int maxDupesToCount)
 }
 
 
+// Add the ids and counts from ki, which must all be for documents after
+// the ones here (as when merging keymaps built from consecutive ranges of
+// documents). Saturates just as addOccurrence would have.
+//
+void KgramInfo::merge(KgramInfo* ki, int maxDupesToCount, KgramArena* arena)
+{
+  occurrences+=ki->occurrences;
+  if (ki->numIds==0) return;
+  U32 total=numIds+ki->numIds;
+  if (saturated() || ki->saturated() || (maxDupesToCount>0 && total>(U32)maxDupesToCount)) {
+    docid lastId=(ki->saturated() ? ki->inlineIds[0] : ki->idArray()[ki->numIds-1]);
+    freeIds(arena);
+    inlineIds[0]=lastId;
+    idsSize=0;
+    arenaIds=false;
+  } else {
+    docid* y=ki->idArray();
+    for (U32 j=0; j<ki->numIds; j++) {
+      if (numIds==idsSize) growIds(arena);
+      idArray()[numIds++]=y[j];
+    }
+  }
+  numIds=total;
+}
+
+
+// Number of ids in the ids array (0 if saturated)
+//
 int KgramInfo::size(void)
 {
-  return(numIds);
+  return(saturated() ? 0 : (int)numIds);
 }
 
-// Grow the ids array. Relies only on the maximum size and not the number
-// of ids currently in use (numIds). Blindly copies the whole array.
+
+// Number of documents the kgram occurs in
 //
-void KgramInfo::growIds(void)
+int KgramInfo::numDocs(void)
 {
-  docid *oldids = ids;
-  int oldidsSize = idsSize;
+  return((int)numIds);
+}
 
-  //cout << "KgramInfo::growIds[" << (ptr_to_int)this << "] was size " << idsSize << "\n";
-  if ((int)idsSize>(MAX_SIZE/2)) {
-    cerr << "KgramInfo::growIds: can't grow ids array from size " << idsSize << "\n";
-    exit(1);
+
+// Double the ids array, from arena if given. Relies only on the maximum
+// size and not the number of ids currently in use (numIds). Blindly copies
+// the whole array.
+//
+void KgramInfo::growIds(KgramArena* arena)
+{
+  U32 oldSize=idsSize;
+  docid old[KGRAMINFO_INLINE_IDS];
+  docid* oldIds=idArray();
+  if (oldSize<=KGRAMINFO_INLINE_IDS) {
+    for (U32 j=0; j<oldSize; j++) old[j]=inlineIds[j];
+    oldIds=old;
   }
+  bool oldArena=arenaIds;
 
-  idsSize+=idsSize;
-  ids = new docid[idsSize];
-  for (int j=0; j<oldidsSize; j++) {
-    ids[j]=oldids[j];
+  //cout << "KgramInfo::growIds[" << (ptr_to_int)this << "] was size " << idsSize << "\n";
+  U32 newSize=(oldSize>0 ? oldSize*2 : KGRAMINFO_INLINE_IDS*2);
+  docid* newIds;
+  if (arena!=(KgramArena*)NULL) {
+    newIds=arena->allocateIds(newSize);
+  } else {
+    newIds=new docid[newSize];
+  }
+  for (U32 j=0; j<oldSize; j++) {
+    newIds[j]=oldIds[j];
   }
-    
-  delete[] oldids;  
+  if (oldSize>KGRAMINFO_INLINE_IDS) {
+    if (!oldArena) {
+      delete[] oldIds;
+    } else if (arena!=(KgramArena*)NULL) {
+      arena->freeIds(oldIds,oldSize);
+    }
+  }
+  ids=newIds;
+  idsSize=newSize;
+  arenaIds=(arena!=(KgramArena*)NULL);
 }
 
 
@@ -135,16 +368,19 @@ void KgramInfo::growIds(void)
 
 // Format of KgramInfo object is
 //   [#occurrences,#docs] #docid1 #docid2..
+// or for a saturated kgram
+//   [#occurrences,#docs] *
 //
 ostream& operator<<(ostream& out, KgramInfo& ki)
 {
   out << "[" << ki.occurrences << "," << ki.numIds << "]";
-  if (ki.ids!=(docid*)NULL) {
-    for (int j=0; j<ki.numIds; j++) {
-      out << " " << ki.ids[j];    
-    }
+  if (ki.saturated()) {
+    out << " *";
   } else {
-    out << "ERROR_no_ids_array";
+    docid* x=ki.idArray();
+    for (U32 j=0; j<ki.numIds; j++) {
+      out << " " << x[j];    
+    }
   }
   return out;
 }
@@ -164,12 +400,21 @@ istream& operator>>(istream& in, KgramInfo& ki)
     cerr << "operator>> for KgramInfo, expected ], got character " << ch << ", bad input" << endl;
     in.clear(ios::badbit|in.rdstate()); // set stream bad
   }
+  // saturated kgram has * instead of ids, keep a dummy last id
+  while (in.peek()==' ') in.get();
+  if (in.peek()=='*') {
+    in.get();
+    ki.freeIds((KgramArena*)NULL);
+    ki.inlineIds[0]=0;
+    ki.idsSize=0;
+    ki.arenaIds=false;
+  }
   // now expect numIds space separated numbers
-  for (int j=0; j<ki.numIds; j++) {
-    if (j==ki.idsSize) ki.growIds();
+  for (int j=0; j<ki.size(); j++) {
+    if ((U32)j==ki.idsSize) ki.growIds();
     docid did;
     in >> did;
-    ki.ids[j]=did;
+    ki.idArray()[j]=did;
   }
   while (in && ((ch=in.get())!='\n')) { 
     // Skip spaces to end of line
@@ -6,28 +6,90 @@
 #include <algorithm>
 #include <fstream>
 
+// Number of ids stored in the KgramInfo object itself, most kgrams are
+// in only one or two documents
+#define KGRAMINFO_INLINE_IDS 2
+// Size of blocks of memory taken by KgramArena
+#define KGRAM_ARENA_CHUNK (1024*1024)
+
+// Memory for KgramInfo objects and their id arrays that is freed all at
+// once when the arena is destroyed (each keymap has one, see FlatKeyMap.h),
+// so no per-entry delete is needed. Id arrays have power of 2 sizes and
+// arrays given back with freeIds() are reused.
+//
+class KgramArena
+{
+public:
+  KgramArena(void);
+  ~KgramArena(void);
+  void* allocate(size_t bytes);
+  docid* allocateIds(U32& n);
+  void freeIds(docid* ids, U32 n);
+  void release(void);
+  void swap(KgramArena& other);
+  void adopt(KgramArena& other);
+  size_t sizeInBytes(void) { return(bytes); }
+
+private:
+  vector<char*> chunks;   // all memory, freed by release()
+  char* next;             // next free byte in last chunk
+  size_t avail;           // bytes left in last chunk
+  size_t bytes;           // total allocated
+  vector<docid*> freeLists[32]; // freed id arrays by log2 of size
+  KgramArena(const KgramArena&);
+  KgramArena& operator=(const KgramArena&);
+};
+
+
 class KgramInfo
 {
 public:
   // DATA
   int occurrences;    // total # of occurrences (counted multiply per document)
-  U16 numIds;         // number of ids in use (# of documents kgram occurs in (counted once per document))
-  U16 idsSize;        // size of ids array
-  docid *ids;         // array of document ids
- 
+  U32 numIds;         // number of ids in use (# of documents kgram occurs in (counted once per document))
+  U32 idsSize;        // size of ids array, 0 if saturated
+  bool arenaIds;      // ids array is from a KgramArena
+  //
+  // Ids are in the object up to KGRAMINFO_INLINE_IDS, otherwise in an array
+  // from the heap or from a KgramArena, see idArray().
+  //
+  // Once a kgram is found in more than maxDupesToCount documents (see
+  // addOccurrence) it is "saturated": ids is cut to just the last docid,
+  // idsSize is 0 and numIds carries on counting documents.
+
   // METHODS
   KgramInfo(void);
   KgramInfo(docid id);
-  KgramInfo(intv& idv);
-  KgramInfo(KgramInfo* ki);
+  KgramInfo(intv& idv, KgramArena* arena=(KgramArena*)NULL);
+  KgramInfo(docid* idv, int n, KgramArena* arena=(KgramArena*)NULL);
+  KgramInfo(KgramInfo* ki, KgramArena* arena=(KgramArena*)NULL);
   ~KgramInfo(void);
   KgramInfo& operator=(const KgramInfo& ki);
-  void addOccurrence(docid id, int maxDupesToCount=-1);
+  void addOccurrence(docid id, int maxDupesToCount=-1, KgramArena* arena=(KgramArena*)NULL);
+  void merge(KgramInfo* ki, int maxDupesToCount=-1, KgramArena* arena=(KgramArena*)NULL);
   int size(void);
-  void growIds(void);
+  int numDocs(void);
+  bool saturated(void) { return(idsSize==0 && numIds>0); }
+  docid* idArray(void) { return(idsSize<=KGRAMINFO_INLINE_IDS ? inlineIds : ids); }
+  void growIds(KgramArena* arena=(KgramArena*)NULL);
+
+  // Objects may be created in a KgramArena with new(arena) KgramInfo(...),
+  // these must not be deleted
+  static void* operator new(size_t size) { return(::operator new(size)); }
+  static void* operator new(size_t size, KgramArena& arena) { return(arena.allocate(size)); }
+  static void operator delete(void* p) { ::operator delete(p); }
+  static void operator delete(void* p, KgramArena& arena) {}
 
   friend ostream& operator<<(ostream& out, KgramInfo& ki);
   friend istream& operator>>(istream& in, KgramInfo& ki);
+
+private:
+  union {
+    docid inlineIds[KGRAMINFO_INLINE_IDS];
+    docid* ids;
+  };
+  void allocIds(U32 n, KgramArena* arena);
+  void freeIds(KgramArena* arena);
 };
 
 #endif //__INC_KgramInfo
@@ -0,0 +1,91 @@
+// Buffered output for writing large KeyTable and KeyMap text files.
+//
+// Integers are formatted directly into a large buffer which is written to
+// the underlying stream only when full or on flush(), never per line. Each
+// writing thread should have its own OutBuffer.
+//
+// Methods are inline as they are called once or more per line written.
+
+#ifndef __INC_OutBuffer
+#define __INC_OutBuffer 1
+
+#include "definitions.h"
+
+// Default buffer size in bytes
+#define OUTBUFFER_SIZE (4*1024*1024)
+// Most chars that a single put call adds (U64 in decimal)
+#define OUTBUFFER_MAX_PUT 20
+
+class OutBuffer
+{
+public:
+  OutBuffer(ostream& o, size_t size=OUTBUFFER_SIZE) : out(o), written(0)
+  {
+    if (size<OUTBUFFER_MAX_PUT*4) size=OUTBUFFER_MAX_PUT*4;
+    buf=new char[size];
+    p=buf;
+    last=buf+size-OUTBUFFER_MAX_PUT;
+  }
+  ~OutBuffer(void) { flush(); delete[] buf; }
+
+  // Write out buffer contents
+  void flush(void)
+  {
+    if (p>buf) {
+      out.write(buf,p-buf);
+      written+=p-buf;
+      p=buf;
+    }
+  }
+
+  // Number of bytes put so far, including those not yet flushed
+  size_t bytes(void) { return(written+(p-buf)); }
+
+  void putChar(char c)
+  {
+    if (p>=last) flush();
+    *p++=c;
+  }
+
+  void putStr(const char* s)
+  {
+    while (*s!='\0') putChar(*s++);
+  }
+
+  // Decimal without leading zeros
+  void putDec(U64 x)
+  {
+    if (p>=last) flush();
+    char tmp[OUTBUFFER_MAX_PUT];
+    int n=0;
+    do {
+      tmp[n++]=(char)('0'+x%10);
+      x/=10;
+    } while (x>0);
+    while (n>0) *p++=tmp[--n];
+  }
+
+  // Lower case hex with at least minDigits digits (zero padded)
+  void putHex(U64 x, int minDigits)
+  {
+    if (p>=last) flush();
+    static const char hex[]="0123456789abcdef";
+    char tmp[OUTBUFFER_MAX_PUT];
+    int n=0;
+    do {
+      tmp[n++]=hex[x&0xf];
+      x>>=4;
+    } while (x>0);
+    while (n<minDigits && n<16) tmp[n++]='0';
+    while (n>0) *p++=tmp[--n];
+  }
+
+private:
+  ostream& out;
+  char* buf;
+  char* p;       // next free char in buf
+  char* last;    // flush before writing beyond here
+  size_t written;
+};
+
+#endif /* #ifndef __INC_OutBuffer */
@@ -0,0 +1,55 @@
+// Compressed docid bitmap for long posting lists, see PostingBitmap.h
+
+#include "PostingBitmap.h"
+
+
+// Add docid i which must be larger than any already added
+//
+void PostingBitmap::append(U32 i)
+{
+  U16 high=(U16)(i>>16);
+  U16 low=(U16)(i&0xffff);
+  if (containers.empty() || containers.back().high!=high) {
+    containers.push_back(Container());
+    containers.back().high=high;
+    containers.back().card=0;
+  }
+  Container& ct=containers.back();
+  if (!ct.isBitmap()) {
+    if (ct.array.size()<BITMAP_ARRAY_MAX) {
+      ct.array.push_back(low);
+      ct.card++;
+      card++;
+      return;
+    }
+    // Array full, switch to bitmap
+    ct.bits.assign(BITMAP_WORDS,0);
+    for (size_t k=0; k<ct.array.size(); k++) {
+      ct.bits[ct.array[k]>>6]|=((U64)1<<(ct.array[k]&63));
+    }
+    vector<U16>().swap(ct.array);
+  }
+  ct.bits[low>>6]|=((U64)1<<(low&63));
+  ct.card++;
+  card++;
+}
+
+
+size_t PostingBitmap::sizeInBytes(void)
+{
+  size_t b=sizeof(PostingBitmap)+containers.capacity()*sizeof(Container);
+  for (size_t c=0; c<containers.size(); c++) {
+    b+=containers[c].array.capacity()*sizeof(U16)+containers[c].bits.capacity()*sizeof(U64);
+  }
+  return(b);
+}
+
+
+size_t PostingBitmap::numBitmapContainers(void)
+{
+  size_t n=0;
+  for (size_t c=0; c<containers.size(); c++) {
+    if (containers[c].isBitmap()) n++;
+  }
+  return(n);
+}
@@ -0,0 +1,81 @@
+// Compressed bitmap of docids in the style of Roaring bitmaps, used for
+// long table3 posting lists in KeyTable (see KeyTable3Element.h).
+//
+// Docids are split by their high 16 bits into containers, each holding
+// the low 16 bits of its docids as either
+//   array  - sorted U16 values, used up to BITMAP_ARRAY_MAX values
+//   bitmap - 65536 bits (8kB), used above that
+// so a list costs at most 2 bytes per docid and much less when dense.
+//
+// Docids must be added in increasing order with append(), as they are
+// for a KeyTable.
+
+#ifndef __INC_PostingBitmap
+#define __INC_PostingBitmap 1
+
+#include "definitions.h"
+
+// Largest array container, above this a bitmap container is smaller
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_WORDS 1024
+
+class PostingBitmap
+{
+public:
+  struct Container {
+    U16 high;            // high 16 bits of docids in this container
+    U32 card;            // number of docids
+    vector<U16> array;   // low 16 bits, if an array container
+    vector<U64> bits;    // BITMAP_WORDS words, if a bitmap container
+    bool isBitmap(void) { return(!bits.empty()); }
+  };
+
+  vector<Container> containers;  // in increasing order of high
+  size_t card;                   // total number of docids
+
+  PostingBitmap(void) : card(0) {}
+  void append(U32 i);
+  size_t size(void) { return(card); }
+  size_t sizeInBytes(void);
+  size_t numBitmapContainers(void);
+
+  // Call f(d) for each docid d in increasing order, straight from the
+  // containers so callers that only count needn't build a list
+  template <class F>
+  void forEach(F& f)
+  {
+    for (size_t c=0; c<containers.size(); c++) {
+      Container& ct=containers[c];
+      U32 base=((U32)ct.high)<<16;
+      if (!ct.isBitmap()) {
+        for (size_t k=0; k<ct.array.size(); k++) {
+          f(base|ct.array[k]);
+        }
+      } else {
+        for (size_t w=0; w<BITMAP_WORDS; w++) {
+          U64 word=ct.bits[w];
+          while (word!=0) {
+            f(base|(U32)(w*64+__builtin_ctzll(word)));
+            word&=word-1;
+          }
+        }
+      }
+    }
+  }
+
+  // Append all docids in increasing order to out (any vector type)
+  template <class V>
+  struct Appender {
+    V& out;
+    Appender(V& o) : out(o) {}
+    void operator()(U32 i) { out.push_back(i); }
+  };
+  template <class V>
+  void appendTo(V& out)
+  {
+    Appender<V> a(out);
+    forEach(a);
+  }
+};
+
+#endif /* #ifndef __INC_PostingBitmap */
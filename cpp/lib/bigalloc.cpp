@@ -0,0 +1,109 @@
+// Allocation of very large arrays with huge pages where possible,
+// see bigalloc.h
+
+#include "bigalloc.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+// Size of huge pages used with MAP_HUGETLB (x86_64 default)
+#define HUGE_PAGE_BYTES (2*1024*1024)
+
+
+void* bigAlloc(BigAlloc& a, size_t bytes)
+{
+  a.bytes=bytes;
+  a.ptr=NULL;
+#if defined(MAP_ANONYMOUS)
+  if (bytes>=BIGALLOC_MIN_BYTES) {
+    a.mapped=((bytes+HUGE_PAGE_BYTES-1)/HUGE_PAGE_BYTES)*HUGE_PAGE_BYTES;
+  #ifdef MAP_HUGETLB
+    void* p=mmap(NULL,a.mapped,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    if (p!=MAP_FAILED) {
+      a.ptr=p;
+      a.method=BIGALLOC_HUGETLB;
+      a.zeroed=true;
+      return(a.ptr);
+    }
+  #endif
+    p=mmap(NULL,a.mapped,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (p!=MAP_FAILED) {
+  #ifdef MADV_HUGEPAGE
+      madvise(p,a.mapped,MADV_HUGEPAGE); // just advice, ignore failure
+  #endif
+      a.ptr=p;
+      a.method=BIGALLOC_MADVISE;
+      a.zeroed=true;
+      return(a.ptr);
+    }
+  }
+#endif
+  a.mapped=bytes;
+  a.ptr=new char[bytes>0 ? bytes : 1];
+  a.method=BIGALLOC_NEW;
+  a.zeroed=false;
+  return(a.ptr);
+}
+
+
+void bigFree(BigAlloc& a)
+{
+  if (a.ptr==NULL) return;
+  if (a.method==BIGALLOC_NEW) {
+    delete[] (char*)a.ptr;
+  } else {
+#if defined(MAP_ANONYMOUS)
+    munmap(a.ptr,a.mapped);
+#endif
+  }
+  a.ptr=NULL;
+  a.bytes=0;
+  a.mapped=0;
+  a.method=BIGALLOC_NONE;
+}
+
+
+// Describe how memory was allocated and, for mmap, the page size and huge
+// page use actually obtained according to /proc/self/smaps
+//
+string bigAllocDescription(BigAlloc& a)
+{
+  ostringstream d;
+  if (a.method==BIGALLOC_NONE) return("none");
+  if (a.method==BIGALLOC_NEW) {
+    d << "new, pagesize=" << (sysconf(_SC_PAGESIZE)/1024) << "kB";
+    return(d.str());
+  }
+  d << (a.method==BIGALLOC_HUGETLB ? "mmap(MAP_HUGETLB)" : "mmap+madvise(MADV_HUGEPAGE)");
+  ifstream smaps("/proc/self/smaps");
+  string line;
+  bool inMapping=false;
+  string kernelPageSize="?";
+  string anonHuge="?";
+  unsigned long addr=(unsigned long)a.ptr;
+  while (getline(smaps,line)) {
+    unsigned long start, end;
+    // Mapping header lines start "start-end perms ..."
+    if (sscanf(line.c_str(),"%lx-%lx ",&start,&end)==2 && line.find(':')>line.find(' ')) {
+      if (inMapping) break;
+      inMapping=(addr>=start && addr<end);
+    } else if (inMapping) {
+      if (line.compare(0,15,"KernelPageSize:")==0) {
+        kernelPageSize=line.substr(15);
+      } else if (line.compare(0,14,"AnonHugePages:")==0) {
+        anonHuge=line.substr(14);
+      }
+    }
+  }
+  // Tidy whitespace from smaps values
+  size_t k=kernelPageSize.find_first_not_of(' ');
+  if (k!=string::npos) kernelPageSize=kernelPageSize.substr(k);
+  k=anonHuge.find_first_not_of(' ');
+  if (k!=string::npos) anonHuge=anonHuge.substr(k);
+  d << ", pagesize=" << kernelPageSize << ", AnonHugePages=" << anonHuge
+    << " of " << (a.mapped/1024) << " kB";
+  return(d.str());
+}
@@ -0,0 +1,77 @@
+// Allocation of very large arrays (KeyTable table1 and table2) so that
+// they can use huge pages and so cut TLB misses on random access.
+//
+// In order of preference:
+//   mmap with MAP_HUGETLB  - needs huge pages reserved by the admin
+//   mmap with madvise(MADV_HUGEPAGE) - transparent huge pages
+//   new[]                  - small arrays or when mmap isn't available
+// Memory from mmap is already zeroed.
+//
+// Usage:
+//   BigAlloc a;
+//   T* x=(T*)bigAlloc(a,n*sizeof(T));
+//   ...
+//   bigFree(a);
+
+#ifndef __INC_bigalloc
+#define __INC_bigalloc 1
+
+#include "definitions.h"
+#include "parallel.h"
+
+// Arrays smaller than this just use new[]
+#define BIGALLOC_MIN_BYTES (64*1024*1024)
+
+#define BIGALLOC_NONE 0
+#define BIGALLOC_NEW 1
+#define BIGALLOC_HUGETLB 2
+#define BIGALLOC_MADVISE 3
+
+struct BigAlloc {
+  void* ptr;
+  size_t bytes;     // as requested
+  size_t mapped;    // rounded up for mmap
+  int method;       // BIGALLOC_*
+  bool zeroed;      // memory known to be zero
+  BigAlloc(void) : ptr(NULL), bytes(0), mapped(0), method(BIGALLOC_NONE), zeroed(false) {}
+};
+
+void* bigAlloc(BigAlloc& a, size_t bytes);
+void bigFree(BigAlloc& a);
+string bigAllocDescription(BigAlloc& a);
+
+
+// Fill x[0..n-1] with value using threads
+//
+template <class T>
+struct FillWork {
+  T* x;
+  T value;
+  size_t start;
+  size_t end;
+};
+
+template <class T>
+void* fillThread(void* arg)
+{
+  FillWork<T>* w=(FillWork<T>*)arg;
+  for (size_t j=w->start; j<w->end; j++) {
+    w->x[j]=w->value;
+  }
+  return(NULL);
+}
+
+template <class T>
+void parallelFill(T* x, size_t n, T value, int threads)
+{
+  if (threads<1 || n<(size_t)threads*1024*1024) threads=1;
+  vector< FillWork<T> > work(threads);
+  for (int t=0; t<threads; t++) {
+    work[t].x=x;
+    work[t].value=value;
+    splitRange(n,threads,t,work[t].start,work[t].end);
+  }
+  runThreads(work,fillThread<T>);
+}
+
+#endif /* #ifndef __INC_bigalloc */
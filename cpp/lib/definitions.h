@@ -31,6 +31,15 @@ typedef unsigned short U16;
 typedef unsigned char U8;
 #define U16_MAX USHRT_MAX
 
+// Packed 24-bit unsigned int (3 bytes, no padding in arrays) for narrow
+// docid storage in KeyTables of corpora with less than 2^24 documents
+struct U24 {
+  U8 b[3];
+  U24(void) {}
+  U24(U32 x) { b[0]=(U8)x; b[1]=(U8)(x>>8); b[2]=(U8)(x>>16); }
+  operator U32() const { return((U32)b[0] | ((U32)b[1]<<8) | ((U32)b[2]<<16)); }
+};
+
 // Defintions intimately tied to the key type and size
 typedef U64 kgramkey;      // Type for kgram keys
 #define KGRAMKEYDIGITS 16  // Number of hex digits in kgram key
@@ -53,11 +62,11 @@ typedef vector<kgramkey> kgramkeyv;
   #include "hash_ull.h"
   typedef hash_set<kgramkey> keyhashset;
   typedef hash_set<docid> docidhashset;
-  typedef hash_set<int> indexhashset;
+  typedef hash_set<U32> indexhashset;
 #else
   typedef std::tr1::unordered_set<kgramkey> keyhashset;
   typedef std::tr1::unordered_set<docid> docidhashset;
-  typedef std::tr1::unordered_set<int> indexhashset;
+  typedef std::tr1::unordered_set<U32> indexhashset;
 #endif
 
 // Utility types based on standard types
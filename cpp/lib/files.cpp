@@ -76,14 +76,24 @@ bool readLine(istream &fin, char* buf, int bufSize) {
 }
 
 
-// Version of readLine that uses buffer space allocated here.
+// Version of readLine that uses buffer space allocated here. There
+// is one buffer per thread so that files can be read on several threads.
 //
-char buf[FILE_BUFFER_SIZE];
+__thread char* lineBuf=(char*)NULL;
 //
 char* readLine(istream &fin) {
-  if (readLine(fin, buf, FILE_BUFFER_SIZE)) {
-    return(buf);
+  if (lineBuf==(char*)NULL) lineBuf=new char[FILE_BUFFER_SIZE];
+  if (readLine(fin, lineBuf, FILE_BUFFER_SIZE)) {
+    return(lineBuf);
   } else {
     return((char*)NULL);
   }
 }
+
+
+// Free this thread's readLine buffer, call at the end of a worker thread
+//
+void freeLineBuffer(void) {
+  delete[] lineBuf;
+  lineBuf=(char*)NULL;
+}
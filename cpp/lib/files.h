@@ -13,5 +13,6 @@ string prependPath(string path, string filename);
 
 bool readLine(istream &fin, char* buf, int bufSize);
 char* readLine(istream &fin);
+void freeLineBuffer(void);
 
 #endif // __INC_files
@@ -103,10 +103,13 @@ kgramkey stringToKgramkey(char* keystr, int chars)
 // internally as they seem to be very inefficient. Now returns
 // a pointer to an array of kgrams [Simeon]
 //
-int MAX_KEYS=INITIAL_MAX_KEYS;
-kgramkey* allkeys=new kgramkey[INITIAL_MAX_KEYS];
-int MAX_RESULTS=INITIAL_MAX_RESULTS;
-kgramkey* results=new kgramkey[INITIAL_MAX_RESULTS];
+// The work arrays are per thread so that documents can be fingerprinted
+// on several threads, they are allocated on first use.
+//
+__thread int MAX_KEYS=INITIAL_MAX_KEYS;
+__thread kgramkey* allkeys=(kgramkey*)NULL;
+__thread int MAX_RESULTS=INITIAL_MAX_RESULTS;
+__thread kgramkey* results=(kgramkey*)NULL;
 
 void growAllkeys() {
   int newMax=MAX_KEYS*2;
@@ -138,6 +141,10 @@ void growResults() {
 //
 kgramkey* getKgrams(char* sentence, bool winnow)
 {
+  if (allkeys==(kgramkey*)NULL) {
+    allkeys=new kgramkey[MAX_KEYS];
+    results=new kgramkey[MAX_RESULTS];
+  }
   intv spaces;       //places of word boundaries in the sentence
   int numWords=findSpaces(spaces,sentence);
   //cout << "numWords=" << numWords << ": " << sentence << "\n";
@@ -189,6 +196,20 @@ kgramkey* getKgrams(char* sentence, bool winnow)
 }
 
 
+// Free this thread's getKgrams work arrays, call at the end of a worker
+// thread
+//
+void freeKgramBuffers(void)
+{
+  delete[] allkeys;
+  delete[] results;
+  allkeys=(kgramkey*)NULL;
+  results=(kgramkey*)NULL;
+  MAX_KEYS=INITIAL_MAX_KEYS;
+  MAX_RESULTS=INITIAL_MAX_RESULTS;
+}
+
+
 // Just do a simple linear search for the smallest key in the
 // array of kgramkeys from startkey to endkey. Returns the address
 // of the smallest kgram key. If startkey==endkey on input then 
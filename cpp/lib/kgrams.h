@@ -12,6 +12,7 @@ string kgramkeyToString(U64 hash);
 kgramkey stringToKgramkey(char* keystr, int chars=0);
 kgramkey* findSmallestKgramkey(kgramkey* startkey, kgramkey* endkey, kgramkey* lastkey);
 kgramkey* getKgrams(char* sentence, bool winnow=true);
+void freeKgramBuffers(void);
 char* findKgram(kgramkey& key, char* sentence);
 char* findKgramWithMask(kgramkey& key, kgramkey mask, char* sentence);
 int findWordsInKgrams(intv& spaces, intv& words, kgramkeyv& keystarts, keyhashset& keys, char* sentence);
@@ -50,6 +50,16 @@ int rangeStart=0;
 int rangeEnd=0;
 int selectBits=0;
 int selectMatch=0;
+int numThreads=1;
+bool freezeKeyTable=false;
+int saturateAbove=0;
+string deleteFile="";
+string segmentDir="";
+int shardPort=0;
+string shardsFile="";
+int sketchBits=0;
+int memoryBudget=0;
+int wirePort=0;
 
 int readOptions(int argc, char* argv[], string argsUsed, string myname, string usage)
 {
@@ -147,6 +157,37 @@ int readOptions(int argc, char* argv[], string argsUsed, string myname, string u
     case 'X':
       selectMatch=atoi(optarg);
       break;
+    case 'j':
+      numThreads=atoi(optarg);
+      if (numThreads<1) numThreads=1;
+      break;
+    case 'z':
+      freezeKeyTable=true;
+      break;
+    case 'u':
+      saturateAbove=atoi(optarg);
+      break;
+    case 'e':
+      deleteFile=optarg;
+      break;
+    case 'g':
+      segmentDir=optarg;
+      break;
+    case 'p':
+      shardPort=atoi(optarg);
+      break;
+    case 'i':
+      shardsFile=optarg;
+      break;
+    case 'y':
+      sketchBits=atoi(optarg);
+      break;
+    case 'a':
+      memoryBudget=atoi(optarg);
+      break;
+    case 'q':
+      wirePort=atoi(optarg);
+      break;
     }
   }
 
@@ -180,6 +221,33 @@ int readOptions(int argc, char* argv[], string argsUsed, string myname, string u
     if (baseDir.length()>0) {
       cout << myname << ":      baseDir=" << baseDir << endl;
     }
+    if (numThreads>1) {
+      cout << myname << ":   numThreads=" << numThreads << endl;
+    }
+    if (segmentDir.length()>0) {
+      cout << myname << ":   segmentDir=" << segmentDir << endl;
+    }
+    if (deleteFile.length()>0) {
+      cout << myname << ":   deleteFile=" << deleteFile << endl;
+    }
+    if (shardPort>0) {
+      cout << myname << ":    shardPort=" << shardPort << endl;
+    }
+    if (sketchBits>0) {
+      cout << myname << ":   sketchBits=" << sketchBits << endl;
+    }
+    if (memoryBudget>0) {
+      cout << myname << ": memoryBudget=" << memoryBudget << "MB" << endl;
+    }
+    if (wirePort>0) {
+      cout << myname << ":     wirePort=" << wirePort << endl;
+    }
+    if (shardsFile.length()>0) {
+      cout << myname << ":   shardsFile=" << shardsFile << endl;
+    }
+    if (saturateAbove>0) {
+      cout << myname << ": saturateAbove=" << saturateAbove << endl;
+    }
   }
 
   return(optind);
@@ -214,6 +282,10 @@ void writeUsage(char* args_str, string myname, string usage)
       shortArgs << " -d <datadir>";
       longArgs << "  -d <datadir>       Specify data directory for input files [default pwd]" << endl;
       break;
+    case 'e':
+      shortArgs << " -e <docidsFile>";
+      longArgs << "  -e <docidsFile>    File of docids of withdrawn or replaced documents to delete from KeyTable" << endl;
+      break;
     case 'f':
       shortArgs << " -f <filename1>";
       longArgs << "  -f <filename1>     Specify normalized txt to examine" << endl;
@@ -222,6 +294,30 @@ void writeUsage(char* args_str, string myname, string usage)
       shortArgs << " -F <filename2>";
       longArgs << "  -F <filename2>     Specify normalized txt to compare filename1 against" << endl;
       break;
+    case 'g':
+      shortArgs << " -g <segmentDir>";
+      longArgs << "  -g <segmentDir>    Directory of KeyTable segments (manifest segments.txt) to add to or read" << endl;
+      break;
+    case 'y':
+      shortArgs << " -y <bits>";
+      longArgs << "  -y <bits>          Find common kgrams first with a sketch of 4x2^bits bytes, keeps them out of the KeyMap" << endl;
+      break;
+    case 'a':
+      shortArgs << " -a <MB>";
+      longArgs << "  -a <MB>            Build in sorted runs of about this size on disk then merge them, bounds memory" << endl;
+      break;
+    case 'q':
+      shortArgs << " -q <port>";
+      longArgs << "  -q <port>          Also answer queries with the lightweight length-prefixed protocol on port" << endl;
+      break;
+    case 'i':
+      shortArgs << " -i <shardsFile>";
+      longArgs << "  -i <shardsFile>    Coordinate KeyTable shards listed in file (lines: selectMatch host port), needs -x" << endl;
+      break;
+    case 'j':
+      shortArgs << " -j <#threads>";
+      longArgs << "  -j <#threads>      Number of threads to use for whole table operations [default 1]" << endl;
+      break;
     case 'k':
       shortArgs << " -k <key>";
       longArgs << "  -k <key>           Specify kgram key (64bit hex)" << endl;
@@ -240,12 +336,16 @@ void writeUsage(char* args_str, string myname, string usage)
       break;
     case 'm':
       shortArgs << " -m <KeyMapFile>";
-      longArgs << "  -m <KeyMapFile>    Full name of KeyMap file to read" << endl;
+      longArgs << "  -m <KeyMapFile>    Full name of KeyMap file to read (ASCII or binary .keymap)" << endl;
       break;
     case 'o':
       shortArgs << " -o <basedir>";
       longArgs << "  -o <basedir>       Output file base directory [default /tmp]" << endl;
       break; 
+    case 'p':
+      shortArgs << " -p <port>";
+      longArgs << "  -p <port>          Serve KeyTable shard lookups for a coordinator on port" << endl;
+      break;
     case 'r':
       shortArgs << " -r <docid-range>";
       longArgs << "  -r <docid-range>   Add in data from documents in range start-end" << endl;
@@ -266,6 +366,10 @@ void writeUsage(char* args_str, string myname, string usage)
       shortArgs << " -T <KeyTableBase>";
       longArgs << "  -T <KeyTableBase>  Set base name of KeyTable files (e.g. dir/allkeys for dir/allkeys_#.keytable)" << endl;
       break;
+    case 'u':
+      shortArgs << " -u <#docs>";
+      longArgs << "  -u <#docs>         Saturate keys in more than #docs documents (drop docids) [default no limit]" << endl;
+      break;
     case 'w':
       shortArgs << " -w";
       longArgs << "  -w                 Write shared keys table (tables23 in KeyTable, index is XX and 6 digit hex num)" << endl;
@@ -277,6 +381,10 @@ void writeUsage(char* args_str, string myname, string usage)
       shortArgs << " -X <selectMatch>";
       longArgs << "  -X <selectMatch>   Binary match used on high bits (selectBits..#bits with -x/-b)" << endl;
       break;
+    case 'z':
+      shortArgs << " -z";
+      longArgs << "  -z                 Freeze KeyTable after reading (compact read-only table1)" << endl;
+      break;
     case ':': case '+': case 'v': case 'V': case 'h': case 'H':
       break;
     default:
@@ -41,6 +41,16 @@ extern int rangeStart;
 extern int rangeEnd;
 extern int selectBits;
 extern int selectMatch;
+extern int numThreads;
+extern bool freezeKeyTable;
+extern int saturateAbove;
+extern string deleteFile;
+extern string segmentDir;
+extern int shardPort;
+extern string shardsFile;
+extern int sketchBits;
+extern int memoryBudget;
+extern int wirePort;
 
 int readOptions(int argc, char* argv[], string argsUsed, string myname, string usage);
 void writeUsage(char* args_str, string myname, string usage);
@@ -0,0 +1,45 @@
+// Minimal helpers for running whole table passes on several threads
+// with pthreads.
+//
+// Work is described by a vector of per-thread work objects, fn is called
+// once with a pointer to each. With one work object fn is called directly
+// on the calling thread.
+
+#ifndef __INC_parallel
+#define __INC_parallel 1
+
+#include "definitions.h"
+#include <pthread.h>
+#include <stdlib.h>  // for exit()
+
+template <class Work>
+void runThreads(vector<Work>& work, void* (*fn)(void*))
+{
+  if (work.size()==1) {
+    fn(&work[0]);
+    return;
+  }
+  vector<pthread_t> tids(work.size());
+  for (size_t t=0; t<work.size(); t++) {
+    if (pthread_create(&tids[t],NULL,fn,&work[t])!=0) {
+      cerr << "runThreads: Error - failed to create thread " << t << endl;
+      exit(4);
+    }
+  }
+  for (size_t t=0; t<work.size(); t++) {
+    pthread_join(tids[t],NULL);
+  }
+}
+
+
+// Range [start,end) of part t when n items are split into parts
+//
+inline void splitRange(size_t n, int parts, int t, size_t& start, size_t& end)
+{
+  size_t each=n/parts;
+  size_t extra=n%parts;
+  start=each*t+((size_t)t<extra ? t : extra);
+  end=start+each+((size_t)t<extra ? 1 : 0);
+}
+
+#endif /* #ifndef __INC_parallel */
@@ -0,0 +1,61 @@
+// Compact read-only structures used for a frozen KeyTable table1,
+// see succinct.h
+
+#include "succinct.h"
+
+
+void RankBitVector::init(size_t size)
+{
+  n=size;
+  bits.assign((n+63)/64+1,0); // one spare word so rank(n) is safe
+  blockRank.clear();
+}
+
+
+void RankBitVector::clear(void)
+{
+  n=0;
+  vector<U64>().swap(bits);
+  vector<U64>().swap(blockRank);
+}
+
+
+void RankBitVector::buildRank(void)
+{
+  blockRank.assign(bits.size()/RANK_BLOCK_WORDS+1,0);
+  U64 r=0;
+  for (size_t w=0; w<bits.size(); w++) {
+    if (w%RANK_BLOCK_WORDS==0) blockRank[w/RANK_BLOCK_WORDS]=r;
+    r+=__builtin_popcountll(bits[w]);
+  }
+}
+
+
+size_t RankBitVector::sizeInBytes(void)
+{
+  return((bits.size()+blockRank.size())*sizeof(U64));
+}
+
+
+void PackedArray::init(size_t size, int bitsPerValue)
+{
+  n=size;
+  width=(bitsPerValue<1 ? 1 : bitsPerValue);
+  mask=(width>=64 ? ~(U64)0 : (((U64)1<<width)-1));
+  words.assign((n*width+63)/64+1,0);
+}
+
+
+void PackedArray::clear(void)
+{
+  n=0;
+  vector<U64>().swap(words);
+}
+
+
+int bitsFor(U64 x)
+{
+  int b=1;
+  while (b<64 && (x>>b)>0) b++;
+  return(b);
+}
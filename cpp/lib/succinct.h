@@ -0,0 +1,93 @@
+// Compact read-only structures used for a frozen KeyTable table1.
+//
+// RankBitVector - bitvector with constant time rank (number of set bits
+//                 before a position) using one cumulative count per block
+//                 of RANK_BLOCK_WORDS 64-bit words (12.5% overhead)
+// PackedArray   - array of unsigned values each stored in a fixed number
+//                 of bits (1..64)
+//
+// Lookups are inline as they are on the query path.
+
+#ifndef __INC_succinct
+#define __INC_succinct 1
+
+#include "definitions.h"
+
+#define RANK_BLOCK_WORDS 8
+
+class RankBitVector
+{
+public:
+  RankBitVector(void) : n(0) {}
+  void init(size_t size);
+  void clear(void);
+  void set(size_t i) { bits[i>>6]|=((U64)1<<(i&63)); }
+  void buildRank(void);
+  size_t size(void) { return(n); }
+  size_t sizeInBytes(void);
+
+  bool get(size_t i) { return((bits[i>>6]>>(i&63))&1); }
+
+  // Number of set bits in positions [0,i), buildRank() must have been called
+  size_t rank(size_t i)
+  {
+    size_t w=i>>6;
+    size_t r=blockRank[w/RANK_BLOCK_WORDS];
+    for (size_t k=w-(w%RANK_BLOCK_WORDS); k<w; k++) {
+      r+=__builtin_popcountll(bits[k]);
+    }
+    if (i&63) r+=__builtin_popcountll(bits[w]&(((U64)1<<(i&63))-1));
+    return(r);
+  }
+
+  const U64* word(size_t i) { return(&bits[i>>6]); }
+
+private:
+  size_t n;
+  vector<U64> bits;
+  vector<U64> blockRank;  // set bits before each block
+};
+
+
+class PackedArray
+{
+public:
+  PackedArray(void) : n(0), width(0) {}
+  void init(size_t size, int bitsPerValue);
+  void clear(void);
+  size_t size(void) { return(n); }
+  int bitsPerValue(void) { return(width); }
+  size_t sizeInBytes(void) { return(words.size()*sizeof(U64)); }
+
+  void set(size_t i, U64 v)
+  {
+    size_t b=i*width;
+    size_t w=b>>6;
+    int s=b&63;
+    words[w]=(words[w]&~(mask<<s))|(v<<s);
+    if (s+width>64) {
+      words[w+1]=(words[w+1]&~(mask>>(64-s)))|(v>>(64-s));
+    }
+  }
+
+  U64 get(size_t i)
+  {
+    size_t b=i*width;
+    size_t w=b>>6;
+    int s=b&63;
+    U64 v=words[w]>>s;
+    if (s+width>64) v|=words[w+1]<<(64-s);
+    return(v&mask);
+  }
+
+private:
+  size_t n;
+  int width;
+  U64 mask;
+  vector<U64> words;
+};
+
+// Number of bits needed to store values 0..x
+int bitsFor(U64 x);
+
+#endif /* #ifndef __INC_succinct */
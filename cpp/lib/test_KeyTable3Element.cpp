@@ -34,4 +34,13 @@ int main(int argc, char* argv[])
   cout << "Element 99 = " << k[99] << endl;
   cout << "Element 999 = " << k[999] << endl;
 
+  // Long increasing list switches to a bitmap
+  KeyTable3Element kb;
+  for (U32 j=1; j<=5000; j++) {
+    kb.push_back(j*3);
+  }
+  cout << "After 5000 increasing additions: bitmap=" << kb.isBitmap() << " back=" << kb.back() << " size=" << kb.size() << " size_in_bytes=" << kb.size_in_bytes() << endl;
+  kb.push_back(7);
+  cout << "After out of order addition: bitmap=" << kb.isBitmap() << " back=" << kb.back() << " size=" << kb.size() << " size_in_bytes=" << kb.size_in_bytes() << endl;
+
 }
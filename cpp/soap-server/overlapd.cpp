@@ -9,11 +9,39 @@
 // where each line is of the form defined by DocPair:
 //   docid1 docid2 keys_overlapping
 // docid2 will always be 9999999 as a dummy value because the input
-// document was supplied directly.
+// document was supplied directly. Documents come best first. Optional
+// <limit> (if >0) returns only that many, optional <minShared> (if >0)
+// only those sharing more than that many keys rather than keysForMatch.
+//
+// With -q <port> the same two requests are also answered with a
+// lightweight protocol that avoids the cost of XML and of a connection per
+// request. Each request and response is a frame of a 4 byte length
+// (network byte order) followed by that many bytes of text:
+//   request  "status\n"                          -> "I_AM_HAPPY\n"
+//   request  "overlap [limit [minShared]]\n<doc>" -> "<matches>\n<DocPair lines>"
+// and anything else, or an overlap request that fails, gets "ERROR ...\n"
+// (over SOAP a failed overlap is a fault). Connections are kept open for
+// further requests, which may be sent without waiting for responses
+// (pipelining), and responses come back in request order. Connections are
+// served by a second pool of -j threads, each keeping one connection until
+// it is closed or idle for WIRE_IDLE_SECONDS, others wait their turn.
+//
+// With -i <shardsFile> -x <selectBits> runs as a coordinator over KeyTable
+// shards split by key range (see KeyTableShards.h): keys of the input
+// document are sent to the shards in parallel and their counts summed. With
+// -p <port> runs as one of those shards, answering lookups for its slice of
+// the key space on port instead of serving SOAP.
+//
+// SOAP requests are answered by a pool of -j worker threads (default 1),
+// each with its own copy of the soap context, all querying the one
+// read-only KeyTable. The main thread accepts connections and queues them
+// for the workers. Each request's log lines are collected and written to
+// the log together so that concurrent requests don't interleave.
 //
 // listens for the following signals:
 //
-// SIGUSR1 -- reload KeyTable and resume
+// SIGUSR1 -- reload KeyTable on a background thread, requests carry on
+//            with the old KeyTable until the new one is swapped in
 //
 // SIGINT (^C), SIGTERM -- quit
 //
@@ -23,6 +51,8 @@
 //
 #include "options.h"
 #include "DocInfo.h"
+#include "KeyTableSegments.h"
+#include "KeyTableShards.h"
 #include "kgrams.h"
 #include "files.h"
 #include "pstats.h"
@@ -33,6 +63,15 @@
 #include <syslog.h>
 #include <time.h>
 #include <signal.h>
+#include <string.h>  // for strlen(), strncpy()
+#include <stdio.h>   // for sprintf()
+#include <pthread.h>
+#include <queue>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>     // for struct timeval
+#include <netinet/in.h>
+#include <netinet/tcp.h>  // for TCP_NODELAY
 
 // For gsoap 
 #include "soapH.h"
@@ -45,32 +84,67 @@
 // If SHOW_PROCESS_STATS!=0 then show process stats in log every SHOW_PROCESS_STATS requests
 #define SHOW_PROCESS_STATS 100
 
-// See fudge in overlap__overlap for return string docs, note that
-// this imposed a limit on the return size of about 10k documents
-#define DOCS_MAX_CHARS 100000
-char docs_buf[DOCS_MAX_CHARS+1];
+// Longest line for a DocPair in the return string docs, two docids and
+// a count of up to 10 digits each, two spaces and newline
+#define DOCPAIR_MAX_CHARS 33
+// Accepted connections waiting for a worker thread before accept blocks
+#define MAX_QUEUED_SOCKETS 1000
+// Largest request frame accepted with -q, larger closes the connection
+#define WIRE_MAX_REQUEST (64*1024*1024)
+// Seconds a -q connection may wait for a request before it is closed
+#define WIRE_IDLE_SECONDS 60
 
 // Name of this program show in logs
 const string myname="overlapd";
 
+// A loaded KeyTable and the number of requests using it. On reload a new
+// one replaces current_kt, the old one is deleted when the last request
+// using it releases it, see acquireKeyTable().
+struct KeyTableRef {
+  KeyTable* kt;
+  int users;
+  bool retired;  // no longer current_kt
+};
+
 // Globals defined in definitions.h and in options.h
-KeyTable *global_kt;
+KeyTableRef *current_kt=(KeyTableRef*)NULL; // NULL in coordinator mode
+pthread_mutex_t kt_lock=PTHREAD_MUTEX_INITIALIZER;
+sigset_t reload_signals; // SIGUSR1, waited for by reloadThread()
+KeyTableShards *global_shards=(KeyTableShards*)NULL; // set in coordinator mode
 ofstream logstream;
-
-void loadKeyTable(KeyTable& kt);
+pthread_mutex_t log_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// State of one worker thread, in soap->user of its soap context
+struct ServeState {
+  // Reused between requests to avoid reallocation, see KeyTable::lookupKeys()
+  vector<U32> query_indexes;
+  KeyTableLookup query_lookup;
+  // Log lines for the current request, see flushLog()
+  ostringstream log;
+};
+
+// Accepted sockets waiting for a worker thread, push() blocks when there
+// are MAX_QUEUED_SOCKETS so that at most that many wait
+struct SocketQueue {
+  queue<int> sockets;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+  SocketQueue(void);
+  void push(int s);
+  int pop(void);
+};
+SocketQueue soap_queue; // from soap_accept() for serveThread()
+SocketQueue wire_queue; // from wireListenThread() for wireServeThread()
+
+bool loadKeyTable(KeyTable& kt);
+bool findOverlap(ServeState& state, const char* nat, int limit, int minShared, DocPairVector& dpv);
+size_t writeDocPairs(DocPairVector& dpv, char* buf);
 
 
 //=====================================================================
 // Signal handlers
 
-void sigusr1_handler(int signo)
-{
-  logstream << myname << ": got SIGUSR1, reloading KeyTable..." << endl;
-  loadKeyTable(*global_kt);
-  logstream << myname << ": Reread KeyTable" << endl;
-}
-
-
 void sigint_handler(int signo)
 {
   logstream << myname << ": got SIGINT, bye, bye." << endl;
@@ -99,22 +173,373 @@ void strclean(char* str)
 }
 
 
-void loadKeyTable(KeyTable& kt) {
+// Write the lines collected in out to the log in one go and empty out
+//
+void flushLog(ostringstream& out)
+{
+  pthread_mutex_lock(&log_lock);
+  logstream << out.str();
+  logstream.flush();
+  pthread_mutex_unlock(&log_lock);
+  out.str("");
+}
+
+
+// Output of a thread that has set log_capture goes there, to be written
+// with flushLog(), see LogBuf
+__thread ostringstream* log_capture=(ostringstream*)NULL;
+
+// Buffer for cout and cerr once the log is open, so that library code
+// writing to them from any thread doesn't race with flushLog(). Writes
+// go to the thread's log_capture if set, else to the log under log_lock.
+//
+class LogBuf : public streambuf
+{
+protected:
+  streamsize xsputn(const char* s, streamsize n)
+  {
+    if (log_capture!=(ostringstream*)NULL) {
+      log_capture->write(s,n);
+      return(n);
+    }
+    pthread_mutex_lock(&log_lock);
+    logstream.write(s,n);
+    pthread_mutex_unlock(&log_lock);
+    return(n);
+  }
+  int overflow(int c)
+  {
+    if (c==EOF) return(0);
+    char ch=(char)c;
+    return(xsputn(&ch,1)==1 ? c : EOF);
+  }
+  int sync(void)
+  {
+    if (log_capture!=(ostringstream*)NULL) return(0);
+    pthread_mutex_lock(&log_lock);
+    logstream.flush();
+    pthread_mutex_unlock(&log_lock);
+    return(0);
+  }
+};
+LogBuf log_buf;
+
+
+//=====================================================================
+// Worker threads
+
+SocketQueue::SocketQueue(void)
+{
+  pthread_mutex_init(&lock,NULL);
+  pthread_cond_init(&notEmpty,NULL);
+  pthread_cond_init(&notFull,NULL);
+}
+
+
+void SocketQueue::push(int s)
+{
+  pthread_mutex_lock(&lock);
+  while (sockets.size()>=MAX_QUEUED_SOCKETS) {
+    pthread_cond_wait(&notFull,&lock);
+  }
+  sockets.push(s);
+  pthread_cond_signal(&notEmpty);
+  pthread_mutex_unlock(&lock);
+}
+
+
+int SocketQueue::pop(void)
+{
+  pthread_mutex_lock(&lock);
+  while (sockets.empty()) {
+    pthread_cond_wait(&notEmpty,&lock);
+  }
+  int s=sockets.front();
+  sockets.pop();
+  pthread_cond_signal(&notFull);
+  pthread_mutex_unlock(&lock);
+  return(s);
+}
+
+
+// Serve requests on sockets from the queue with soap context arg (a copy
+// of the main one) until given an invalid socket
+//
+void* serveThread(void* arg)
+{
+  struct soap* tsoap=(struct soap*)arg;
+  ServeState state;
+  tsoap->user=&state;
+  while (true) {
+    tsoap->socket=soap_queue.pop();
+    if (!soap_valid_socket(tsoap->socket)) break;
+    if (soap_serve(tsoap)!=SOAP_OK) {
+      // A bad request only fails that client
+      soap_print_fault(tsoap, stderr);
+    }
+    soap_destroy(tsoap);
+    soap_end(tsoap);
+  }
+  tsoap->user=NULL;
+  soap_done(tsoap);
+  free(tsoap);
+  return(NULL);
+}
+
+
+//=====================================================================
+// Lightweight protocol, see -q above
+
+// Read exactly n bytes from fd, false if closed first or on error
+//
+bool readFull(int fd, char* buf, size_t n)
+{
+  while (n>0) {
+    ssize_t r=recv(fd,buf,n,0);
+    if (r<=0) return(false);
+    buf+=r;
+    n-=(size_t)r;
+  }
+  return(true);
+}
+
+
+// Write all n bytes of buf to fd, no SIGPIPE if the other end has gone
+//
+bool writeFull(int fd, const char* buf, size_t n)
+{
+  while (n>0) {
+    ssize_t w=send(fd,buf,n,MSG_NOSIGNAL);
+    if (w<=0) return(false);
+    buf+=w;
+    n-=(size_t)w;
+  }
+  return(true);
+}
+
+
+// Answer the request in req (\0 terminated), the response text goes in
+// out after 4 bytes left for its length
+//
+void answerWire(ServeState& state, char* req, vector<char>& out)
+{
+  char* nl=strchr(req,'\n');
+  char* doc=(nl==NULL ? req+strlen(req) : nl+1);
+  if (nl!=NULL) *nl='\0';
+  char op[16];
+  int limit=0;
+  int minShared=0;
+  int nargs=sscanf(req,"%15s %d %d",op,&limit,&minShared);
+  string text;
+  if (nargs>=1 && strcmp(op,"status")==0) {
+    text="I_AM_HAPPY\n";
+    state.log << myname << ": Returning result for status call" << endl << endl;
+  } else if (nargs>=1 && strcmp(op,"overlap")==0) {
+    DocPairVector dpv;
+    if (!findOverlap(state,doc,limit,minShared,dpv)) {
+      text="ERROR overlap lookup failed, shard unavailable\n";
+      state.log << myname << ": Returning error" << endl << endl;
+      out.resize(4);
+      out.insert(out.end(),text.begin(),text.end());
+      return;
+    }
+    out.resize(4+32+dpv.size()*DOCPAIR_MAX_CHARS+1);
+    size_t len=sprintf(&out[4],"%u\n",(unsigned int)dpv.size());
+    len+=writeDocPairs(dpv,&out[4+len]);
+    out.resize(4+len);
+    state.log << myname << ": Returning result" << endl << endl;
+    return;
+  } else {
+    text="ERROR unknown request\n";
+    state.log << myname << ": Unknown request '" << req << "'" << endl << endl;
+  }
+  out.resize(4);
+  out.insert(out.end(),text.begin(),text.end());
+}
+
+
+// Serve requests on connection fd until the client closes it or is idle
+// for WIRE_IDLE_SECONDS, req and out are reused buffers
+//
+void serveWireConnection(int fd, ServeState& state, vector<char>& req, vector<char>& out)
+{
+  int on=1;
+  setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+  struct timeval idle;
+  idle.tv_sec=WIRE_IDLE_SECONDS;
+  idle.tv_usec=0;
+  setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&idle,sizeof(idle));
+  while (true) {
+    unsigned char len[4];
+    if (!readFull(fd,(char*)len,4)) break;
+    U32 n=((U32)len[0]<<24)|((U32)len[1]<<16)|((U32)len[2]<<8)|(U32)len[3];
+    if (n>WIRE_MAX_REQUEST) {
+      state.log << myname << ": Request of " << n << " bytes too large, closing connection" << endl;
+      break;
+    }
+    req.resize(n+1);
+    if (n>0 && !readFull(fd,&req[0],n)) break;
+    req[n]='\0';
+    answerWire(state,&req[0],out);
+    U32 m=out.size()-4;
+    out[0]=(char)(m>>24);
+    out[1]=(char)(m>>16);
+    out[2]=(char)(m>>8);
+    out[3]=(char)m;
+    bool ok=writeFull(fd,&out[0],out.size());
+    flushLog(state.log);
+    if (!ok) break;
+  }
+  flushLog(state.log);
+  close(fd);
+}
+
+
+// Serve connections from wire_queue one at a time, the buffers here and
+// the thread's own in the library are reused for all of them
+//
+void* wireServeThread(void* arg)
+{
+  ServeState state;
+  vector<char> req;
+  vector<char> out;
+  while (true) {
+    serveWireConnection(wire_queue.pop(),state,req,out);
+  }
+  return(NULL);
+}
+
+
+// Accept connections on listening socket arg for the wireServeThread()s
+//
+void* wireListenThread(void* arg)
+{
+  int lfd=(int)(long)arg;
+  while (true) {
+    int fd=accept(lfd,NULL,NULL);
+    if (fd<0) continue;
+    wire_queue.push(fd);
+  }
+  return(NULL);
+}
+
+
+//=====================================================================
+// KeyTable in use and reloading
+
+// The current KeyTable, to be released with releaseKeyTable() when the
+// request is done with it
+//
+KeyTableRef* acquireKeyTable(void)
+{
+  pthread_mutex_lock(&kt_lock);
+  KeyTableRef* ref=current_kt;
+  ref->users++;
+  pthread_mutex_unlock(&kt_lock);
+  return(ref);
+}
+
+
+void releaseKeyTable(KeyTableRef* ref)
+{
+  pthread_mutex_lock(&kt_lock);
+  ref->users--;
+  bool unused=(ref->retired && ref->users==0);
+  pthread_mutex_unlock(&kt_lock);
+  if (unused) {
+    delete ref->kt;
+    delete ref;
+  }
+}
+
+
+// Make kt the KeyTable for new requests, the old one is deleted now if
+// no request is using it, else by the last to release it
+//
+void swapKeyTable(KeyTable* kt)
+{
+  KeyTableRef* ref=new KeyTableRef;
+  ref->kt=kt;
+  ref->users=0;
+  ref->retired=false;
+  pthread_mutex_lock(&kt_lock);
+  KeyTableRef* old=current_kt;
+  current_kt=ref;
+  bool unused=false;
+  if (old!=(KeyTableRef*)NULL) {
+    old->retired=true;
+    unused=(old->users==0);
+  }
+  pthread_mutex_unlock(&kt_lock);
+  if (unused) {
+    delete old->kt;
+    delete old;
+  }
+}
+
+
+// Wait for SIGUSR1 (blocked in all threads) and reload the KeyTable each
+// time, building the new one here while requests use the old one
+//
+void* reloadThread(void* arg)
+{
+  ostringstream rlog;
+  while (true) {
+    int sig;
+    if (sigwait(&reload_signals,&sig)!=0) continue;
+    if (current_kt==(KeyTableRef*)NULL) {
+      rlog << myname << ": got SIGUSR1, no KeyTable to reload in coordinator mode" << endl;
+      flushLog(rlog);
+      continue;
+    }
+    rlog << myname << ": got SIGUSR1, reloading KeyTable..." << endl;
+    flushLog(rlog);
+    // Output from reading goes in rlog, written when done
+    log_capture=&rlog;
+    KeyTable* kt=new KeyTable(bitsInKeyTable);
+    bool ok=loadKeyTable(*kt);
+    log_capture=(ostringstream*)NULL;
+    if (ok) {
+      swapKeyTable(kt);
+      rlog << myname << ": Reread KeyTable, now used for new requests" << endl;
+    } else {
+      delete kt;
+      rlog << myname << ": Failed to reread KeyTable, keeping the old one" << endl;
+    }
+    flushLog(rlog);
+  }
+  return(NULL);
+}
+
+
+// Read the KeyTable given by -t, -T or -g into kt, false if it can't be
+// opened (a daemon serving an old one keeps that)
+//
+bool loadKeyTable(KeyTable& kt) {
   if (keyTableFile!="") {
     ifstream ktin;
     ktin.open(keyTableFile.c_str(),ios_base::in);
     if (!ktin.good()) {
-      cerr << myname << ": Error - failed to open '" << keyTableFile << "' for input, aborting." << endl;
-      exit(2);
+      cerr << myname << ": Error - failed to open '" << keyTableFile << "' for input" << endl;
+      return(false);
     }
     ktin >> kt;
     ktin.close();
   } else if (keyTableBase!="") {
     kt.readMultiFile(keyTableBase);
+  } else if (segmentDir!="") {
+    // All segments listed in the manifest, read in order into kt
+    KeyTableSegments segs(bitsInKeyTable,segmentDir);
+    segs.readManifest();
+    segs.readInto(kt);
   } else {
-    cerr << myname << ": Error - must specify either -t or -T for KeyTable" << endl;
-    exit(2);
+    cerr << myname << ": Error - must specify one of -t, -T or -g for KeyTable" << endl;
+    return(false);
+  }
+  if (freezeKeyTable) {
+    kt.freeze();
   }
+  return(true);
 }
 
  
@@ -125,7 +550,7 @@ int main(int argc, char* argv[])
 
   // Read any options
   //
-  readOptions(argc, argv, (const char*)"hH?St:T:b:vV", myname, "Run overlap server");
+  readOptions(argc, argv, (const char*)"hH?Sg:t:T:b:vVzx:p:i:j:q:", myname, "Run overlap server, answering requests on -j threads");
 
   // Open a log file to append to
   //
@@ -143,24 +568,68 @@ int main(int argc, char* argv[])
   logstream << myname << ": pid " << getpid() << ", started at " << ctime(&rawtime) << endl;
 
   // Redirect cout and cerr to the log  
-  cout.rdbuf(logstream.rdbuf());
-  cerr.rdbuf(logstream.rdbuf());
+  cout.rdbuf(&log_buf);
+  cerr.rdbuf(&log_buf);
   
-  // Read data
+  // Read data, or in coordinator mode just the list of shards
   //
-  KeyTable kt(bitsInKeyTable);
-  loadKeyTable(kt);
-  global_kt=&kt;
-  logstream << myname << ": Read KeyTable" << endl;
+  if (shardsFile!="") {
+    global_shards=new KeyTableShards(bitsInKeyTable,selectBits);
+    global_shards->readShardsFile(shardsFile);
+  } else {
+    KeyTable* ktp=new KeyTable(bitsInKeyTable);
+    if (!loadKeyTable(*ktp)) {
+      cerr << myname << ": No KeyTable to serve, aborting." << endl;
+      exit(2);
+    }
+    swapKeyTable(ktp);
+    logstream << myname << ": Read KeyTable" << endl;
+  }
 
   //  // Become a daemon
   
-  if (signal(SIGUSR1, sigusr1_handler)==SIG_ERR ||
-      signal(SIGINT,  sigint_handler)==SIG_ERR ||
+  if (signal(SIGINT,  sigint_handler)==SIG_ERR ||
       signal(SIGTERM, sigterm_handler)==SIG_ERR ) {
-    logstream << myname << "Failed to set USR1 and TERM handlers" << endl; 
+    logstream << myname << "Failed to set INT and TERM handlers" << endl; 
+    exit(1);
+  }
+
+  // SIGUSR1 is blocked here, and so in all threads started later, and
+  // taken with sigwait() by the reload thread instead of by a handler
+  sigemptyset(&reload_signals);
+  sigaddset(&reload_signals,SIGUSR1);
+  pthread_t reloader;
+  if (pthread_sigmask(SIG_BLOCK,&reload_signals,NULL)!=0 ||
+      pthread_create(&reloader,NULL,reloadThread,NULL)!=0) {
+    logstream << myname << ": Failed to start reload thread for USR1" << endl;
     exit(1);
   }
+  // Other threads write the log from here on
+  ostringstream mainlog;
+
+  // Shard mode, answer lookups from a coordinator instead of SOAP
+  if (shardPort>0) {
+    if (current_kt==(KeyTableRef*)NULL) {
+      mainlog << myname << ": Can't have both -p and -i" << endl;
+      flushLog(mainlog);
+      exit(1);
+    }
+    int fd=shardListen(shardPort);
+    ostringstream shardlog;
+    shardlog << myname << ": Serving KeyTable shard on port " << shardListenPort(fd) << endl;
+    flushLog(shardlog);
+    for (int count=1; ; count++) {
+      KeyTableRef* ref=acquireKeyTable();
+      if (!shardServe(fd,*ref->kt)) {
+        shardlog << myname << ": Failed to answer shard request " << count << endl;
+      }
+      releaseKeyTable(ref);
+      if (SHOW_PROCESS_STATS>0 && (count%SHOW_PROCESS_STATS == 0)) {
+        shardlog << myname << ": [" << count << "] " << get_pstats_string() << endl;
+      }
+      flushLog(shardlog);
+    }
+  }
 
   struct soap soap;
   soap_init(&soap);
@@ -172,27 +641,56 @@ int main(int argc, char* argv[])
       soap_print_fault(&soap, stderr);
       exit(-1);
     }
-    logstream << myname << ": Socket connection successful: master socket = " << m << endl;
+    mainlog << myname << ": Socket connection successful: master socket = " << m << endl;
+
+    // Start workers, each with its own soap context
+    vector<pthread_t> workers(numThreads);
+    for (int t=0; t<numThreads; t++) {
+      struct soap* tsoap=soap_copy(&soap);
+      if (tsoap==NULL || pthread_create(&workers[t],NULL,serveThread,tsoap)!=0) {
+        mainlog << myname << ": Failed to start worker thread " << t << endl;
+        flushLog(mainlog);
+        exit(1);
+      }
+    }
+    mainlog << myname << ": Started " << numThreads << " worker threads" << endl;
+
+    // Lightweight protocol alongside SOAP, with its own workers
+    if (wirePort>0) {
+      int lfd=shardListen(wirePort);
+      vector<pthread_t> wireWorkers(numThreads);
+      pthread_t listener;
+      for (int t=0; t<numThreads; t++) {
+        if (pthread_create(&wireWorkers[t],NULL,wireServeThread,NULL)!=0) {
+          mainlog << myname << ": Failed to start lightweight protocol worker thread " << t << endl;
+          flushLog(mainlog);
+          exit(1);
+        }
+      }
+      if (pthread_create(&listener,NULL,wireListenThread,(void*)(long)lfd)!=0) {
+        mainlog << myname << ": Failed to start listener for port " << wirePort << endl;
+        flushLog(mainlog);
+        exit(1);
+      }
+      mainlog << myname << ": Answering lightweight protocol on port " << shardListenPort(lfd) << endl;
+    }
+    flushLog(mainlog);
 
-    // Main loop to wait for and answer SOAP requests
+    // Main loop to wait for SOAP requests and hand them to the workers
     for (int count=1; ; count++ ) { 
       s = soap_accept(&soap);
       if (s < 0) {
         soap_print_fault(&soap, stderr);
         exit(-2);
       } 
-      logstream << myname << ": Socket connection successful: slave socket = " << s 
-                << ", count = " << count << endl;
-      if (soap_serve(&soap) != SOAP_OK) { 
-        soap_print_fault(&soap, stderr);
-        exit(-3);
-      }
-      soap_destroy(&soap);
-      soap_end(&soap);
+      mainlog << myname << ": Socket connection successful: slave socket = " << s 
+              << ", count = " << count << endl;
+      soap_queue.push(soap.socket);
       // Show some monitoring stats every SHOW_PROCESS_STATS requests
       if (SHOW_PROCESS_STATS>0 && (count%SHOW_PROCESS_STATS == 0)) {
-        logstream << myname << ": [" << count << "] " << get_pstats_string() << endl;
+        mainlog << myname << ": [" << count << "] " << get_pstats_string() << endl;
       }
+      flushLog(mainlog);
     }
   }
   soap_done(&soap);
@@ -200,23 +698,29 @@ int main(int argc, char* argv[])
 } 
 
 
-int overlap__overlap(struct soap *soap, char *nat, struct overlap__overlapResponse &response)
-{ 
+// Find documents overlapping the document text nat, best first, at most
+// limit (if >0) and sharing more than minShared keys (keysForMatch if
+// minShared is 0). Log lines go in state.log. Returns false if the lookup
+// failed, which can only happen when a shard coordinator loses a shard.
+//
+bool findOverlap(ServeState& state, const char* nat, int limit, int minShared, DocPairVector& dpv)
+{
+  ostringstream& log=state.log;
   int bytes;
   bytes=strlen(nat);
 
-  logstream << myname << ": read() read " << bytes << " bytes in input doc" << endl;
+  log << myname << ": read() read " << bytes << " bytes in input doc" << endl;
   if (VERBOSE) {
     #define SZ 40
     char buf2[SZ+1];
     strncpy(buf2,nat,SZ);
     buf2[SZ]='\0';
     strclean(buf2);
-    logstream << myname << ": VERBOSE: data starts '" << buf2 << "'" << endl;
+    log << myname << ": VERBOSE: data starts '" << buf2 << "'" << endl;
     strncpy(buf2,&nat[bytes-SZ],SZ);
     buf2[SZ]='\0';
     strclean(buf2);
-    logstream << myname << ": VERBOSE: data ends   '" << buf2 << "'" << endl;
+    log << myname << ": VERBOSE: data ends   '" << buf2 << "'" << endl;
   }
       
   // "read" document from buffer
@@ -225,17 +729,65 @@ int overlap__overlap(struct soap *soap, char *nat, struct overlap__overlapRespon
 
   KeyMap km;
   doc.addToKeymap(is,km);
-  logstream << myname << ": Extracted " << km.size() << " keys from input doc" << endl;
+  log << myname << ": Extracted " << km.size() << " keys from input doc" << endl;
+
+  int n=(minShared>0 ? minShared : keysForMatch);
+  if (global_shards!=(KeyTableShards*)NULL) {
+    // coordinator, shards each count overlap for their slice of the keys
+    if (!global_shards->getCommonDocs(km, dpv, n)) {
+      log << myname << ": Failed to get counts from all shards" << endl;
+      return(false);
+    }
+  } else {
+    // now find overlap of keys in km with corpus in KeyTable kt, batched
+    // lookup of sorted short keys with all postings in query_lookup
+    // in the KeyTable current now, even if a reload swaps in another
+    KeyTableRef* ref=acquireKeyTable();
+    ref->kt->keysToIndexes(km,state.query_indexes);
+    state.query_lookup.clear();
+    if (state.query_indexes.size()>0) {
+      ref->kt->lookupKeys(&state.query_indexes[0],state.query_indexes.size(),state.query_lookup);
+    }
+    releaseKeyTable(ref);
+    log << myname << ": Got " << state.query_lookup.size() << " overlapping keys" << endl;
+
+    // now find overlapping docs
+    state.query_lookup.getCommonDocs(dpv, n);      
+  }
+  log << myname << ": Found " << dpv.size() << " docs overlapping by >= " << n << " keys" << endl;
 
-  // now find overlap of keys in km with corpus in KeyTable kt
-  KeyMap sharedkeys;
-  global_kt->getOverlapKeys(km,sharedkeys);
-  logstream << myname << ": Got " << sharedkeys.size() << " overlapping keys" << endl;
+  // dpv is best first so a limit keeps the best
+  if (limit>0 && dpv.size()>(size_t)limit) {
+    dpv.erase(dpv.begin()+limit,dpv.end());
+    log << myname << ": Returning best " << limit << " docs" << endl;
+  }
+  return(true);
+}
 
-  // now find overlapping docs
+
+// Write dpv as operator<< for DocPairVector does into buf, which must
+// have room for dpv.size()*DOCPAIR_MAX_CHARS+1 chars. Returns the length.
+//
+size_t writeDocPairs(DocPairVector& dpv, char* buf)
+{
+  char* p=buf;
+  *p='\0';
+  for (size_t j=0; j<dpv.size(); j++) {
+    p+=sprintf(p,"%u %u %d\n",(unsigned int)dpv[j].id1,(unsigned int)dpv[j].id2,dpv[j].sharedKeys);
+  }
+  return(p-buf);
+}
+
+
+int overlap__overlap(struct soap *soap, char *nat, int limit, int minShared, struct overlap__overlapResponse &response)
+{ 
+  ServeState* state=(ServeState*)soap->user;
   DocPairVector dpv;
-  sharedkeys.getCommonDocs(dpv, keysForMatch);      
-  logstream << myname << ": Found " << dpv.size() << " docs overlapping by >= " << keysForMatch << " keys" << endl;
+  if (!findOverlap(*state,nat,limit,minShared,dpv)) {
+    state->log << myname << ": Returning fault" << endl << endl;
+    flushLog(state->log);
+    return(soap_receiver_fault(soap,"Overlap lookup failed, shard unavailable",NULL));
+  }
 
   // set number of matches in response <matches>
   response.matches = dpv.size();
@@ -244,22 +796,16 @@ int overlap__overlap(struct soap *soap, char *nat, struct overlap__overlapRespon
   if (dpv.size() == 0) {
     response.docs = (char*)"";
   } else {
-    ostringstream osd (ostringstream::out);
-    osd << dpv;
-    // Copy the response string to a to real and persistent char* data structure. 
-    //
-    // If we simply do response.docs=(char *)osd.str().c_str()
-    // then the response is truncated. See comments at
-    // http://stackoverflow.com/questions/1374468/c-stringstream-string-and-char-conversion-confusion
-    // which point out that c_str() returns a pointer to a string that is 
-    // deleted when the statement ends so we must copy it to something that
-    // persists beyond exit of this method.
-    //
-    strncpy(docs_buf,osd.str().c_str(),DOCS_MAX_CHARS);
-    response.docs = docs_buf;
-  }
-
-  logstream << myname << ": Returning result, SOAP_OK" << endl << endl;
+    // Write the lines straight into memory from soap_malloc(), which
+    // lasts until soap_end() after the response is sent, so there is no
+    // limit on size and no copy
+    response.docs = (char*)soap_malloc(soap,dpv.size()*DOCPAIR_MAX_CHARS+1);
+    if (response.docs==NULL) return(soap->error);
+    writeDocPairs(dpv,response.docs);
+  }
+
+  state->log << myname << ": Returning result, SOAP_OK" << endl << endl;
+  flushLog(state->log);
   return SOAP_OK;
 } 
 
@@ -269,6 +815,8 @@ int overlap__overlap(struct soap *soap, char *nat, struct overlap__overlapRespon
 int overlap__status(struct soap *soap, char *&status)
 { 
   status = (char*)"I_AM_HAPPY";
-  logstream << myname << ": Returning result, SOAP_OK for status call" << endl << endl;
+  ostringstream& log=((ServeState*)soap->user)->log;
+  log << myname << ": Returning result, SOAP_OK for status call" << endl << endl;
+  flushLog(log);
   return SOAP_OK;
 } 
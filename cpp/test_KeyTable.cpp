@@ -5,7 +5,27 @@
 #include "definitions.h"
 #include "kgrams.h"
 #include "KeyTable.h"
+#include "KeyTableSegments.h"
+#include "KeyTableShards.h"
 #include "lib/options.h"
+#include <sstream>    // for stringstream
+#include <sys/stat.h> // for mkdir()
+#include <unistd.h>   // for close()
+#include <pthread.h>
+
+// Shard server answering a single request, for the shards test
+struct ShardServer {
+  KeyTable* kt;
+  int fd;
+  ShardServer(KeyTable& k) : kt(&k), fd(shardListen(0)) {}
+};
+
+void* shardServeThread(void* arg)
+{
+  ShardServer* s=(ShardServer*)arg;
+  shardServe(s->fd,*s->kt);
+  return(NULL);
+}
 
 int main(int argc, char* argv[]) 
 {
@@ -111,16 +131,16 @@ int main(int argc, char* argv[])
   if (!ktin2) {
     cerr << "test_KeyTable: failed to open " << outFile1 << endl;
   } 
-  dummyKT.readTables123(ktin2, (intv*)NULL, &km);
+  dummyKT.readTables123(ktin2, (indexhashset*)NULL, &km);
   ktin2.close();
   cout << "Got KeyMap from " << outFile1 << endl << km;
 
   km.clear();
-  intv indexes;
-  indexes.push_back(5);
-  indexes.push_back(6);
-  indexes.push_back(7);
-  indexes.push_back(8);
+  indexhashset indexes;
+  indexes.insert(5);
+  indexes.insert(6);
+  indexes.insert(7);
+  indexes.insert(8);
   cout << "Reading KeyTable as KeyMap single file from " << outFile1 << " with filter (5,6,7,8)" << endl;
   ifstream ktin3;
   ktin3.open(outFile1.c_str(),ios_base::in);
@@ -131,5 +151,321 @@ int main(int argc, char* argv[])
   ktin3.close();
   cout << "Got KeyMap from " << outFile1 << " with filter (5,6,7,8)" << endl << km;
 
+  //
+  // =============== Batched lookup ==================
+  //
+  // Keys 1 (table3), 5 (table2), 8 (table1), 12 (empty), 1 repeated
+  U32 lkeys[]={1,1,5,8,12};
+  KeyTableLookup lookup;
+  kt.lookupKeys(lkeys,5,lookup);
+  cout << "Batched lookup of keys (1,1,5,8,12) found " << lookup.size() << " keys:" << endl;
+  for (size_t k=0; k<lookup.size(); k++) {
+    cout << "  " << lookup.keys[k] << ":";
+    for (size_t j=0; j<lookup.numDocids(k); j++) {
+      cout << " " << lookup.docidsFor(k)[j];
+    }
+    cout << endl;
+  }
+  DocPairVector ldpv;
+  lookup.getCommonDocs(ldpv,0);
+  cout << "Docs in more than 0 of these keys:" << endl << ldpv;
+
+  //
+  // =============== Frozen table1 ==================
+  //
+  // Lookups and output should be unchanged
+  kt.freeze();
+  kt.writeStats(cout,true);
+  KeyTableLookup flookup;
+  kt.lookupKeys(lkeys,5,flookup);
+  cout << "Frozen batched lookup of keys (1,1,5,8,12) found " << flookup.size() << " keys, "
+       << (flookup.docids==lookup.docids ? "same" : "NOT same") << " docids as before" << endl;
+  cout << "Frozen table is:" << endl << kt;
+  kt.thaw();
+
+  //
+  // =============== All pairs overlap ==================
+  //
+  intv oids;
+  kt.getOverlapIds(oids,0,3);
+  cout << "Docids in more than 0 shared keys, 3 threads:";
+  for (size_t j=0; j<oids.size(); j++) cout << " " << oids[j];
+  cout << endl;
+  kt.writeStats(cout,true,3);
+  //
+  intv noFilter;
+  DocPairVector pdpv;
+  kt.getOverlapDocs(pdpv,noFilter,1,2);
+  cout << "Found " << pdpv.size() << " pairs sharing >= 1 key (expect 5151 from key 1 + 4 from keys 2..5):" << endl << pdpv;
+
+  //
+  // =============== Narrow docid KeyTables ==================
+  //
+  // Should read back to give the same table as written above
+  KeyTableT<U32,U16> k16(20);
+  cout << "Reading KeyTable with U16 docids from " << outFile1 << endl;
+  ifstream ktin4;
+  ktin4.open(outFile1.c_str(),ios_base::in);
+  ktin4 >> k16;
+  ktin4.close();
+  k16.writeStats(cout);
+  cout << "Read KeyTable with U16 docids from " << outFile1 << endl << k16;
+  //
+  KeyTableT<U32,U24> k24(20);
+  for (U32 j=1; j<=5; j++) {
+    k24.addKey((U32)1,j*1000000);
+  }
+  cout << "Added 5 docids up to 5000000 to key 1 of KeyTable with U24 docids:" << endl << k24;
+
+  //
+  // =============== Saturated keys ==================
+  //
+  // Key 7 goes past 4 docids and is saturated, key 8 stays as a list
+  KeyTable ks(20);
+  ks.setSaturateAbove(4);
+  for (U32 j=1; j<=9; j++) {
+    ks.addKey((U32)7,j);
+    ks.addKey((U32)7,j); // repeat is ignored
+    if (j<=4) ks.addKey((U32)8,j);
+  }
+  ks.writeStats(cout,true);
+  cout << "Key 7 " << (ks.isSaturated(7) ? "is" : "is NOT") << " saturated, key 8 "
+       << (ks.isSaturated(8) ? "is" : "is not") << " saturated" << endl;
+  cout << "KeyTable with saturated key 7 (expect 000007 *9):" << endl << ks;
+  intv sids;
+  ks.getDocids(sids,7);
+  cout << "getDocids for key 7 gives " << sids.size() << " docids" << endl;
+  DocPairVector sdpv;
+  ks.getOverlapDocs(sdpv,noFilter,1);
+  cout << "Found " << sdpv.size() << " pairs sharing >= 1 key (expect 6 from key 8 only)" << endl;
+  // ...and should read back with the count
+  string outFile4="/tmp/test_KeyTable_saturated.out";
+  ofstream ktout4;
+  ktout4.open(outFile4.c_str(),ios_base::out);
+  ktout4 << ks;
+  ktout4.close();
+  KeyTable ks2(20);
+  ifstream ktin5;
+  ktin5.open(outFile4.c_str(),ios_base::in);
+  ktin5 >> ks2;
+  ktin5.close();
+  ks2.writeStats(cout,true);
+  cout << "Read KeyTable with saturated key from " << outFile4 << endl << ks2;
+
+  //
+  // =============== Deleted documents ==================
+  //
+  // Key 1 has docids 1..5 (table3), key 2 has 2,3 (table2), key 3 has 3
+  // (table1) and key 4 has 1,3,4 (table3)
+  KeyTable kd(20);
+  for (U32 j=1; j<=5; j++) kd.addKey((U32)1,j);
+  kd.addKey((U32)2,2);
+  kd.addKey((U32)2,3);
+  kd.addKey((U32)3,3);
+  kd.addKey((U32)4,1);
+  kd.addKey((U32)4,3);
+  kd.addKey((U32)4,4);
+  kd.deleteDoc(3);
+  kd.deleteDoc(4);
+  U32 dkeys[4]={1,2,3,4};
+  KeyTableLookup dlookup;
+  kd.lookupKeys(dkeys,4,dlookup);
+  cout << "Lookup after deleting docids 3 and 4 (expect 1: 1 2 5, 2: 2, 4: 1):" << endl;
+  for (size_t k=0; k<dlookup.size(); k++) {
+    cout << "  " << dlookup.keys[k] << ":";
+    for (size_t j=0; j<dlookup.numDocids(k); j++) {
+      cout << " " << dlookup.docidsFor(k)[j];
+    }
+    cout << endl;
+  }
+  intv dids;
+  kd.getOverlapIds(dids,0);
+  cout << "Docids in more than 0 shared keys (expect 1 2 5):";
+  for (size_t j=0; j<dids.size(); j++) cout << " " << dids[j];
+  cout << endl;
+  DocPairVector ddpv;
+  kd.getOverlapDocs(ddpv,noFilter,1);
+  cout << "Pairs sharing >= 1 key (expect 3 from key 1):" << endl << ddpv;
+  // Deleted docids aren't written, without compacting and also when frozen
+  stringstream dwrite1, dwrite2, dwrite3, dwrite23;
+  kd.writeTables123(dwrite1);
+  kd.writeTables23(dwrite23);
+  kd.freeze();
+  kd.writeTables123(dwrite2);
+  kd.thaw();
+  cout << "Written with " << kd.numUncompacted << " deletions not compacted (expect 2, 1 2 5 / 2 / - / 1):" << endl << dwrite1.str();
+  cout << "Tables 2 and 3 written (expect just 1 2 5):" << endl << dwrite23.str();
+  kd.compact();
+  kd.writeStats(cout,true);
+  cout << "Compacted KeyTable (expect 1 2 5 / 2 / - / 1):" << endl << kd;
+  kd.writeTables123(dwrite3);
+  cout << "Written before compacting, frozen or not, is " << (dwrite1.str()==dwrite3.str() && dwrite2.str()==dwrite3.str() ? "same" : "NOT same") << " as after" << endl;
+  // Emptied table3 entry and table2 entries are reused
+  kd.deleteDoc(1);
+  kd.deleteDoc(2);
+  kd.compact();
+  kd.addKey((U32)5,6);
+  kd.addKey((U32)5,7);
+  kd.addKey((U32)5,8);
+  kd.writeStats(cout,true);
+  cout << "After deleting docids 1 and 2 and adding key 5 (expect 5 / 6 7 8):" << endl << kd;
+
+  //
+  // =============== KeyTable segments ==================
+  //
+  // Four segments each with two documents, key 9 is in every document and
+  // key 10 only in the first of each segment. The delta adds document 9.
+  string segDir="/tmp/test_KeyTable_segments";
+  mkdir(segDir.c_str(),0755);
+  remove((segDir+"/"+SEGMENT_MANIFEST).c_str());
+  KeyTableSegments segs(20,segDir);
+  segs.readManifest();
+  for (U32 seg=0; seg<4; seg++) {
+    for (U32 j=1; j<=2; j++) {
+      segs.deltaTable().addKey((U32)9,seg*2+j);
+      if (j==1) segs.deltaTable().addKey((U32)10,seg*2+j);
+    }
+    segs.flushDelta();
+  }
+  segs.deltaTable().addKey((U32)9,9);
+  segs.load();
+  U32 skeys[3]={9,10,11};
+  KeyTableLookup slookup;
+  segs.lookupKeys(skeys,3,slookup);
+  cout << "Lookup over " << segs.segments.size() << " segments and delta (expect 9: 1..9, 10: 1 3 5 7):" << endl;
+  for (size_t k=0; k<slookup.size(); k++) {
+    cout << "  " << slookup.keys[k] << ":";
+    for (size_t j=0; j<slookup.numDocids(k); j++) {
+      cout << " " << slookup.docidsFor(k)[j];
+    }
+    cout << endl;
+  }
+  segs.startCompaction();
+  segs.waitCompaction();
+  segs.load();
+  KeyTableLookup clookup;
+  segs.lookupKeys(skeys,3,clookup);
+  cout << "After compaction " << segs.segments.size() << " segment, lookup gives "
+       << (clookup.keys==slookup.keys && clookup.docids==slookup.docids ? "same" : "NOT same") << " result" << endl;
+  KeyTable kseg(20);
+  segs.readInto(kseg);
+  cout << "Merged segment is:" << endl << kseg;
+  // Segments merged into an ordinary KeyTable, as for a build in runs
+  string mergedBase=segDir+"/merged";
+  segs.setSaturateAbove(4);
+  segs.writeMerged(mergedBase);
+  KeyTable kmerged(20);
+  kmerged.readMultiFile(mergedBase);
+  cout << "Merged with saturateAbove=4 (expect 9: *8, 10: 1 3 5 7):" << endl << kmerged;
+  // Background compaction saturates lists as the deltas do
+  string satDir=segDir+"/saturated";
+  mkdir(satDir.c_str(),0755);
+  remove((satDir+"/"+SEGMENT_MANIFEST).c_str());
+  KeyTableSegments ssegs(20,satDir);
+  ssegs.setSaturateAbove(4);
+  ssegs.readManifest();
+  for (U32 seg=0; seg<4; seg++) {
+    ssegs.deltaTable().addKey((U32)9,seg*2+1);
+    ssegs.deltaTable().addKey((U32)9,seg*2+2);
+    ssegs.flushDelta();
+  }
+  ssegs.startCompaction();
+  ssegs.waitCompaction();
+  KeyTable ksat(20);
+  ssegs.readInto(ksat);
+  cout << "Compacted " << ssegs.segments.size() << " segment with saturateAbove=4 (expect 9: *8):" << endl << ksat;
+
+  //
+  // =============== Bitmap posting lists ==================
+  //
+  // Key 1 in docids 1..3000 becomes a bitmap list, deleting docids 1..2000
+  // takes it back below KT3_BITMAP_MIN to an array
+  KeyTable kbm(20);
+  for (U32 d=1; d<=3000; d++) {
+    kbm.addKey((U32)1,d);
+    if (d%1000==0) kbm.addKey((U32)2,d);
+  }
+  intv bmdocids;
+  kbm.getDocids(bmdocids,1);
+  cout << "Key 1 has " << bmdocids.size() << " docids " << bmdocids[0] << ".." << bmdocids[bmdocids.size()-1]
+       << " (expect 3000 1..3000), bitmap=" << kbm.table3[0].isBitmap() << endl;
+  kbm.writeStats(cout,true);
+  intv bmoverlap;
+  kbm.getOverlapIds(bmoverlap,1,2);
+  cout << "Docids with >1 shared keys, counted from the bitmap:";
+  for (size_t j=0; j<bmoverlap.size(); j++) cout << " " << bmoverlap[j];
+  cout << " (expect 1000 2000 3000)" << endl;
+  for (U32 d=1; d<=2000; d++) kbm.deleteDoc(d);
+  kbm.compact();
+  bmdocids.clear();
+  kbm.getDocids(bmdocids,1);
+  cout << "After deleting 1..2000 key 1 has " << bmdocids.size() << " docids " << bmdocids[0] << ".." << bmdocids[bmdocids.size()-1]
+       << " (expect 1000 2001..3000), bitmap=" << kbm.table3[0].isBitmap() << endl;
+
+  //
+  // =============== Docids with 8 or more digits ==================
+  //
+  KeyTable kbig(20);
+  kbig.addKey((U32)3,12345678);
+  kbig.addKey((U32)4,(U32)kbig.MAX_DOCID);
+  kbig.addKey((U32)4,99);
+  stringstream bigio;
+  kbig.writeTables123(bigio);
+  KeyTable kbig2(20);
+  kbig2.readTables123(bigio);
+  intv bigdocids;
+  kbig2.getDocids(bigdocids,3);
+  kbig2.getDocids(bigdocids,4);
+  cout << "Read back large docids:";
+  for (size_t j=0; j<bigdocids.size(); j++) cout << " " << bigdocids[j];
+  cout << " (expect 12345678 " << kbig.MAX_DOCID << " 99)" << endl;
+
+  //
+  // =============== KeyTable shards ==================
+  //
+  // Keys 1..6 with select bit 20 set for even keys, so two shards each with
+  // half the keys. Docid d has keys 1..d. Shards are served on threads.
+  KeyTable kfull(20);
+  KeyTable kshard0(20,false,21,0);
+  KeyTable kshard1(20,false,21,1);
+  keymap qkm;
+  for (U32 j=1; j<=6; j++) {
+    kgramkey key=(kgramkey)j|((kgramkey)(j%2==0 ? 1 : 0)<<20);
+    for (U32 d=j; d<=6; d++) {
+      kfull.addKey(key,d);
+      kshard0.addKey(key,d);
+      kshard1.addKey(key,d);
+    }
+    qkm[key]=(KgramInfo*)NULL;
+  }
+  KeyTableShards shards(20,21);
+  ShardServer servers[2]={ShardServer(kshard0),ShardServer(kshard1)};
+  pthread_t stids[2];
+  for (int s=0; s<2; s++) {
+    shards.setShard(s,"localhost",shardListenPort(servers[s].fd));
+    pthread_create(&stids[s],NULL,shardServeThread,&servers[s]);
+  }
+  DocPairVector shdpv;
+  shards.getCommonDocs(qkm,shdpv,2);
+  for (int s=0; s<2; s++) pthread_join(stids[s],NULL);
+  vector<U32> qindexes;
+  kfull.keysToIndexes(qkm,qindexes);
+  KeyTableLookup qlookup;
+  kfull.lookupKeys(&qindexes[0],qindexes.size(),qlookup);
+  DocPairVector fdpv;
+  qlookup.getCommonDocs(fdpv,2);
+  cout << "Docs sharing >2 keys over 2 shards (expect docids 3..6 with 3..6 keys):" << endl << shdpv;
+  bool sameShard=(shdpv.size()==fdpv.size());
+  for (size_t j=0; sameShard && j<shdpv.size(); j++) {
+    sameShard=(shdpv[j].id1==fdpv[j].id1 && shdpv[j].sharedKeys==fdpv[j].sharedKeys);
+  }
+  cout << "Sharded lookup gives " << (sameShard ? "same" : "NOT same") << " result as single KeyTable" << endl;
+  for (int s=0; s<2; s++) close(servers[s].fd);
+  // With the shards gone the query fails instead of exiting
+  DocPairVector downdpv;
+  bool downOk=shards.getCommonDocs(qkm,downdpv,2);
+  cout << "Sharded lookup with shards down " << (downOk ? "succeeded" : "failed")
+       << " with " << downdpv.size() << " docs (expect failed with 0)" << endl;
+
   cout << "Done." << endl;
 }
@@ -47,6 +47,36 @@ int main(int argc, char* argv[])
   in >> kin;
   cout << "Read '" << buf << "'" << endl;
   cout << "Got  '" << kin << "'" << endl;
+
+  ////////////////////////////////////////////////////////////////
+  // KgramInfo in an arena, with more ids than the old 60000 limit
+  cout << endl << "Now to test arena..." << endl;
+  KgramArena arena;
+  KgramInfo* ka=new(arena) KgramInfo(1);
+  cout << "Created ka in arena: " << *ka << endl;
+  for (docid id=2; id<=100000; id++) ka->addOccurrence(id,-1,&arena);
+  cout << "Added docs 2..100000: numIds=" << ka->numIds << " size=" << ka->size()
+       << " ids[99999]=" << ka->idArray()[99999] << endl;
+  KgramInfo* kc=new(arena) KgramInfo(ka,&arena);
+  cout << "Copied to kc: numIds=" << kc->numIds << " ids[0]=" << kc->idArray()[0]
+       << " ids[99999]=" << kc->idArray()[99999] << endl;
+  KgramInfo* ks=new(arena) KgramInfo(7);
+  for (docid id=8; id<=12; id++) ks->addOccurrence(id,3,&arena);
+  cout << "Saturated ks with maxDupes 3: " << *ks << " saturated=" << ks->saturated() << endl;
+  cout << "Arena size " << arena.sizeInBytes() << " bytes" << endl;
+
+  ////////////////////////////////////////////////////////////////
+  // Merging KgramInfo for later documents
+  cout << endl << "Now to test merge..." << endl;
+  KgramInfo* km1=new(arena) KgramInfo(1);
+  km1->addOccurrence(1,-1,&arena);
+  km1->addOccurrence(2,-1,&arena);
+  KgramInfo* km2=new(arena) KgramInfo(5);
+  km2->addOccurrence(6,-1,&arena);
+  km1->merge(km2,-1,&arena);
+  cout << "Merged [2,2] 5 6 into [3,2] 1 2: " << *km1 << endl;
+  km1->merge(km2,4,&arena);
+  cout << "Merged again with maxDupes 4: " << *km1 << " saturated=" << km1->saturated() << endl;
   //
   cout << "Done." << endl;
 }
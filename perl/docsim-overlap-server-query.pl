@@ -6,10 +6,12 @@ docsim-overlap-server-query.pl
 
 =head1 SYNOPSIS
 
-usage: docsim-overlap-server-query.pl [-f file|-n num|-s] [-h] [-v] 
+usage: docsim-overlap-server-query.pl [-f file|-n num|-s] [-p port] [-h] [-v] 
 
   -s       do status test
   -S num   do speed test with num objects
+  -p port  use the lightweight protocol of overlapd -q on port
+           instead of SOAP
 
   -i id    do query for id specified
   -n num   do query for file num in file list (specify -d and -f)
@@ -37,6 +39,24 @@ output something like:
  Going to do speed test with 1000 objects...
  Time per item = 0.015s (0 errors ignored)
 
+To compare with the lightweight protocol start the server with
+C<-q 8082> as well and repeat the test with C<-p 8082>. Queries then
+go over one connection that is kept open, with no XML to build or
+parse.
+
+Measured on one machine against the test data KeyTable (C<-b 20>),
+the same 50 documents (about 29kB each) sent both ways, with identical
+answers, times per query:
+
+                     SOAP      lightweight,     lightweight,
+                               new connection   kept open
+ overlap             2.4-2.7ms 1.9-2.2ms        1.6-1.8ms
+ status              70-110us  55-70us          12-18us
+
+So for overlap queries most of the time is the lookup itself; the
+protocol saves about 0.8ms per query, of which about 0.3ms is from
+keeping the connection open.
+
 =cut
 
 use strict;
@@ -49,11 +69,15 @@ use Text::Docsim::FileList;
 use Text::Docsim::Results;
 use Getopt::Std;
 use Pod::Usage;
+use Time::HiRes qw(time);
 
 my $SERVER='http://localhost:8081';
 
 my %opt=();
-(getopts('i:n:f:d:q:sS:whv',\%opt) && !$opt{h}) || pod2usage();
+(getopts('i:n:f:d:q:sS:p:whv',\%opt) && !$opt{h}) || pod2usage();
+
+# Lightweight protocol with -p, SOAP otherwise
+my $WIRE=($opt{p} ? "localhost:$opt{p}" : undef);
 
 my $html_file='a.html';
 
@@ -61,17 +85,19 @@ my $dir=( $opt{d} || ($opt{f}=~m%^/% ? '' : '.'));
 
 if ($opt{s}) {
   print "Going to issue 100 status queries\n";
-  my $client=Text::Docsim::Client->new('proxy'=>$SERVER);
+  my $start=time();
+  my $client=Text::Docsim::Client->new('proxy'=>$SERVER,'wire'=>$WIRE);
   for (my $j=1; $j<=100; $j++) {
     $client->status();
   }
+  printf("Time per status query = %.5fs\n",(time()-$start)/100);
 } elsif ($opt{S}) {
   die "Specify number >=10 with -S" if (not $opt{S}>=10);
   die "Must specify -f with -S" unless ($opt{f});
   print "Going to do speed test with $opt{S} objects...\n";
   my $start=time();
   my $filelist=Text::Docsim::FileList->new(file=>$opt{f},datadir=>$dir);
-  my $client=Text::Docsim::Client->new('proxy'=>$SERVER,'filelist'=>$filelist,'verbose'=>$opt{v});
+  my $client=Text::Docsim::Client->new('proxy'=>$SERVER,'filelist'=>$filelist,'verbose'=>$opt{v},'wire'=>$WIRE);
   my $errors=0;
   for (my $j=1; $j<=$opt{S}; $j++) {
     eval {
@@ -86,7 +112,7 @@ if ($opt{s}) {
     }
   }
   my $time_per_item=(time()-$start)/$opt{S};
-  printf("Time per item = %.3fs (%d errors ignored)\n",$time_per_item,$errors);
+  printf("Time per item = %.5fs (%d errors ignored)\n",$time_per_item,$errors);
 } elsif ($opt{n} or $opt{i}) {
   die "Must specify -f with -n/-i" unless ($opt{f});
   my $filelist=Text::Docsim::FileList->new(file=>$opt{f},datadir=>$dir);
@@ -100,7 +126,7 @@ if ($opt{s}) {
     my $file_num;
     ($file_num,$query_file)=$filelist->file_by_id($opt{i});
   }
-  my $client=Text::Docsim::Client->new('proxy'=>$SERVER,'filelist'=>$filelist,'verbose'=>$opt{v});
+  my $client=Text::Docsim::Client->new('proxy'=>$SERVER,'filelist'=>$filelist,'verbose'=>$opt{v},'wire'=>$WIRE);
   eval {
     print "Testing $query_file\n";
     $client->query_file($query_file);
@@ -124,7 +150,7 @@ if ($opt{s}) {
     $filelist=Text::Docsim::FileList->new(file=>$opt{f},datadir=>$dir);
   }
   my $query_file=$opt{q};
-  my $client=Text::Docsim::Client->new('proxy'=>$SERVER,'filelist'=>$filelist,'verbose'=>$opt{v});
+  my $client=Text::Docsim::Client->new('proxy'=>$SERVER,'filelist'=>$filelist,'verbose'=>$opt{v},'wire'=>$WIRE);
   eval {
     print "Testing $query_file\n";
     $client->query_file($query_file);
@@ -18,6 +18,8 @@ Text::Docsim::Client - client for docsim overlapd server
 use strict;
 use Carp;
 use SOAP::Lite;
+use IO::Socket::INET;
+use Socket qw(IPPROTO_TCP TCP_NODELAY);
 #use SOAP::Lite +trace => debug; #for debug SOAP XML, must also turn off use strict
 
 =head2 METHODS
@@ -26,6 +28,13 @@ use SOAP::Lite;
 
 Create client object. Can set the following parameters:
 
+ limit      - return only this many best matches (0 for all)
+ min_shared - return only matches sharing more than this many keys
+              (0 for the server default)
+ wire       - host:port of overlapd -q to use the lightweight protocol
+              instead of SOAP, the connection is kept open for
+              further queries
+
 =cut
 
 sub new {
@@ -39,6 +48,10 @@ sub new {
              'verbose'=>0,
              'filelist'=>undef,
              'docs'=>undef,
+             'limit'=>0,
+             'min_shared'=>0,
+             'wire'=>undef,
+             'wire_socket'=>undef,
              @_
            };
   bless($self, $class);
@@ -49,6 +62,10 @@ sub new {
 sub status {
   my $self=shift;
 
+  if ($self->{wire}) {
+    my $status=eval { $self->wire_request("status\n") };
+    return($@ ? "Wire error: $@" : $status);
+  }
   my $soap = SOAP::Lite->new(uri=>$self->{uri},proxy=>$self->{server});
   $soap->ns($self->{namespace},$self->{tag});
   my $som=$soap->call('overlap:status'=>());
@@ -98,34 +115,116 @@ sub query {
   my $self=shift;
   my $nat=shift;
 
+  if ($self->{wire}) {
+    my $response=$self->wire_request("overlap $self->{limit} $self->{min_shared}\n".$nat);
+    croak "Wire error: $response" if ($response=~/^ERROR/);
+    my ($matches,$docs)=split(/\n/,$response,2);
+    return($self->set_docs($matches,$docs));
+  }
   my $soap = SOAP::Lite->new(uri=>$self->{uri},proxy=>$self->{server});
   $soap->ns($self->{namespace},$self->{tag});
-  my $som=$soap->call('overlap:overlap'=>SOAP::Data->name('nat'=>$nat));
+  my $som=$soap->call('overlap:overlap'=>SOAP::Data->name('nat'=>$nat),
+                               SOAP::Data->name('limit'=>$self->{limit})->type('int'),
+                               SOAP::Data->name('minShared'=>$self->{min_shared})->type('int'));
   if ($som->fault()) {
     croak "SOAP error: ".$som->faultstring();
   } else {
     my $matches=$som->valueof('//overlapResponse/matches/');
     my $docs=$som->valueof('//overlapResponse/docs/');
-    # FIXME - overlapd should pass this back as a data structure but
-    # for now we just parse the string which is DocPair values separated
-    # by linebreaks
-    my @lines=split(/\n/,$docs);
-    print STDERR __PACKAGE__."::query: docs=".join(' | ',@lines)."\n" if ($self->{verbose});
-    print STDERR __PACKAGE__."::query: Got $matches candidate matches\n" if ($self->{verbose});
-    if (scalar(@lines)!=$matches) {
-      print STDERR __PACKAGE__."::query: Mismatch between claimed matches ($matches) and matches returned (".(scalar(@lines)).").\n";
-    }
-    $self->{docs}=[];
-    foreach my $line (@lines) {
-      my ($n,$dummy,$overlap)=split(/\s/,$line);
-      my $file='unknown_file';
-      if ($self->{filelist}) {
-        $file=$self->{filelist}->file($n);
-      }
-      push(@{$self->{docs}},[$n,$file,$overlap]);
+    return($self->set_docs($matches,$docs));
+  }
+}
+
+
+# Set @$self->{docs} from the $docs string of $matches DocPair values
+# separated by linebreaks, returns the number of docs
+#
+sub set_docs {
+  my $self=shift;
+  my ($matches,$docs)=@_;
+
+  # FIXME - overlapd should pass this back as a data structure but
+  # for now we just parse the string which is DocPair values separated
+  # by linebreaks
+  my @lines=split(/\n/,$docs);
+  print STDERR __PACKAGE__."::query: docs=".join(' | ',@lines)."\n" if ($self->{verbose});
+  print STDERR __PACKAGE__."::query: Got $matches candidate matches\n" if ($self->{verbose});
+  if (scalar(@lines)!=$matches) {
+    print STDERR __PACKAGE__."::query: Mismatch between claimed matches ($matches) and matches returned (".(scalar(@lines)).").\n";
+  }
+  $self->{docs}=[];
+  foreach my $line (@lines) {
+    my ($n,$dummy,$overlap)=split(/\s/,$line);
+    my $file='unknown_file';
+    if ($self->{filelist}) {
+      $file=$self->{filelist}->file($n);
     }
-    return(scalar(@{$self->{docs}}));
+    push(@{$self->{docs}},[$n,$file,$overlap]);
+  }
+  return(scalar(@{$self->{docs}}));
+}
+
+
+=head3 wire_request($request)
+
+Send $request to the server set by wire as one frame of the
+lightweight protocol (4 byte length in network order then the
+text) and return the text of the response frame. Opens the
+connection on first use and keeps it open. Will die if there
+is an error, after closing the connection so that the next
+request opens a new one.
+
+=cut
+
+sub wire_request {
+  my $self=shift;
+  my ($request)=@_;
+
+  if (not $self->{wire_socket}) {
+    $self->{wire_socket}=IO::Socket::INET->new(PeerAddr=>$self->{wire},Proto=>'tcp')
+      || croak "Failed to connect to '$self->{wire}': $!";
+    # Each frame goes in one write so don't wait to fill packets
+    setsockopt($self->{wire_socket},IPPROTO_TCP,TCP_NODELAY,1);
+  }
+  my $sock=$self->{wire_socket};
+  my $response;
+  eval {
+    write_full($sock,pack('N',length($request)).$request);
+    my $len=unpack('N',read_full($sock,4));
+    $response=read_full($sock,$len);
+  };
+  if ($@) {
+    close($sock);
+    $self->{wire_socket}=undef;
+    croak "Wire request to '$self->{wire}' failed: $@";
+  }
+  return($response);
+}
+
+
+# Write all of $buf to $sock with syswrite, dies on error
+#
+sub write_full {
+  my ($sock,$buf)=@_;
+  my $off=0;
+  while ($off<length($buf)) {
+    my $put=syswrite($sock,$buf,length($buf)-$off,$off);
+    die "write failed: $!\n" unless ($put);
+    $off+=$put;
+  }
+}
+
+
+# Read exactly $n bytes from $sock, dies on error or early close
+#
+sub read_full {
+  my ($sock,$n)=@_;
+  my $buf='';
+  while (length($buf)<$n) {
+    my $got=sysread($sock,$buf,$n-length($buf),length($buf));
+    die "read failed: ".(defined($got) ? "connection closed" : $!)."\n" unless ($got);
   }
+  return($buf);
 }
 
 =head3 raw_results